@@ -0,0 +1,719 @@
+#include <sstream>
+#include <stdexcept>
+#include <typeinfo>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "checkpoint.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+#include "env.hpp"
+#include "cont.hpp"
+#include "pass.hpp"
+#include "lift.hpp"
+#include "scheduler.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+
+namespace {
+    const char magic[] = "MSDC";
+    const unsigned long version = 1;
+
+    // One byte before each saved object says what it is
+    typedef enum {
+        empty_tag,
+        extended_tag,
+        num_tag,
+        bool_tag,
+        fun_tag,
+        lifted_tag,
+        done_tag,
+        right_then_add_tag,
+        add_tag,
+        right_then_mult_tag,
+        mult_tag,
+        let_body_tag,
+        right_then_equals_tag,
+        equals_tag,
+        if_branch_tag,
+        arg_then_call_tag,
+        call_tag,
+        await_tag,
+        fold_tag,
+        fold_step_tag,
+        // Follows the last object
+        end_tag = 0xff
+    } tag_t;
+
+    // FNV-1a over the printed program, as a profile does
+    unsigned long program_fingerprint(PTR(Expr) program) {
+        unsigned long hash = 2166136261UL;
+        for (char c : program->to_string()) {
+            hash ^= (unsigned char)c;
+            hash = (hash * 16777619UL) & 0xffffffffUL;
+        }
+        return hash;
+    }
+
+    // Every node of the program in preorder, in the same child order as
+    // expr_children(), and where each one is
+    struct Numbering {
+        std::vector<PTR(Expr)> exprs;
+        std::unordered_map<Expr*, unsigned long> ids;
+        // Lifted closures, by the FunExpr holding them
+        std::unordered_map<Val*, unsigned long> lifted;
+
+        Numbering(PTR(Expr) program) {
+            std::vector<PTR(Expr)> todo = { program };
+            while (!todo.empty()) {
+                PTR(Expr) e = todo.back();
+                todo.pop_back();
+                ids[&*e] = exprs.size();
+                if (PTR(FunExpr) f = CAST(FunExpr)(e)) {
+                    if (f->lifted != nullptr)
+                        lifted[&*f->lifted] = exprs.size();
+                }
+                exprs.push_back(e);
+                std::vector<PTR(Expr)> kids = expr_children(e);
+                for (size_t i = kids.size(); i > 0; i--)
+                    todo.push_back(kids[i - 1]);
+            }
+        }
+    };
+
+    class Writer {
+    public:
+        std::string out;
+
+        Writer(Numbering &numbering) : numbering(numbering) { }
+
+        void number(unsigned long n) {
+            while (n >= 0x80) {
+                out.push_back((char)(n | 0x80));
+                n >>= 7;
+            }
+            out.push_back((char)n);
+        }
+
+        // Zigzag, so small negative numbers stay short
+        void signed_number(long n) {
+            number(n >= 0 ? 2 * n : -2 * n - 1);
+        }
+
+        void expr(PTR(Expr) const &e) {
+            if (e == nullptr) {
+                number(0);
+                return;
+            }
+            auto found = numbering.ids.find(&*e);
+            if (found == numbering.ids.end())
+                throw std::runtime_error("cannot checkpoint an expression outside the program");
+            number(found->second + 1);
+        }
+
+        // Each name is spelled out the first time only
+        void symbol(Symbol s) {
+            auto found = symbols.find(s);
+            if (found != symbols.end()) {
+                number(found->second + 1);
+                return;
+            }
+            number(0);
+            number(s.str().size());
+            out += s.str();
+            symbols.emplace(s, symbols.size());
+        }
+
+        template <typename T>
+        void ref(PTR(T) const &p) {
+            if (p == nullptr) {
+                number(0);
+                return;
+            }
+            auto found = objects.find(static_cast<Collectable*>(&*p));
+            if (found == objects.end())
+                throw std::runtime_error("cannot checkpoint this state");
+            number(found->second + 1);
+        }
+
+        // Saves `root` and everything it reaches, children before the
+        // objects pointing to them. Walked without recursion, since a
+        // deep recursion leaves a long chain of continuations
+        template <typename T>
+        void reach(PTR(T) const &root) {
+            if (root == nullptr)
+                return;
+            std::vector<std::pair<Collectable*, bool>> todo;
+            todo.push_back(std::make_pair(static_cast<Collectable*>(&*root), false));
+            std::vector<Collectable*> kids;
+            while (!todo.empty()) {
+                Collectable *obj = todo.back().first;
+                if (todo.back().second) {
+                    todo.pop_back();
+                    visiting.erase(obj);
+                    write_object(obj);
+                } else if (objects.count(obj)) {
+                    todo.pop_back();
+                } else {
+                    // Everything still being visited is above `obj`
+                    todo.back().second = true;
+                    visiting.insert(obj);
+                    kids.clear();
+                    obj->gc_children(kids);
+                    for (Collectable *kid : kids) {
+                        if (visiting.count(kid))
+                            throw std::runtime_error("cannot checkpoint a cycle");
+                        if (!objects.count(kid))
+                            todo.push_back(std::make_pair(kid, false));
+                    }
+                }
+            }
+        }
+
+    private:
+        Numbering &numbering;
+        std::unordered_map<Symbol, unsigned long> symbols;
+        std::unordered_map<Collectable*, unsigned long> objects;
+        std::unordered_set<Collectable*> visiting;
+
+        void tag(tag_t t) {
+            out.push_back((char)t);
+        }
+
+        void write_object(Collectable *obj) {
+            if (Env *env = dynamic_cast<Env*>(obj))
+                write_env(env);
+            else if (Val *val = dynamic_cast<Val*>(obj))
+                write_val(val);
+            else
+                write_cont(dynamic_cast<Cont*>(obj));
+            objects.emplace(obj, objects.size());
+        }
+
+        void write_env(Env *env) {
+            if (ExtendedEnv *x = dynamic_cast<ExtendedEnv*>(env)) {
+                tag(extended_tag);
+                symbol(x->name);
+                ref(x->val);
+                ref(x->rest);
+            } else {
+                tag(empty_tag);
+            }
+        }
+
+        void write_val(Val *val) {
+            if (NumVal *n = dynamic_cast<NumVal*>(val)) {
+                tag(num_tag);
+                signed_number(n->rep);
+            } else if (BoolVal *b = dynamic_cast<BoolVal*>(val)) {
+                tag(bool_tag);
+                number(b->rep);
+            } else if (typeid(*val) == typeid(FunVal)) {
+                FunVal *f = (FunVal *)val;
+                auto lifted = numbering.lifted.find(val);
+                if (lifted != numbering.lifted.end()) {
+                    tag(lifted_tag);
+                    number(lifted->second);
+                    return;
+                }
+                tag(fun_tag);
+                symbol(f->formal_arg);
+                expr(f->body);
+                ref(f->env);
+                number(f->stack_frame);
+            } else if (dynamic_cast<FutureVal*>(val) != nullptr) {
+                throw std::runtime_error("cannot checkpoint a future");
+            } else {
+                throw std::runtime_error("cannot checkpoint this value");
+            }
+        }
+
+        void write_cont(Cont *cont) {
+            if (dynamic_cast<DoneCont*>(cont) != nullptr) {
+                tag(done_tag);
+            } else if (RightThenAddCont *c = dynamic_cast<RightThenAddCont*>(cont)) {
+                tag(right_then_add_tag);
+                expr(c->rhs);
+                ref(c->env);
+                ref(c->rest);
+            } else if (AddCont *c = dynamic_cast<AddCont*>(cont)) {
+                tag(add_tag);
+                ref(c->lhs_val);
+                ref(c->rest);
+            } else if (RightThenMultCont *c = dynamic_cast<RightThenMultCont*>(cont)) {
+                tag(right_then_mult_tag);
+                expr(c->rhs);
+                ref(c->env);
+                ref(c->rest);
+            } else if (MultCont *c = dynamic_cast<MultCont*>(cont)) {
+                tag(mult_tag);
+                ref(c->lhs_val);
+                ref(c->rest);
+            } else if (LetBodyCont *c = dynamic_cast<LetBodyCont*>(cont)) {
+                tag(let_body_tag);
+                symbol(c->var);
+                expr(c->body);
+                ref(c->env);
+                ref(c->rest);
+            } else if (RightThenEqualsCont *c = dynamic_cast<RightThenEqualsCont*>(cont)) {
+                tag(right_then_equals_tag);
+                expr(c->rhs);
+                ref(c->env);
+                ref(c->rest);
+            } else if (EqualsCont *c = dynamic_cast<EqualsCont*>(cont)) {
+                tag(equals_tag);
+                ref(c->lhs_val);
+                ref(c->rest);
+            } else if (IfBranchCont *c = dynamic_cast<IfBranchCont*>(cont)) {
+                tag(if_branch_tag);
+                expr(c->then_part);
+                expr(c->else_part);
+                ref(c->env);
+                ref(c->rest);
+            } else if (ArgThenCallCont *c = dynamic_cast<ArgThenCallCont*>(cont)) {
+                tag(arg_then_call_tag);
+                expr(c->actual_arg);
+                ref(c->env);
+                ref(c->rest);
+            } else if (CallCont *c = dynamic_cast<CallCont*>(cont)) {
+                tag(call_tag);
+                ref(c->to_be_called_val);
+                ref(c->rest);
+            } else if (AwaitCont *c = dynamic_cast<AwaitCont*>(cont)) {
+                tag(await_tag);
+                ref(c->rest);
+            } else if (FoldCont *c = dynamic_cast<FoldCont*>(cont)) {
+                tag(fold_tag);
+                expr(c->fold);
+                number(c->vals.size());
+                for (PTR(Val) &val : c->vals)
+                    ref(val);
+                ref(c->env);
+                ref(c->rest);
+            } else if (FoldStepCont *c = dynamic_cast<FoldStepCont*>(cont)) {
+                tag(fold_step_tag);
+                ref(c->f);
+                number(c->applied);
+                signed_number(c->index);
+                signed_number(c->end);
+                ref(c->rest);
+            } else {
+                throw std::runtime_error("cannot checkpoint this state");
+            }
+        }
+    };
+
+    class Reader {
+    public:
+        Reader(Numbering &numbering, const std::string &in) : numbering(numbering), in(in) {
+            pos = 0;
+        }
+
+        bool at_end() {
+            return pos == in.size();
+        }
+
+        unsigned long number() {
+            unsigned long n = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                unsigned char c = byte();
+                n |= (unsigned long)(c & 0x7f) << shift;
+                if (!(c & 0x80))
+                    return n;
+            }
+            bad();
+            return 0;
+        }
+
+        long signed_number() {
+            unsigned long z = number();
+            return (z & 1) ? -(long)(z >> 1) - 1 : (long)(z >> 1);
+        }
+
+        unsigned char byte() {
+            if (pos >= in.size())
+                bad();
+            return (unsigned char)in[pos++];
+        }
+
+        std::string text(size_t length) {
+            if (length > in.size() - pos)
+                bad();
+            std::string s = in.substr(pos, length);
+            pos += length;
+            return s;
+        }
+
+        PTR(Expr) expr() {
+            unsigned long n = number();
+            if (n == 0)
+                return nullptr;
+            if (n > numbering.exprs.size())
+                bad();
+            return numbering.exprs[n - 1];
+        }
+
+        Symbol symbol() {
+            unsigned long n = number();
+            if (n > 0) {
+                if (n > symbols.size())
+                    bad();
+                return symbols[n - 1];
+            }
+            symbols.push_back(Symbol(text(number())));
+            return symbols.back();
+        }
+
+        int peek() {
+            if (pos >= in.size())
+                bad();
+            return (unsigned char)in[pos];
+        }
+
+        // `optional` allows a missing object, as in the registers
+        PTR(Env) env(bool optional = false) {
+            Object *obj = ref(optional);
+            if (obj == nullptr)
+                return nullptr;
+            if (obj->env == nullptr)
+                bad();
+            return obj->env;
+        }
+
+        PTR(Val) val(bool optional = false) {
+            Object *obj = ref(optional);
+            if (obj == nullptr)
+                return nullptr;
+            if (obj->val == nullptr)
+                bad();
+            return obj->val;
+        }
+
+        PTR(Cont) cont(bool optional = false) {
+            Object *obj = ref(optional);
+            if (obj == nullptr)
+                return nullptr;
+            if (obj->cont == nullptr)
+                bad();
+            return obj->cont;
+        }
+
+        void read_object() {
+            Object obj;
+            tag_t t = (tag_t)byte();
+            switch (t) {
+                case empty_tag:
+                    obj.env = Env::empty;
+                    break;
+                case extended_tag: {
+                    Symbol name = symbol();
+                    PTR(Val) v = val();
+                    obj.env = NEW(ExtendedEnv)(name, v, env());
+                    break;
+                }
+                case num_tag:
+                    obj.val = NEW(NumVal)((int)signed_number());
+                    break;
+                case bool_tag:
+                    obj.val = NEW(BoolVal)(number() != 0);
+                    break;
+                case fun_tag: {
+                    Symbol arg = symbol();
+                    PTR(Expr) body = some_expr();
+                    PTR(FunVal) f = NEW(FunVal)(arg, body, env());
+                    f->stack_frame = (number() != 0);
+                    obj.val = f;
+                    break;
+                }
+                case lifted_tag: {
+                    unsigned long n = number();
+                    if (n >= numbering.exprs.size())
+                        bad();
+                    PTR(FunExpr) f = CAST(FunExpr)(numbering.exprs[n]);
+                    if (f == nullptr || f->lifted == nullptr)
+                        bad();
+                    obj.val = f->lifted;
+                    break;
+                }
+                case done_tag:
+                    obj.cont = Cont::done;
+                    break;
+                case right_then_add_tag: {
+                    PTR(Expr) rhs = some_expr();
+                    PTR(Env) e = env();
+                    obj.cont = NEW(RightThenAddCont)(rhs, e, cont());
+                    break;
+                }
+                case add_tag: {
+                    PTR(Val) lhs = val();
+                    obj.cont = NEW(AddCont)(lhs, cont());
+                    break;
+                }
+                case right_then_mult_tag: {
+                    PTR(Expr) rhs = some_expr();
+                    PTR(Env) e = env();
+                    obj.cont = NEW(RightThenMultCont)(rhs, e, cont());
+                    break;
+                }
+                case mult_tag: {
+                    PTR(Val) lhs = val();
+                    obj.cont = NEW(MultCont)(lhs, cont());
+                    break;
+                }
+                case let_body_tag: {
+                    Symbol var = symbol();
+                    PTR(Expr) body = some_expr();
+                    PTR(Env) e = env();
+                    obj.cont = NEW(LetBodyCont)(var, body, e, cont());
+                    break;
+                }
+                case right_then_equals_tag: {
+                    PTR(Expr) rhs = some_expr();
+                    PTR(Env) e = env();
+                    obj.cont = NEW(RightThenEqualsCont)(rhs, e, cont());
+                    break;
+                }
+                case equals_tag: {
+                    PTR(Val) lhs = val();
+                    obj.cont = NEW(EqualsCont)(lhs, cont());
+                    break;
+                }
+                case if_branch_tag: {
+                    PTR(Expr) then_part = some_expr();
+                    PTR(Expr) else_part = some_expr();
+                    PTR(Env) e = env();
+                    obj.cont = NEW(IfBranchCont)(then_part, else_part, e, cont());
+                    break;
+                }
+                case arg_then_call_tag: {
+                    PTR(Expr) arg = some_expr();
+                    PTR(Env) e = env();
+                    obj.cont = NEW(ArgThenCallCont)(arg, e, cont());
+                    break;
+                }
+                case call_tag: {
+                    PTR(Val) f = val();
+                    obj.cont = NEW(CallCont)(f, cont());
+                    break;
+                }
+                case await_tag:
+                    obj.cont = NEW(AwaitCont)(cont());
+                    break;
+                case fold_tag: {
+                    PTR(FoldExpr) fold = CAST(FoldExpr)(some_expr());
+                    if (fold == nullptr)
+                        bad();
+                    unsigned long count = number();
+                    if (count > 3)
+                        bad();
+                    std::vector<PTR(Val)> vals;
+                    for (unsigned long i = 0; i < count; i++)
+                        vals.push_back(val());
+                    PTR(Env) e = env();
+                    obj.cont = NEW(FoldCont)(fold, vals, e, cont());
+                    break;
+                }
+                case fold_step_tag: {
+                    PTR(Val) f = val();
+                    bool applied = number() != 0;
+                    int index = (int)signed_number();
+                    int end = (int)signed_number();
+                    obj.cont = NEW(FoldStepCont)(f, applied, index, end, cont());
+                    break;
+                }
+                default:
+                    bad();
+            }
+            objects.push_back(obj);
+        }
+
+        [[noreturn]] void bad() {
+            throw std::runtime_error("bad checkpoint");
+        }
+
+    private:
+        struct Object {
+            PTR(Env) env;
+            PTR(Val) val;
+            PTR(Cont) cont;
+        };
+
+        Numbering &numbering;
+        const std::string &in;
+        size_t pos;
+        std::vector<Symbol> symbols;
+        std::vector<Object> objects;
+
+        Object *ref(bool optional) {
+            unsigned long n = number();
+            if (n == 0 && optional)
+                return nullptr;
+            if (n == 0 || n > objects.size())
+                bad();
+            return &objects[n - 1];
+        }
+
+        PTR(Expr) some_expr() {
+            PTR(Expr) e = expr();
+            if (e == nullptr)
+                bad();
+            return e;
+        }
+    };
+}
+
+std::string Checkpoint::save(PTR(Expr) program, const Step::Registers &state) {
+    Numbering numbering(program);
+    Writer out(numbering);
+    out.out = magic;
+    out.number(version);
+    out.number(program_fingerprint(program));
+    out.number(numbering.exprs.size());
+    out.reach(state.env);
+    out.reach(state.val);
+    out.reach(state.cont);
+    out.out.push_back((char)end_tag);
+    out.number(state.mode);
+    // The expression register is only read in interp_mode
+    if (state.mode == Step::interp_mode)
+        out.expr(state.expr);
+    else
+        out.number(0);
+    out.ref(state.env);
+    out.ref(state.val);
+    out.ref(state.cont);
+    return out.out;
+}
+
+void Checkpoint::load(PTR(Expr) program, const std::string &bytes, Step::Registers &state) {
+    Numbering numbering(program);
+    Reader in(numbering, bytes);
+    if (in.text(4) != magic || in.number() != version)
+        in.bad();
+    unsigned long fingerprint = in.number();
+    unsigned long size = in.number();
+    if (fingerprint != program_fingerprint(program) || size != numbering.exprs.size())
+        throw std::runtime_error("checkpoint does not match program");
+    while (in.peek() != end_tag)
+        in.read_object();
+    in.byte();
+    Step::Registers loaded;
+    unsigned long mode = in.number();
+    if (mode != Step::interp_mode && mode != Step::continue_mode)
+        in.bad();
+    loaded.mode = (Step::mode_t)mode;
+    loaded.expr = in.expr();
+    if (loaded.mode == Step::interp_mode && loaded.expr == nullptr)
+        in.bad();
+    loaded.env = in.env(true);
+    loaded.val = in.val(true);
+    loaded.cont = in.cont(true);
+    if (loaded.cont == nullptr || !in.at_end())
+        in.bad();
+    std::swap(state, loaded);
+}
+
+// Pauses `program` after `steps` steps and finishes it from a checkpoint
+// loaded against a fresh parse, as another process would
+static PTR(Val) checkpoint_finish(std::string program, long steps) {
+    PTR(Expr) e = parse_str(program);
+    Step::Registers state;
+    Step::start(state, e, Env::empty);
+    Step::resume(state, steps);
+    std::string bytes = Checkpoint::save(e, state);
+    state = Step::Registers();
+    e = nullptr;
+    PTR(Expr) again = parse_str(program);
+    Step::Registers loaded;
+    Checkpoint::load(again, bytes, loaded);
+    Step::resume(loaded, -1);
+    REQUIRE( Step::done(loaded) );
+    return loaded.val;
+}
+
+TEST_CASE( "Checkpoint" ) {
+    std::string count = "_let count = _fun (count) _fun (n) _if n == 0 _then 0 _else 1 + count(count)(n + -1) _in count(count)";
+    SECTION( "Every pause point" ) {
+        std::string programs[] = {
+            "_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1 _else fib(fib)(x + -1) + fib(fib)(x + -2) _in fib(fib)(6)",
+            "_let x = -3 _in _if x * x == 9 _then (x + 1) * -40000 _else _false",
+            "_let add = _fun (a) _fun (b) a + b _in add(2)",
+            "_let k = 5 _in _fold(_fun (a) _fun (i) _if i == 2 _then a _else a + i * k, 0, 0, 5)",
+            "_fold(_fun (a) _fun (i) _if i == 0 _then a _else a * 10 + i, 0, -3, 2)",
+            "(_fun (x) _fun (y) x == y)(_true)(_true)"
+        };
+        for (std::string &program : programs) {
+            PTR(Expr) e = parse_str(program);
+            Step::Registers state;
+            Step::start(state, e, Env::empty);
+            long total = Step::resume(state, -1);
+            std::string expected = state.val->to_string();
+            for (long steps = 0; steps <= total; steps++)
+                CHECK( checkpoint_finish(program, steps)->to_string() == expected );
+        }
+    }
+    SECTION( "Long chains" ) {
+        CHECK( checkpoint_finish(count + "(100000)", 600000)->equals(NEW(NumVal)(100000)) );
+    }
+    SECTION( "Lifted closures" ) {
+        std::string program = "_let f = _fun (x) x + 1 _in f(1) + f(2)";
+        PTR(Expr) e = lift(parse_str(program));
+        Step::Registers state;
+        Step::start(state, e, Env::empty);
+        Step::resume(state, 3);
+        std::string bytes = Checkpoint::save(e, state);
+        PTR(Expr) again = lift(parse_str(program));
+        Step::Registers loaded;
+        Checkpoint::load(again, bytes, loaded);
+        PTR(FunExpr) f = CAST(FunExpr)(CAST(LetExpr)(again)->rhs);
+        REQUIRE( f != nullptr );
+        CHECK( loaded.env->lookup(Symbol("f")) == f->lifted );
+        Step::resume(loaded, -1);
+        CHECK( loaded.val->equals(NEW(NumVal)(5)) );
+    }
+    SECTION( "Finished evaluations" ) {
+        PTR(Expr) e = parse_str("2 * 21");
+        Step::Registers state;
+        Step::start(state, e, Env::empty);
+        Step::resume(state, -1);
+        Step::Registers loaded;
+        Checkpoint::load(e, Checkpoint::save(e, state), loaded);
+        CHECK( Step::done(loaded) );
+        CHECK( loaded.val->equals(NEW(NumVal)(42)) );
+    }
+    SECTION( "Moving a task between schedulers" ) {
+        Scheduler first(100);
+        long id = first.add(parse_str(count + "(500)"));
+        for (int i = 0; i < 5; i++)
+            first.run_slice();
+        std::string bytes = first.checkpoint(id);
+        CHECK( first.steps(id) == 500 );
+        first.cancel(id);
+        Scheduler second(100);
+        long moved = second.resume(parse_str(count + "(500)"), bytes);
+        second.run();
+        CHECK( second.steps(moved) > 0 );
+        CHECK( second.take(moved)->equals(NEW(NumVal)(500)) );
+    }
+    SECTION( "Errors" ) {
+        PTR(Expr) e = parse_str(count + "(10)");
+        Step::Registers state;
+        Step::start(state, e, Env::empty);
+        Step::resume(state, 20);
+        std::string bytes = Checkpoint::save(e, state);
+        Step::Registers loaded;
+        CHECK_THROWS_WITH( Checkpoint::load(parse_str(count + "(11)"), bytes, loaded), "checkpoint does not match program" );
+        for (size_t length = 0; length < bytes.size(); length++)
+            CHECK_THROWS_WITH( Checkpoint::load(e, bytes.substr(0, length), loaded), "bad checkpoint" );
+        CHECK_THROWS_WITH( Checkpoint::load(e, bytes + "x", loaded), "bad checkpoint" );
+        CHECK_THROWS_WITH( Checkpoint::load(e, "XSDC" + bytes.substr(4), loaded), "bad checkpoint" );
+        CHECK( loaded.cont == nullptr );
+        CHECK_THROWS_WITH( Checkpoint::save(parse_str("1"), state), "cannot checkpoint an expression outside the program" );
+
+        PTR(Expr) spawn = parse_str("_let f = _spawn 1 _in (_await f) + 1");
+        Step::start(state, spawn, Env::empty);
+        Step::resume(state, 3);
+        CHECK_THROWS_WITH( Checkpoint::save(spawn, state), "cannot checkpoint a future" );
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef checkpoint_hpp
+#define checkpoint_hpp
+
+#include <string>
+#include "macros.hpp"
+#include "step.hpp"
+
+class Expr;
+
+/* Saves a paused step machine evaluation (see Step::start) as bytes, and
+ loads it back, possibly in another process, against the same program:
+ the same source put through the same passes. An Expr is saved as its
+ place in a preorder walk of `program`, so the bytes hold only a
+ fingerprint of the program, and loading against a different one throws
+ "checkpoint does not match program". Values, Envs and continuations
+ are saved whole, each once however many things point to it. Futures,
+ compiled closures and trees that are not part of `program`, such as one
+ copied for a _spawn, cannot be saved. */
+class Checkpoint {
+public:
+    static std::string save(PTR(Expr) program, const Step::Registers &state);
+    static void load(PTR(Expr) program, const std::string &bytes, Step::Registers &state);
+};
+
+#endif /* checkpoint_hpp */
@@ -0,0 +1,307 @@
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include "compile.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+#include "env.hpp"
+#include "step.hpp"
+#include "lift.hpp"
+#include "escape.hpp"
+#include "future.hpp"
+#include "fold.hpp"
+#include "jit.hpp"
+#include "profile.hpp"
+#include "parallel.hpp"
+#include "gc.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+
+// Names in scope at a point in the tree, innermost last
+typedef std::vector<Symbol> Scope;
+
+static Code compile_rec(PTR(Expr) e, Scope &scope);
+
+// Frames up from the innermost binding, or -1 for a free variable
+static int resolve(Symbol name, const Scope &scope) {
+    for (size_t i = scope.size(); i > 0; i--) {
+        if (scope[i - 1] == name)
+            return (int)(scope.size() - i);
+    }
+    return -1;
+}
+
+// Every frame compiled code makes is an ExtendedEnv, so a resolved
+// variable is found by counting frames instead of comparing names
+static PTR(Val) const &frame_val(Env *env, int depth) {
+    for (int i = 0; i < depth; i++)
+        env = &*static_cast<ExtendedEnv *>(env)->rest;
+    return static_cast<ExtendedEnv *>(env)->val;
+}
+
+static Code compile_var(Symbol name, Scope &scope) {
+    int depth = resolve(name, scope);
+    if (depth < 0) {
+        return [name](PTR(Env) const &) -> PTR(Val) {
+            throw std::runtime_error("free variable: " + name.str());
+        };
+    }
+    if (depth == 0) {
+        return [](PTR(Env) const &env) -> PTR(Val) {
+            return static_cast<ExtendedEnv *>(&*env)->val;
+        };
+    }
+    return [depth](PTR(Env) const &env) -> PTR(Val) {
+        return frame_val(&*env, depth);
+    };
+}
+
+// Compiles +, * and ==. `fast` does the work when both operands are
+// numbers and `slow` is the ordinary Val method otherwise. A variable
+// compared with or combined with a literal, the `n + -1` and `n == 0`
+// of most loops, reads its frame slot directly
+template <class Fast, class Slow>
+static Code compile_binary(PTR(Expr) lhs, PTR(Expr) rhs, Scope &scope, Fast fast, Slow slow) {
+    PTR(VarExpr) lhs_var = CAST(VarExpr)(lhs);
+    PTR(NumExpr) rhs_num = CAST(NumExpr)(rhs);
+    int depth = (lhs_var != nullptr) ? resolve(lhs_var->name, scope) : -1;
+    if (depth >= 0 && rhs_num != nullptr) {
+        int c = rhs_num->rep;
+        PTR(Val) c_val = rhs_num->val;
+        return [depth, c, c_val, fast, slow](PTR(Env) const &env) -> PTR(Val) {
+            PTR(Val) const &v = frame_val(&*env, depth);
+            if (NumVal *n = as_num(v))
+                return fast(n->rep, c);
+            return slow(v, c_val);
+        };
+    }
+    Code lhs_code = compile_rec(lhs, scope);
+    Code rhs_code = compile_rec(rhs, scope);
+    return [lhs_code, rhs_code, fast, slow](PTR(Env) const &env) -> PTR(Val) {
+        PTR(Val) l = lhs_code(env);
+        PTR(Val) r = rhs_code(env);
+        NumVal *a = as_num(l);
+        NumVal *b = as_num(r);
+        if (a != nullptr && b != nullptr)
+            return fast(a->rep, b->rep);
+        return slow(l, r);
+    };
+}
+
+static Code compile_rec(PTR(Expr) e, Scope &scope) {
+    if (PTR(NumExpr) n = CAST(NumExpr)(e)) {
+        PTR(Val) val = n->val;
+        return [val](PTR(Env) const &) { return val; };
+    }
+    if (PTR(BoolExpr) b = CAST(BoolExpr)(e)) {
+        PTR(Val) val = NEW(BoolVal)(b->rep);
+        return [val](PTR(Env) const &) { return val; };
+    }
+    if (PTR(VarExpr) v = CAST(VarExpr)(e))
+        return compile_var(v->name, scope);
+    if (PTR(AddExpr) a = CAST(AddExpr)(e)) {
+        return compile_binary(a->lhs, a->rhs, scope,
+                              [](int x, int y) -> PTR(Val) { return NEW(NumVal)((unsigned)x + (unsigned)y); },
+                              [](PTR(Val) const &x, PTR(Val) const &y) { return x->add_to(y); });
+    }
+    if (PTR(MultExpr) m = CAST(MultExpr)(e)) {
+        return compile_binary(m->lhs, m->rhs, scope,
+                              [](int x, int y) -> PTR(Val) { return NEW(NumVal)((unsigned)x * (unsigned)y); },
+                              [](PTR(Val) const &x, PTR(Val) const &y) { return x->mult_with(y); });
+    }
+    if (PTR(EqualExpr) q = CAST(EqualExpr)(e)) {
+        PTR(Val) true_val = NEW(BoolVal)(true);
+        PTR(Val) false_val = NEW(BoolVal)(false);
+        return compile_binary(q->lhs, q->rhs, scope,
+                              [true_val, false_val](int x, int y) { return (x == y) ? true_val : false_val; },
+                              [](PTR(Val) const &x, PTR(Val) const &y) -> PTR(Val) { return NEW(BoolVal)(x->equals(y)); });
+    }
+    if (PTR(LetExpr) l = CAST(LetExpr)(e)) {
+        Symbol name = l->name;
+        bool stack_frame = l->stack_frame;
+        Code rhs_code = compile_rec(l->rhs, scope);
+        scope.push_back(name);
+        Code body_code = compile_rec(l->body, scope);
+        scope.pop_back();
+        return [name, stack_frame, rhs_code, body_code](PTR(Env) const &env) -> PTR(Val) {
+            PTR(Val) rhs_val = rhs_code(env);
+            if (stack_frame) {
+                ExtendedEnv frame(name, rhs_val, env);
+                return body_code(BORROW(Env, frame));
+            }
+            return body_code(NEW(ExtendedEnv)(name, rhs_val, env));
+        };
+    }
+    if (PTR(IfExpr) i = CAST(IfExpr)(e)) {
+        Code test_code = compile_rec(i->test_part, scope);
+        Code then_code = compile_rec(i->then_part, scope);
+        Code else_code = compile_rec(i->else_part, scope);
+        return [test_code, then_code, else_code](PTR(Env) const &env) -> PTR(Val) {
+            PTR(Val) test = test_code(env);
+            bool took_then;
+            if (typeid(*test) == typeid(BoolVal))
+                took_then = static_cast<BoolVal *>(&*test)->rep;
+            else
+                took_then = test->is_true();
+            return took_then ? then_code(env) : else_code(env);
+        };
+    }
+    if (PTR(FunExpr) f = CAST(FunExpr)(e)) {
+        Symbol arg = f->formal_arg;
+        PTR(Expr) body = f->body;
+        bool stack_frame = f->stack_frame;
+        // Shared with interp(), so a function hot in either is compiled
+        // to native code once
+        if (JitEntry::enabled && f->jit == nullptr)
+            f->jit = NEW(JitEntry)(arg, body);
+        PTR(JitEntry) jit = f->jit;
+        if (f->lifted != nullptr) {
+            // Nothing from outside is used, so the one closure is made now
+            Scope own = { arg };
+            PTR(SharedCode) code = NEW(SharedCode)(compile_rec(body, own));
+            PTR(FunVal) closure = NEW(CompiledFunVal)(arg, body, code, Env::empty);
+            closure->stack_frame = stack_frame;
+            closure->jit = jit;
+            PTR(Val) val = closure;
+            return [val](PTR(Env) const &) { return val; };
+        }
+        scope.push_back(arg);
+        PTR(SharedCode) code = NEW(SharedCode)(compile_rec(body, scope));
+        scope.pop_back();
+        return [arg, body, code, stack_frame, jit](PTR(Env) const &env) -> PTR(Val) {
+            PTR(FunVal) closure = NEW(CompiledFunVal)(arg, body, code, env);
+            closure->stack_frame = stack_frame;
+            closure->jit = jit;
+            return closure;
+        };
+    }
+    if (PTR(CallExpr) c = CAST(CallExpr)(e)) {
+        Code fun_code = compile_rec(c->to_be_called, scope);
+        Code arg_code = compile_rec(c->actual_arg, scope);
+        return [fun_code, arg_code](PTR(Env) const &env) -> PTR(Val) {
+            PTR(Val) fun = fun_code(env);
+            return fun->call(arg_code(env));
+        };
+    }
+    if (PTR(SpawnExpr) s = CAST(SpawnExpr)(e)) {
+        // The pool interprets the tree, looking names up in the copied
+        // frames
+        PTR(Expr) expr = s->expr;
+        return [expr](PTR(Env) const &env) -> PTR(Val) {
+            return NEW(FutureVal)(Future::spawn(expr, env, false));
+        };
+    }
+    if (PTR(AwaitExpr) w = CAST(AwaitExpr)(e)) {
+        Code future_code = compile_rec(w->expr, scope);
+        return [future_code](PTR(Env) const &env) -> PTR(Val) {
+            return FutureVal::await(future_code(env));
+        };
+    }
+    if (PTR(FoldExpr) f = CAST(FoldExpr)(e)) {
+        Code fun_code = compile_rec(f->fun, scope);
+        Code init_code = compile_rec(f->init, scope);
+        Code lo_code = compile_rec(f->lo, scope);
+        Code hi_code = compile_rec(f->hi, scope);
+        return [fun_code, init_code, lo_code, hi_code](PTR(Env) const &env) -> PTR(Val) {
+            PTR(Val) fun = fun_code(env);
+            PTR(Val) init = init_code(env);
+            PTR(Val) lo = lo_code(env);
+            return Fold::run(fun, init, lo, hi_code(env));
+        };
+    }
+    throw std::runtime_error("compile: unknown expression");
+}
+
+Code compile(PTR(Expr) e) {
+    Scope scope;
+    return compile_rec(e, scope);
+}
+
+PTR(Val) interp_compiled(PTR(Expr) e) {
+    return compile(e)(Env::empty);
+}
+
+namespace {
+    // Keeps Step::interp_depth right when a call throws
+    struct DepthGuard {
+        DepthGuard() { Step::interp_depth++; }
+        ~DepthGuard() { Step::interp_depth--; }
+    };
+}
+
+SharedCode::SharedCode(Code run) {
+    this->run = run;
+}
+
+CompiledFunVal::CompiledFunVal(Symbol arg, PTR(Expr) body, PTR(SharedCode) code, PTR(Env) env)
+: FunVal(arg, body, env) {
+    this->code = code;
+}
+
+// Hot integer functions go to native code and deep calls to the step
+// machine, the same way FunVal::call does. The step machine works because
+// compiled frames are named ExtendedEnvs
+PTR(Val) CompiledFunVal::call(PTR(Val) actual_arg) {
+    GC::safe_point();
+    Future::poll();
+    if (jit != nullptr && Profile::current == nullptr && !Parallel::may_fork()) {
+        PTR(Val) result;
+        if (jit->try_call(env, actual_arg, result))
+            return result;
+    }
+    if (Step::interp_depth >= Step::max_interp_depth)
+        return Step::interp_by_steps(body, NEW(ExtendedEnv)(formal_arg, actual_arg, env), -1);
+    DepthGuard guard;
+    if (stack_frame) {
+        ExtendedEnv frame(formal_arg, actual_arg, env);
+        return code->run(BORROW(Env, frame));
+    }
+    return code->run(NEW(ExtendedEnv)(formal_arg, actual_arg, env));
+}
+
+TEST_CASE( "Compile" ) {
+    SECTION( "Same result as interp" ) {
+        std::string programs[] = {
+            "1 + 2 * 3",
+            "_let x = 5 _in _let y = x + 1 _in x * y",
+            "_let x = 1 _in _let y = 2 _in _let z = 3 _in x + y * z",
+            "_if 1 == 1 _then _true _else _false",
+            "_let x = 1 _in _let x = 2 _in x",
+            "_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1 _else fib(fib)(x + -1) + fib(fib)(x + -2) _in fib(fib)(10)",
+            "_let add = _fun (a) _fun (b) a + b _in _let inc = add(1) _in inc(inc(5))",
+            "(_fun (x) _fun (y) x * y)(6)(7)",
+            "_let f = _fun (x) x _in f",
+            "1 == _true",
+            "_let y = 2 _in (_fun (x) x + y)(3)",
+            "_let y = 2 _in _let f = _spawn (_fun (x) x + y)(3) _in _await f * y",
+            "_let k = 3 _in _fold(_fun (a) _fun (i) _if i == k _then a _else a + i * k, 1, 0, 10)"
+        };
+        for (std::string program : programs) {
+            PTR(Expr) e = parse_str(program);
+            CHECK( interp_compiled(e)->equals(e->interp(NEW(EmptyEnv)())) );
+            PTR(Expr) marked = escape_analysis(lift(e));
+            CHECK( interp_compiled(marked)->equals(e->interp(NEW(EmptyEnv)())) );
+        }
+        CHECK( interp_compiled(parse_str("_let f = _fun (x) x + 1 _in f"))->to_string()
+              == "_fun (x) (x + 1)" );
+    }
+    SECTION( "Errors" ) {
+        CHECK_THROWS_WITH( interp_compiled(parse_str("x + 1")), "free variable: x" );
+        CHECK_THROWS_WITH( interp_compiled(parse_str("_let x = _true _in x + 1")), "no adding booleans" );
+        CHECK_THROWS_WITH( interp_compiled(parse_str("_if 1 _then 2 _else 3")), "numbers cannot be true/false" );
+        CHECK_THROWS_WITH( interp_compiled(parse_str("1(2)")), "cannot call on a number" );
+        // Only evaluated variables have to be bound
+        CHECK( interp_compiled(parse_str("_if _false _then x _else 3"))->equals(NEW(NumVal)(3)) );
+    }
+    SECTION( "Deep recursion" ) {
+        PTR(Expr) count = parse_str("_let count = _fun (count) _fun (n) _if n == 0 _then 0 _else 1 + count(count)(n + -1) _in count(count)(100000)");
+        CHECK( interp_compiled(escape_analysis(lift(count)))->equals(NEW(NumVal)(100000)) );
+        CHECK( Step::interp_depth == 0 );
+    }
+    SECTION( "Compiled closures in the step machine" ) {
+        PTR(Val) add = interp_compiled(parse_str("_fun (a) _fun (b) a + b"));
+        PTR(Expr) call = NEW(CallExpr)(NEW(CallExpr)(NEW(VarExpr)("add"), NEW(NumExpr)(2)), NEW(NumExpr)(3));
+        CHECK( Step::interp_by_steps(call, NEW(ExtendedEnv)("add", add, NEW(EmptyEnv)()), -1)
+              ->equals(NEW(NumVal)(5)) );
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef compile_hpp
+#define compile_hpp
+
+#include <functional>
+#include <vector>
+#include "macros.hpp"
+#include "value.hpp"
+
+class Expr;
+class Env;
+
+// Compiled code for one Expr: call it with the Env its variables live in
+typedef std::function<PTR(Val)(PTR(Env) const &env)> Code;
+
+// Closure compilation. Walks the tree once and turns every node into a
+// Code object with its children already compiled, its constants already
+// made and each variable resolved to how many frames up it lives, so
+// running it never looks at an Expr or compares a name. Frames are
+// ordinary ExtendedEnvs, so compiled closures can still be called by the
+// step machine
+Code compile(PTR(Expr) e);
+
+// Compiles `e` and runs it in an empty Env
+PTR(Val) interp_compiled(PTR(Expr) e);
+
+// The compiled body of a _fun, shared by every closure made from it
+class SharedCode ENABLE_THIS(SharedCode) {
+public:
+    Code run;
+    
+    SharedCode(Code run);
+};
+
+// A closure made by compiled code; calls run the compiled body
+class CompiledFunVal : public FunVal {
+public:
+    PTR(SharedCode) code;
+    
+    CompiledFunVal(Symbol arg, PTR(Expr) body, PTR(SharedCode) code, PTR(Env) env);
+    PTR(Val) call(PTR(Val) actual_arg);
+};
+
+#endif /* compile_hpp */
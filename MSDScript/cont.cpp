@@ -3,8 +3,10 @@
 #include "step.hpp"
 #include "value.hpp"
 #include "env.hpp"
+#include "expr.hpp"
+#include "fold.hpp"
 
-PTR(Cont) Cont::done = NEW(DoneCont)();
+PTR(Cont) Cont::done = IMMORTAL(NEW(DoneCont)());
 
 DoneCont::DoneCont() { }
 
@@ -19,11 +21,12 @@ RightThenAddCont::RightThenAddCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest)
 }
 
 void RightThenAddCont::step_continue() {
-    PTR(Val) lhs_val = Step::val;
-    Step::mode = Step::interp_mode;
-    Step::expr = rhs;
-    Step::env = env;
-    Step::cont = NEW(AddCont)(lhs_val, rest);
+    Step::Registers &regs = *Step::regs;
+    PTR(Val) lhs_val = regs.val;
+    regs.mode = Step::interp_mode;
+    regs.expr = rhs;
+    regs.env = env;
+    regs.cont = NEW(AddCont)(lhs_val, rest);
 }
 
 AddCont::AddCont(PTR(Val) lhs_val, PTR(Cont) rest) {
@@ -32,10 +35,11 @@ AddCont::AddCont(PTR(Val) lhs_val, PTR(Cont) rest) {
 }
 
 void AddCont::step_continue() {
-    PTR(Val) rhs_val = Step::val;
-    Step::mode = Step::continue_mode;
-    Step::val = lhs_val->add_to(rhs_val);
-    Step::cont = rest;
+    Step::Registers &regs = *Step::regs;
+    PTR(Val) rhs_val = regs.val;
+    regs.mode = Step::continue_mode;
+    regs.val = lhs_val->add_to(rhs_val);
+    regs.cont = rest;
 }
 
 RightThenMultCont::RightThenMultCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest) {
@@ -45,11 +49,12 @@ RightThenMultCont::RightThenMultCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest
 }
 
 void RightThenMultCont::step_continue() {
-    PTR(Val) lhs_val = Step::val;
-    Step::mode = Step::interp_mode;
-    Step::expr = rhs;
-    Step::env = env;
-    Step::cont = NEW(MultCont)(lhs_val, rest);
+    Step::Registers &regs = *Step::regs;
+    PTR(Val) lhs_val = regs.val;
+    regs.mode = Step::interp_mode;
+    regs.expr = rhs;
+    regs.env = env;
+    regs.cont = NEW(MultCont)(lhs_val, rest);
 }
 
 MultCont::MultCont(PTR(Val) lhs_val, PTR(Cont) rest) {
@@ -58,13 +63,14 @@ MultCont::MultCont(PTR(Val) lhs_val, PTR(Cont) rest) {
 }
 
 void MultCont::step_continue() {
-    PTR(Val) rhs_val = Step::val;
-    Step::mode = Step::continue_mode;
-    Step::val = lhs_val->mult_with(rhs_val);
-    Step::cont = rest;
+    Step::Registers &regs = *Step::regs;
+    PTR(Val) rhs_val = regs.val;
+    regs.mode = Step::continue_mode;
+    regs.val = lhs_val->mult_with(rhs_val);
+    regs.cont = rest;
 }
 
-LetBodyCont::LetBodyCont(std::string var, PTR(Expr) body, PTR(Env) env, PTR(Cont) rest) {
+LetBodyCont::LetBodyCont(Symbol var, PTR(Expr) body, PTR(Env) env, PTR(Cont) rest) {
     this->var = var;
     this->body = body;
     this->env = env;
@@ -72,10 +78,11 @@ LetBodyCont::LetBodyCont(std::string var, PTR(Expr) body, PTR(Env) env, PTR(Cont
 }
 
 void LetBodyCont::step_continue() {
-    Step::mode = Step::interp_mode;
-    Step::expr = body;
-    Step::env = NEW(ExtendedEnv)(var, Step::val, env);
-    Step::cont = rest;
+    Step::Registers &regs = *Step::regs;
+    regs.mode = Step::interp_mode;
+    regs.expr = body;
+    regs.env = NEW(ExtendedEnv)(var, regs.val, env);
+    regs.cont = rest;
 }
 
 RightThenEqualsCont::RightThenEqualsCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest) {
@@ -85,11 +92,12 @@ RightThenEqualsCont::RightThenEqualsCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont)
 }
 
 void RightThenEqualsCont::step_continue() {
-    PTR(Val) lhs_val = Step::val;
-    Step::mode = Step::interp_mode;
-    Step::expr = rhs;
-    Step::env = env;
-    Step::cont = NEW(EqualsCont)(lhs_val, rest);
+    Step::Registers &regs = *Step::regs;
+    PTR(Val) lhs_val = regs.val;
+    regs.mode = Step::interp_mode;
+    regs.expr = rhs;
+    regs.env = env;
+    regs.cont = NEW(EqualsCont)(lhs_val, rest);
 }
 
 EqualsCont::EqualsCont(PTR(Val) lhs_val, PTR(Cont) rest) {
@@ -98,10 +106,11 @@ EqualsCont::EqualsCont(PTR(Val) lhs_val, PTR(Cont) rest) {
 }
 
 void EqualsCont::step_continue() {
-    PTR(Val) rhs_val = Step::val;
-    Step::mode = Step::continue_mode;
-    Step::val = NEW(BoolVal)(lhs_val->equals(rhs_val));
-    Step::cont = rest;
+    Step::Registers &regs = *Step::regs;
+    PTR(Val) rhs_val = regs.val;
+    regs.mode = Step::continue_mode;
+    regs.val = NEW(BoolVal)(lhs_val->equals(rhs_val));
+    regs.cont = rest;
 }
 
 IfBranchCont::IfBranchCont(PTR(Expr) then_part, PTR(Expr) else_part, PTR(Env) env, PTR(Cont) rest) {
@@ -112,15 +121,16 @@ IfBranchCont::IfBranchCont(PTR(Expr) then_part, PTR(Expr) else_part, PTR(Env) en
 }
 
 void IfBranchCont::step_continue() {
-    PTR(Val) test_val = Step::val;
-    Step::mode = Step::interp_mode;
+    Step::Registers &regs = *Step::regs;
+    PTR(Val) test_val = regs.val;
+    regs.mode = Step::interp_mode;
     if (test_val->is_true()) {
-        Step::expr = then_part;
+        regs.expr = then_part;
     } else {
-        Step::expr = else_part;
+        regs.expr = else_part;
     }
-    Step::env = env;
-    Step::cont = rest;
+    regs.env = env;
+    regs.cont = rest;
 }
 
 ArgThenCallCont::ArgThenCallCont(PTR(Expr) actual_arg, PTR(Env) env, PTR(Cont) rest) {
@@ -130,10 +140,11 @@ ArgThenCallCont::ArgThenCallCont(PTR(Expr) actual_arg, PTR(Env) env, PTR(Cont) r
 }
 
 void ArgThenCallCont::step_continue() {
-    Step::mode = Step::interp_mode;
-    Step::expr = actual_arg;
-    Step::env = env;
-    Step::cont = NEW(CallCont)(Step::val, rest);
+    Step::Registers &regs = *Step::regs;
+    regs.mode = Step::interp_mode;
+    regs.expr = actual_arg;
+    regs.env = env;
+    regs.cont = NEW(CallCont)(regs.val, rest);
 }
 
 CallCont::CallCont(PTR(Val) to_be_called_val, PTR(Cont) rest) {
@@ -142,5 +153,198 @@ CallCont::CallCont(PTR(Val) to_be_called_val, PTR(Cont) rest) {
 }
 
 void CallCont::step_continue() {
-    to_be_called_val->call_step(Step::val, rest);
+    to_be_called_val->call_step(Step::regs->val, rest);
+}
+
+AwaitCont::AwaitCont(PTR(Cont) rest) {
+    this->rest = rest;
+}
+
+void AwaitCont::step_continue() {
+    Step::Registers &regs = *Step::regs;
+    regs.mode = Step::continue_mode;
+    regs.val = FutureVal::await(regs.val);
+    regs.cont = rest;
+}
+
+FoldCont::FoldCont(PTR(FoldExpr) fold, std::vector<PTR(Val)> vals, PTR(Env) env, PTR(Cont) rest) {
+    this->fold = fold;
+    this->vals = vals;
+    this->env = env;
+    this->rest = rest;
+}
+
+void FoldCont::step_continue() {
+    Step::Registers &regs = *Step::regs;
+    std::vector<PTR(Val)> now = vals;
+    now.push_back(regs.val);
+    if (now.size() == 4) {
+        regs.mode = Step::continue_mode;
+        regs.val = Fold::run_without_calls(now[0], now[1], now[2], now[3]);
+        if (regs.val != nullptr) {
+            regs.cont = rest;
+            return;
+        }
+        regs.val = now[1];
+        regs.cont = NEW(FoldStepCont)(now[0], false, as_num(now[2])->rep, as_num(now[3])->rep, rest);
+        return;
+    }
+    PTR(Expr) next[] = { fold->init, fold->lo, fold->hi };
+    regs.mode = Step::interp_mode;
+    regs.expr = next[now.size() - 1];
+    regs.env = env;
+    regs.cont = NEW(FoldCont)(fold, now, env, rest);
+}
+
+FoldStepCont::FoldStepCont(PTR(Val) f, bool applied, int index, int end, PTR(Cont) rest) {
+    this->f = f;
+    this->applied = applied;
+    this->index = index;
+    this->end = end;
+    this->rest = rest;
+}
+
+void FoldStepCont::step_continue() {
+    Step::Registers &regs = *Step::regs;
+    if (applied) {
+        regs.val->call_step(NEW(NumVal)(index), NEW(FoldStepCont)(f, false, index + 1, end, rest));
+        return;
+    }
+    if (index >= end) {
+        regs.mode = Step::continue_mode;
+        regs.cont = rest;
+        return;
+    }
+    f->call_step(regs.val, NEW(FoldStepCont)(f, true, index, end, rest));
+}
+
+void RightThenAddCont::gc_children(std::vector<Collectable*> &out) {
+    gc_child(out, env);
+    gc_child(out, rest);
+}
+
+void RightThenAddCont::gc_clear() {
+    env = nullptr;
+    rest = nullptr;
+}
+
+void AddCont::gc_children(std::vector<Collectable*> &out) {
+    gc_child(out, lhs_val);
+    gc_child(out, rest);
+}
+
+void AddCont::gc_clear() {
+    lhs_val = nullptr;
+    rest = nullptr;
+}
+
+void RightThenMultCont::gc_children(std::vector<Collectable*> &out) {
+    gc_child(out, env);
+    gc_child(out, rest);
+}
+
+void RightThenMultCont::gc_clear() {
+    env = nullptr;
+    rest = nullptr;
+}
+
+void MultCont::gc_children(std::vector<Collectable*> &out) {
+    gc_child(out, lhs_val);
+    gc_child(out, rest);
+}
+
+void MultCont::gc_clear() {
+    lhs_val = nullptr;
+    rest = nullptr;
+}
+
+void LetBodyCont::gc_children(std::vector<Collectable*> &out) {
+    gc_child(out, env);
+    gc_child(out, rest);
+}
+
+void LetBodyCont::gc_clear() {
+    env = nullptr;
+    rest = nullptr;
+}
+
+void RightThenEqualsCont::gc_children(std::vector<Collectable*> &out) {
+    gc_child(out, env);
+    gc_child(out, rest);
+}
+
+void RightThenEqualsCont::gc_clear() {
+    env = nullptr;
+    rest = nullptr;
+}
+
+void EqualsCont::gc_children(std::vector<Collectable*> &out) {
+    gc_child(out, lhs_val);
+    gc_child(out, rest);
+}
+
+void EqualsCont::gc_clear() {
+    lhs_val = nullptr;
+    rest = nullptr;
+}
+
+void IfBranchCont::gc_children(std::vector<Collectable*> &out) {
+    gc_child(out, env);
+    gc_child(out, rest);
+}
+
+void IfBranchCont::gc_clear() {
+    env = nullptr;
+    rest = nullptr;
+}
+
+void ArgThenCallCont::gc_children(std::vector<Collectable*> &out) {
+    gc_child(out, env);
+    gc_child(out, rest);
+}
+
+void ArgThenCallCont::gc_clear() {
+    env = nullptr;
+    rest = nullptr;
+}
+
+void CallCont::gc_children(std::vector<Collectable*> &out) {
+    gc_child(out, to_be_called_val);
+    gc_child(out, rest);
+}
+
+void CallCont::gc_clear() {
+    to_be_called_val = nullptr;
+    rest = nullptr;
+}
+
+void AwaitCont::gc_children(std::vector<Collectable*> &out) {
+    gc_child(out, rest);
+}
+
+void AwaitCont::gc_clear() {
+    rest = nullptr;
+}
+
+void FoldCont::gc_children(std::vector<Collectable*> &out) {
+    for (PTR(Val) &val : vals)
+        gc_child(out, val);
+    gc_child(out, env);
+    gc_child(out, rest);
+}
+
+void FoldCont::gc_clear() {
+    vals.clear();
+    env = nullptr;
+    rest = nullptr;
+}
+
+void FoldStepCont::gc_children(std::vector<Collectable*> &out) {
+    gc_child(out, f);
+    gc_child(out, rest);
+}
+
+void FoldStepCont::gc_clear() {
+    f = nullptr;
+    rest = nullptr;
 }
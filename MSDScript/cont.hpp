@@ -2,14 +2,18 @@
 #define cont_hpp
 
 #include "macros.hpp"
+#include "symbol.hpp"
+#include "gc.hpp"
 #include <string>
+#include <vector>
 
 class Expr;
 class Cont;
 class Val;
 class Env;
+class FoldExpr;
 
-class Cont ENABLE_THIS(Cont) {
+class Cont COLLECTABLE(Cont) {
 public:
     virtual void step_continue() = 0;
     static PTR(Cont) done;
@@ -29,6 +33,8 @@ public:
     
     RightThenAddCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest);
     void step_continue();
+    void gc_children(std::vector<Collectable*> &out);
+    void gc_clear();
 };
 
 class AddCont : public Cont {
@@ -38,6 +44,8 @@ public:
     
     AddCont(PTR(Val) lhs_val, PTR(Cont) rest);
     void step_continue();
+    void gc_children(std::vector<Collectable*> &out);
+    void gc_clear();
 };
 
 class RightThenMultCont : public Cont {
@@ -48,6 +56,8 @@ public:
     
     RightThenMultCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest);
     void step_continue();
+    void gc_children(std::vector<Collectable*> &out);
+    void gc_clear();
 };
 
 class MultCont : public Cont {
@@ -57,17 +67,21 @@ public:
     
     MultCont(PTR(Val) lhs_val, PTR(Cont) rest);
     void step_continue();
+    void gc_children(std::vector<Collectable*> &out);
+    void gc_clear();
 };
 
 class LetBodyCont : public Cont {
 public:
-    std::string var;
+    Symbol var;
     PTR(Expr) body;
     PTR(Env) env;
     PTR(Cont) rest;
     
-    LetBodyCont(std::string var, PTR(Expr) body, PTR(Env) env, PTR(Cont) rest);
+    LetBodyCont(Symbol var, PTR(Expr) body, PTR(Env) env, PTR(Cont) rest);
     void step_continue();
+    void gc_children(std::vector<Collectable*> &out);
+    void gc_clear();
 };
 
 class RightThenEqualsCont : public Cont {
@@ -78,6 +92,8 @@ public:
     
     RightThenEqualsCont(PTR(Expr) rhs, PTR(Env) env, PTR(Cont) rest);
     void step_continue();
+    void gc_children(std::vector<Collectable*> &out);
+    void gc_clear();
 };
 
 class EqualsCont : public Cont {
@@ -87,6 +103,8 @@ public:
     
     EqualsCont(PTR(Val) lhs_val, PTR(Cont) rest);
     void step_continue();
+    void gc_children(std::vector<Collectable*> &out);
+    void gc_clear();
 };
 
 class IfBranchCont : public Cont {
@@ -98,6 +116,8 @@ public:
     
     IfBranchCont(PTR(Expr) then_part, PTR(Expr) else_part, PTR(Env) env, PTR(Cont) rest);
     void step_continue();
+    void gc_children(std::vector<Collectable*> &out);
+    void gc_clear();
 };
 
 class ArgThenCallCont : public Cont {
@@ -108,6 +128,8 @@ public:
     
     ArgThenCallCont(PTR(Expr) actual_arg, PTR(Env) env, PTR(Cont) rest);
     void step_continue();
+    void gc_children(std::vector<Collectable*> &out);
+    void gc_clear();
 };
 
 class CallCont : public Cont {
@@ -117,6 +139,52 @@ public:
     
     CallCont(PTR(Val) to_be_called_val, PTR(Cont) rest);
     void step_continue();
+    void gc_children(std::vector<Collectable*> &out);
+    void gc_clear();
+};
+
+class AwaitCont : public Cont {
+public:
+    PTR(Cont) rest;
+    
+    AwaitCont(PTR(Cont) rest);
+    void step_continue();
+    void gc_children(std::vector<Collectable*> &out);
+    void gc_clear();
+};
+
+// Collects the values of a _fold's operands, in order, then runs it, or
+// leaves it to a FoldStepCont when f has to be called
+class FoldCont : public Cont {
+public:
+    PTR(FoldExpr) fold;
+    std::vector<PTR(Val)> vals;
+    PTR(Env) env;
+    PTR(Cont) rest;
+    
+    FoldCont(PTR(FoldExpr) fold, std::vector<PTR(Val)> vals, PTR(Env) env, PTR(Cont) rest);
+    void step_continue();
+    void gc_children(std::vector<Collectable*> &out);
+    void gc_clear();
+};
+
+// Takes the accumulator of a _fold's loop and calls f with it, then
+// takes f(acc) and calls it with the index, then moves to the next
+// index, so each call is its own steps and fuel and time slices can stop
+// the loop anywhere
+class FoldStepCont : public Cont {
+public:
+    PTR(Val) f;
+    // Whether the value arriving is f(acc) rather than acc
+    bool applied;
+    int index;
+    int end;
+    PTR(Cont) rest;
+    
+    FoldStepCont(PTR(Val) f, bool applied, int index, int end, PTR(Cont) rest);
+    void step_continue();
+    void gc_children(std::vector<Collectable*> &out);
+    void gc_clear();
 };
 
 #endif /* cont_hpp */
@@ -0,0 +1,176 @@
+#include <sstream>
+#include "copy.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+#include "env.hpp"
+#include "jit.hpp"
+#include "lift.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+
+template <typename T>
+static bool is_immortal(PTR(T) const &p) {
+#if MSD_PTR_MODE == MSD_PTR_COUNTED
+    return p == nullptr || p->msd_refs == msd::RefCounted::immortal_refs;
+#else
+    return p == nullptr;
+#endif
+}
+
+ThreadCopy::ThreadCopy(bool copy_code) {
+    this->ok = true;
+    this->copy_code = copy_code;
+}
+
+PTR(Env) ThreadCopy::env(PTR(Env) e) {
+    if (is_immortal(e))
+        return e;
+    auto found = envs.find(&*e);
+    if (found != envs.end())
+        return found->second;
+    PTR(Env) copy = nullptr;
+    if (PTR(ExtendedEnv) x = CAST(ExtendedEnv)(e))
+        copy = NEW(ExtendedEnv)(x->name, val(x->val), env(x->rest));
+    else if (CAST(EmptyEnv)(e) != nullptr)
+        copy = Env::empty;
+    else
+        ok = false;
+    envs[&*e] = copy;
+    return copy;
+}
+
+PTR(Val) ThreadCopy::val(PTR(Val) v) {
+    if (is_immortal(v))
+        return v;
+    auto found = vals.find(&*v);
+    if (found != vals.end())
+        return found->second;
+    PTR(Val) copy = nullptr;
+    if (PTR(NumVal) n = CAST(NumVal)(v)) {
+        copy = NEW(NumVal)(n->rep);
+    } else if (PTR(BoolVal) b = CAST(BoolVal)(v)) {
+        copy = NEW(BoolVal)(b->rep);
+    } else if (PTR(FunVal) f = CAST(FunVal)(v)) {
+        PTR(FunVal) g = NEW(FunVal)(f->formal_arg, expr(f->body), env(f->env));
+        g->stack_frame = f->stack_frame;
+        if (is_immortal(f->jit)) {
+            g->jit = f->jit;
+        } else if (!copy_code) {
+            ok = false;
+        } else {
+            // Closures of one _fun keep sharing one entry
+            PTR(JitEntry) &jit = jits[&*f->jit];
+            if (jit == nullptr)
+                jit = NEW(JitEntry)(f->formal_arg, g->body);
+            g->jit = jit;
+        }
+        copy = g;
+    } else if (PTR(FutureVal) f = CAST(FutureVal)(v)) {
+        copy = NEW(FutureVal)(f->future);
+    } else {
+        ok = false;
+    }
+    vals[&*v] = copy;
+    return copy;
+}
+
+PTR(Expr) ThreadCopy::expr(PTR(Expr) e) {
+    if (is_immortal(e))
+        return e;
+    if (!copy_code) {
+        ok = false;
+        return e;
+    }
+    auto found = exprs.find(&*e);
+    if (found != exprs.end())
+        return found->second;
+    PTR(Expr) copy = copy_expr(e);
+    exprs[&*e] = copy;
+    return copy;
+}
+
+// Every node is new, even when its children were kept, since a node's
+// quickened sites and cached values change as it runs
+PTR(Expr) ThreadCopy::copy_expr(PTR(Expr) e) {
+    if (PTR(NumExpr) n = CAST(NumExpr)(e))
+        return NEW(NumExpr)(n->rep);
+    if (PTR(BoolExpr) b = CAST(BoolExpr)(e))
+        return NEW(BoolExpr)(b->rep);
+    if (PTR(VarExpr) v = CAST(VarExpr)(e))
+        return NEW(VarExpr)(v->name);
+    if (PTR(AddExpr) a = CAST(AddExpr)(e))
+        return NEW(AddExpr)(expr(a->lhs), expr(a->rhs));
+    if (PTR(MultExpr) m = CAST(MultExpr)(e))
+        return NEW(MultExpr)(expr(m->lhs), expr(m->rhs));
+    if (PTR(EqualExpr) q = CAST(EqualExpr)(e))
+        return NEW(EqualExpr)(expr(q->lhs), expr(q->rhs));
+    if (PTR(LetExpr) l = CAST(LetExpr)(e)) {
+        PTR(LetExpr) copy = NEW(LetExpr)(l->name, expr(l->rhs), expr(l->body));
+        copy->stack_frame = l->stack_frame;
+        return copy;
+    }
+    if (PTR(IfExpr) i = CAST(IfExpr)(e))
+        return NEW(IfExpr)(expr(i->test_part), expr(i->then_part), expr(i->else_part));
+    if (PTR(FunExpr) f = CAST(FunExpr)(e)) {
+        PTR(FunExpr) copy = NEW(FunExpr)(f->formal_arg, expr(f->body));
+        copy->stack_frame = f->stack_frame;
+        if (f->lifted != nullptr) {
+            PTR(FunVal) lifted = NEW(FunVal)(f->formal_arg, copy->body, Env::empty);
+            lifted->stack_frame = f->stack_frame;
+            copy->lifted = lifted;
+        }
+        return copy;
+    }
+    if (PTR(CallExpr) c = CAST(CallExpr)(e)) {
+        PTR(CallExpr) copy = NEW(CallExpr)(expr(c->to_be_called), expr(c->actual_arg));
+        copy->stack_closure = c->stack_closure;
+        return copy;
+    }
+    if (PTR(SpawnExpr) s = CAST(SpawnExpr)(e))
+        return NEW(SpawnExpr)(expr(s->expr));
+    if (PTR(AwaitExpr) w = CAST(AwaitExpr)(e))
+        return NEW(AwaitExpr)(expr(w->expr));
+    if (PTR(FoldExpr) f = CAST(FoldExpr)(e))
+        return NEW(FoldExpr)(expr(f->fun), expr(f->init), expr(f->lo), expr(f->hi));
+    ok = false;
+    return e;
+}
+
+static PTR(Expr) copy_parse(std::string s) {
+    return lift(parse_str(s));
+}
+
+TEST_CASE( "ThreadCopy" ) {
+    SECTION( "Trees" ) {
+        PTR(Expr) e = copy_parse("_let f = _fun (x) _fun (y) x + y * 2 _in _if f(1)(2) == 5 _then _spawn f(3) _else _await f");
+        ThreadCopy copy(true);
+        PTR(Expr) c = copy.expr(e);
+        CHECK( copy.ok );
+        CHECK( c != e );
+        CHECK( c->equals(e) );
+        CHECK( CAST(LetExpr)(c)->rhs != CAST(LetExpr)(e)->rhs );
+        // Without code, only an IMMORTAL tree can be used
+        ThreadCopy no_code(false);
+        no_code.expr(e);
+        CHECK( ! no_code.ok );
+    }
+    SECTION( "Values keep their sharing" ) {
+        PTR(Val) one = NEW(NumVal)(1);
+        PTR(Env) env = NEW(ExtendedEnv)("a", one, NEW(ExtendedEnv)("b", one, Env::empty));
+        PTR(Val) f = copy_parse("_fun (x) x + a")->interp(env);
+        env = NEW(ExtendedEnv)("f", f, env);
+        ThreadCopy copy(true);
+        PTR(ExtendedEnv) c = CAST(ExtendedEnv)(copy.env(env));
+        REQUIRE( c != nullptr );
+        CHECK( copy.ok );
+        PTR(FunVal) g = CAST(FunVal)(c->val);
+        REQUIRE( g != nullptr );
+        CHECK( g != f );
+        CHECK( g->env == c->rest );
+        PTR(ExtendedEnv) a = CAST(ExtendedEnv)(c->rest);
+        CHECK( a->val != one );
+        CHECK( a->val == CAST(ExtendedEnv)(a->rest)->val );
+        CHECK( CAST(ExtendedEnv)(a->rest)->rest == Env::empty );
+        CHECK( g->call(NEW(NumVal)(2))->equals(NEW(NumVal)(3)) );
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef copy_hpp
+#define copy_hpp
+
+#include <unordered_map>
+#include "macros.hpp"
+
+class Expr;
+class Env;
+class Val;
+class JitEntry;
+
+/* Copies an Env, a value or a tree and everything it reaches, so another
+ thread can use the copy without ever changing a reference count this
+ thread can see. Each object is copied once, so sharing inside the graph
+ is kept, and IMMORTAL objects are used as they are. With `copy_code`
+ false an Expr that is not IMMORTAL cannot be copied; `ok` ends up false
+ when anything could not be, and the copy must not be used. */
+class ThreadCopy {
+public:
+    bool ok;
+
+    ThreadCopy(bool copy_code);
+    PTR(Env) env(PTR(Env) e);
+    PTR(Val) val(PTR(Val) v);
+    PTR(Expr) expr(PTR(Expr) e);
+
+private:
+    bool copy_code;
+    std::unordered_map<Env*, PTR(Env)> envs;
+    std::unordered_map<Val*, PTR(Val)> vals;
+    std::unordered_map<Expr*, PTR(Expr)> exprs;
+    std::unordered_map<JitEntry*, PTR(JitEntry)> jits;
+
+    PTR(Expr) copy_expr(PTR(Expr) e);
+};
+
+#endif /* copy_hpp */
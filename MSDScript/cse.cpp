@@ -0,0 +1,324 @@
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "cse.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+#include "env.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+
+/* A scope is a region of the tree that is always evaluated together:
+ the whole program, a _let body, a _fun body, a _spawn, or one branch of an _if.
+ Subtrees are only shared inside a single scope, so hoisting them to the
+ start of the scope never evaluates something the original would have
+ skipped, and every free variable of a hoisted subtree is already bound
+ where the new _let is placed. */
+
+typedef enum {
+    num_kind,
+    bool_kind,
+    var_kind,
+    add_kind,
+    mult_kind,
+    equal_kind,
+    let_kind,
+    if_kind,
+    fun_kind,
+    call_kind,
+    spawn_kind,
+    await_kind,
+    fold_kind
+} kind_t;
+
+// Identifies a subtree by its kind, its own fields and the value numbers
+// of its children, so two subtrees get the same number only when they
+// are structurally identical
+struct NodeKey {
+    kind_t kind;
+    int rep;
+    Symbol name;
+    std::vector<int> kids;
+
+    bool operator==(const NodeKey &other) const {
+        return (kind == other.kind
+                && rep == other.rep
+                && name == other.name
+                && kids == other.kids);
+    }
+};
+
+struct NodeKeyHash {
+    size_t operator()(const NodeKey &key) const {
+        size_t h = std::hash<int>()(key.kind);
+        h = h * 31 + std::hash<int>()(key.rep);
+        h = h * 31 + std::hash<Symbol>()(key.name);
+        for (int kid : key.kids)
+            h = h * 31 + std::hash<int>()(kid);
+        return h;
+    }
+};
+
+class CSE {
+public:
+    CSE(PTR(Expr) e);
+    PTR(Expr) scope(PTR(Expr) e);
+
+private:
+    struct ScopeState {
+        std::unordered_map<int, int> counts;
+        std::unordered_map<int, std::string> names;
+        std::vector<std::pair<std::string, PTR(Expr)>> bindings;
+    };
+
+    std::unordered_map<NodeKey, int, NodeKeyHash> numbers;
+    std::unordered_map<Expr*, int> ids;
+    std::unordered_set<std::string> used_names;
+    int fresh_count;
+
+    int number(PTR(Expr) e);
+    int number_key(PTR(Expr) e, NodeKey key);
+    void count(PTR(Expr) e, ScopeState &st);
+    PTR(Expr) rewrite(PTR(Expr) e, ScopeState &st);
+    PTR(Expr) rebuild(PTR(Expr) e, ScopeState &st);
+    std::string fresh_name();
+};
+
+CSE::CSE(PTR(Expr) e) {
+    fresh_count = 0;
+    number(e);
+}
+
+int CSE::number_key(PTR(Expr) e, NodeKey key) {
+    auto found = numbers.find(key);
+    int id;
+    if (found == numbers.end()) {
+        id = (int)numbers.size();
+        numbers.emplace(key, id);
+    } else {
+        id = found->second;
+    }
+    ids[&*e] = id;
+    return id;
+}
+
+// Assigns every subtree a value number, bottom up, in one pass
+int CSE::number(PTR(Expr) e) {
+    auto seen = ids.find(&*e);
+    if (seen != ids.end())
+        return seen->second;
+
+    NodeKey key;
+    key.rep = 0;
+    if (PTR(NumExpr) n = CAST(NumExpr)(e)) {
+        key.kind = num_kind;
+        key.rep = n->rep;
+    } else if (PTR(BoolExpr) b = CAST(BoolExpr)(e)) {
+        key.kind = bool_kind;
+        key.rep = b->rep;
+    } else if (PTR(VarExpr) v = CAST(VarExpr)(e)) {
+        key.kind = var_kind;
+        key.name = v->name;
+        used_names.insert(v->name);
+    } else if (PTR(AddExpr) a = CAST(AddExpr)(e)) {
+        key.kind = add_kind;
+        key.kids = { number(a->lhs), number(a->rhs) };
+    } else if (PTR(MultExpr) m = CAST(MultExpr)(e)) {
+        key.kind = mult_kind;
+        key.kids = { number(m->lhs), number(m->rhs) };
+    } else if (PTR(EqualExpr) q = CAST(EqualExpr)(e)) {
+        key.kind = equal_kind;
+        key.kids = { number(q->lhs), number(q->rhs) };
+    } else if (PTR(LetExpr) l = CAST(LetExpr)(e)) {
+        key.kind = let_kind;
+        key.name = l->name;
+        key.kids = { number(l->rhs), number(l->body) };
+        used_names.insert(l->name);
+    } else if (PTR(IfExpr) i = CAST(IfExpr)(e)) {
+        key.kind = if_kind;
+        key.kids = { number(i->test_part), number(i->then_part), number(i->else_part) };
+    } else if (PTR(FunExpr) f = CAST(FunExpr)(e)) {
+        key.kind = fun_kind;
+        key.name = f->formal_arg;
+        key.kids = { number(f->body) };
+        used_names.insert(f->formal_arg);
+    } else if (PTR(CallExpr) c = CAST(CallExpr)(e)) {
+        key.kind = call_kind;
+        key.kids = { number(c->to_be_called), number(c->actual_arg) };
+    } else if (PTR(SpawnExpr) s = CAST(SpawnExpr)(e)) {
+        key.kind = spawn_kind;
+        key.kids = { number(s->expr) };
+    } else if (PTR(AwaitExpr) w = CAST(AwaitExpr)(e)) {
+        key.kind = await_kind;
+        key.kids = { number(w->expr) };
+    } else if (PTR(FoldExpr) f = CAST(FoldExpr)(e)) {
+        key.kind = fold_kind;
+        key.kids = { number(f->fun), number(f->init), number(f->lo), number(f->hi) };
+    } else {
+        throw std::runtime_error("cse: unknown expression");
+    }
+    return number_key(e, key);
+}
+
+// Counts occurrences within one scope. Only the first occurrence of a
+// subtree is descended into, because every later occurrence will be
+// replaced by a variable and its children disappear with it
+void CSE::count(PTR(Expr) e, ScopeState &st) {
+    if (++st.counts[ids[&*e]] > 1)
+        return;
+    if (PTR(AddExpr) a = CAST(AddExpr)(e)) {
+        count(a->lhs, st);
+        count(a->rhs, st);
+    } else if (PTR(MultExpr) m = CAST(MultExpr)(e)) {
+        count(m->lhs, st);
+        count(m->rhs, st);
+    } else if (PTR(EqualExpr) q = CAST(EqualExpr)(e)) {
+        count(q->lhs, st);
+        count(q->rhs, st);
+    } else if (PTR(LetExpr) l = CAST(LetExpr)(e)) {
+        count(l->rhs, st);
+    } else if (PTR(IfExpr) i = CAST(IfExpr)(e)) {
+        count(i->test_part, st);
+    } else if (PTR(CallExpr) c = CAST(CallExpr)(e)) {
+        count(c->to_be_called, st);
+        count(c->actual_arg, st);
+    } else if (PTR(AwaitExpr) w = CAST(AwaitExpr)(e)) {
+        count(w->expr, st);
+    } else if (PTR(FoldExpr) f = CAST(FoldExpr)(e)) {
+        count(f->fun, st);
+        count(f->init, st);
+        count(f->lo, st);
+        count(f->hi, st);
+    }
+}
+
+PTR(Expr) CSE::scope(PTR(Expr) e) {
+    ScopeState st;
+    count(e, st);
+    PTR(Expr) result = rewrite(e, st);
+    // Later bindings may refer to earlier ones, so the first binding
+    // ends up outermost
+    for (size_t i = st.bindings.size(); i > 0; i--)
+        result = NEW(LetExpr)(st.bindings[i - 1].first, st.bindings[i - 1].second, result);
+    return result;
+}
+
+PTR(Expr) CSE::rewrite(PTR(Expr) e, ScopeState &st) {
+    int id = ids[&*e];
+    bool trivial = (CAST(NumExpr)(e) != nullptr
+                    || CAST(BoolExpr)(e) != nullptr
+                    || CAST(VarExpr)(e) != nullptr);
+    if (trivial || st.counts[id] < 2)
+        return rebuild(e, st);
+
+    auto bound = st.names.find(id);
+    if (bound != st.names.end())
+        return NEW(VarExpr)(bound->second);
+
+    // Children are rewritten first, so any binding this one depends on
+    // is pushed before it
+    PTR(Expr) rhs = rebuild(e, st);
+    std::string name = fresh_name();
+    st.names[id] = name;
+    st.bindings.push_back(std::make_pair(name, rhs));
+    return NEW(VarExpr)(name);
+}
+
+PTR(Expr) CSE::rebuild(PTR(Expr) e, ScopeState &st) {
+    if (PTR(AddExpr) a = CAST(AddExpr)(e))
+        return NEW(AddExpr)(rewrite(a->lhs, st), rewrite(a->rhs, st));
+    if (PTR(MultExpr) m = CAST(MultExpr)(e))
+        return NEW(MultExpr)(rewrite(m->lhs, st), rewrite(m->rhs, st));
+    if (PTR(EqualExpr) q = CAST(EqualExpr)(e))
+        return NEW(EqualExpr)(rewrite(q->lhs, st), rewrite(q->rhs, st));
+    if (PTR(LetExpr) l = CAST(LetExpr)(e))
+        return NEW(LetExpr)(l->name, rewrite(l->rhs, st), scope(l->body));
+    if (PTR(IfExpr) i = CAST(IfExpr)(e))
+        return NEW(IfExpr)(rewrite(i->test_part, st), scope(i->then_part), scope(i->else_part));
+    if (PTR(FunExpr) f = CAST(FunExpr)(e))
+        return NEW(FunExpr)(f->formal_arg, scope(f->body));
+    if (PTR(CallExpr) c = CAST(CallExpr)(e))
+        return NEW(CallExpr)(rewrite(c->to_be_called, st), rewrite(c->actual_arg, st));
+    // Hoisting out of a _spawn would move work off the other thread
+    if (PTR(SpawnExpr) s = CAST(SpawnExpr)(e))
+        return NEW(SpawnExpr)(scope(s->expr));
+    if (PTR(AwaitExpr) w = CAST(AwaitExpr)(e))
+        return NEW(AwaitExpr)(rewrite(w->expr, st));
+    if (PTR(FoldExpr) f = CAST(FoldExpr)(e))
+        return NEW(FoldExpr)(rewrite(f->fun, st), rewrite(f->init, st), rewrite(f->lo, st), rewrite(f->hi, st));
+    return e;
+}
+
+// Variables are alphabetic only, so fresh names are "cse" followed by
+// letters, skipping anything the program already uses
+std::string CSE::fresh_name() {
+    while (1) {
+        std::string suffix = "";
+        int n = fresh_count++;
+        do {
+            suffix = (char)('a' + n % 26) + suffix;
+            n = n / 26;
+        } while (n > 0);
+        std::string name = "cse" + suffix;
+        if (used_names.insert(name).second)
+            return name;
+    }
+}
+
+PTR(Expr) cse(PTR(Expr) e) {
+    CSE pass(e);
+    return pass.scope(e);
+}
+
+static PTR(Expr) cse_str(std::string s) {
+    return cse(parse_str(s));
+}
+
+TEST_CASE( "CSE" ) {
+    SECTION( "No sharing" ) {
+        CHECK( cse_str("1 + 2")->to_string()
+              == "(1 + 2)" );
+        CHECK( cse_str("x + x")->to_string()
+              == "(x + x)" );
+        CHECK( cse_str("(x + 1) * (y + 1)")->to_string()
+              == "((x + 1) * (y + 1))" );
+    }
+    SECTION( "Repeated subtree" ) {
+        CHECK( cse_str("(x + 1) * (x + 1)")
+              ->equals(NEW(LetExpr)("csea",
+                                    NEW(AddExpr)(NEW(VarExpr)("x"), NEW(NumExpr)(1)),
+                                    NEW(MultExpr)(NEW(VarExpr)("csea"), NEW(VarExpr)("csea")))) );
+        CHECK( cse_str("f(f)(x + -1) + f(f)(x + -2)")->to_string()
+              == "(_let csea = , (f(f)) _in (, (csea((x + -1))) + , (csea((x + -2)))))" );
+    }
+    SECTION( "Nested sharing only counts what survives" ) {
+        CHECK( cse_str("((x + 1) * 2) + ((x + 1) * 2)")->to_string()
+              == "(_let csea = ((x + 1) * 2) _in (csea + csea))" );
+        CHECK( cse_str("(f(f)(x) + f(f)(x)) + f(f)(y)")->to_string()
+              == "(_let csea = , (f(f)) _in (_let cseb = , (csea(x)) _in ((cseb + cseb) + , (csea(y)))))" );
+    }
+    SECTION( "Scopes" ) {
+        // Branches are their own scopes, so nothing is hoisted out of them
+        CHECK( cse_str("_if b _then (x + 1) * 2 _else (x + 1) * 3")->to_string()
+              == "(_if b _then ((x + 1) * 2) _else ((x + 1) * 3))" );
+        CHECK( cse_str("_if b _then (x + 1) * (x + 1) _else 0")->to_string()
+              == "(_if b _then (_let csea = (x + 1) _in (csea * csea)) _else 0)" );
+        CHECK( cse_str("_let x = y + 1 _in (x + 1) * (x + 1)")->to_string()
+              == "(_let x = (y + 1) _in (_let csea = (x + 1) _in (csea * csea)))" );
+        CHECK( cse_str("_fun (x) (x + 1) * (x + 1)")->to_string()
+              == "(_fun (x) (_let csea = (x + 1) _in (csea * csea)))" );
+        CHECK( cse_str("(_spawn (x + 1) * (x + 1)) == (_spawn (x + 1) * (x + 1))")->to_string()
+              == "(_let cseb = (_spawn (_let csea = (x + 1) _in (csea * csea))) _in cseb == cseb)" );
+    }
+    SECTION( "Fresh names avoid program names" ) {
+        CHECK( cse_str("_let csea = 1 _in (csea + 1) * (csea + 1)")->to_string()
+              == "(_let csea = 1 _in (_let cseb = (csea + 1) _in (cseb * cseb)))" );
+    }
+    SECTION( "Same result" ) {
+        std::string fib = "_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 2 + -1 _then 1 _else fib(fib)(x + -1) + fib(fib)(x + -2) _in fib(fib)(10)";
+        CHECK( cse_str(fib)->interp(NEW(EmptyEnv)())
+              ->equals(NEW(NumVal)(89)) );
+    }
+}
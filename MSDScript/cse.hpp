@@ -0,0 +1,13 @@
+#ifndef cse_hpp
+#define cse_hpp
+
+#include "macros.hpp"
+
+class Expr;
+
+// Common subexpression elimination. Structurally identical subtrees that
+// are evaluated more than once in the same scope are bound once with a
+// fresh _let and every occurrence is replaced with a VarExpr
+PTR(Expr) cse(PTR(Expr) e);
+
+#endif /* cse_hpp */
@@ -0,0 +1,434 @@
+#include <sstream>
+#include <stdexcept>
+#include "egraph.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+#include "env.hpp"
+#include "pass.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+
+/* Rules, for MSDScript's 32-bit wrapping integers (see NumVal::add_to):
+   a + b = b + a                a * b = b * a
+   (a + b) + c = a + (b + c)    (a * b) * c = a * (b * c)
+   a + 0 = a                    a * 1 = a
+   a * 0 = 0                    a == a = _true
+   constant + constant, constant * constant and constant == constant fold
+ The identity, zero and `a == a` rules only fire when the operand is
+ proven to be a number: a class holding a number constant, or a + or *
+ of two such classes. A variable might hold a boolean or a function, or
+ be free, so `x + 0`, `x * 0` and `x == x` keep failing at run time the
+ way they would have. */
+
+bool EGraph::ENode::operator<(const ENode &other) const {
+    if (op != other.op)
+        return op < other.op;
+    if (val != other.val)
+        return val < other.val;
+    if (lhs != other.lhs)
+        return lhs < other.lhs;
+    return rhs < other.rhs;
+}
+
+bool EGraph::ENode::operator==(const ENode &other) const {
+    return (op == other.op
+            && val == other.val
+            && lhs == other.lhs
+            && rhs == other.rhs);
+}
+
+EGraph::EGraph() {
+    max_nodes = 2000;
+    max_iterations = 12;
+    changed = false;
+}
+
+int EGraph::find(int cls) {
+    while (parent[cls] != cls) {
+        parent[cls] = parent[parent[cls]];
+        cls = parent[cls];
+    }
+    return cls;
+}
+
+bool EGraph::same(int cls1, int cls2) {
+    return find(cls1) == find(cls2);
+}
+
+int EGraph::size() {
+    return (int)memo.size();
+}
+
+EGraph::ENode EGraph::canonical(ENode node) {
+    if (node.lhs >= 0)
+        node.lhs = find(node.lhs);
+    if (node.rhs >= 0)
+        node.rhs = find(node.rhs);
+    return node;
+}
+
+int EGraph::add(ENode node) {
+    node = canonical(node);
+    auto found = memo.find(node);
+    if (found != memo.end())
+        return find(found->second);
+    int cls = (int)parent.size();
+    parent.push_back(cls);
+    memo[node] = cls;
+    order[node] = (int)order.size();
+    changed = true;
+    return cls;
+}
+
+int EGraph::add_num(int rep) {
+    return add({ num_op, rep, -1, -1 });
+}
+
+// The lower id stays the root, so results do not depend on map order
+void EGraph::merge(int cls1, int cls2) {
+    cls1 = find(cls1);
+    cls2 = find(cls2);
+    if (cls1 == cls2)
+        return;
+    if (cls1 < cls2)
+        parent[cls2] = cls1;
+    else
+        parent[cls1] = cls2;
+    changed = true;
+}
+
+int EGraph::add_expr(PTR(Expr) e) {
+    if (PTR(NumExpr) n = CAST(NumExpr)(e))
+        return add_num(n->rep);
+    if (PTR(BoolExpr) b = CAST(BoolExpr)(e))
+        return add({ bool_op, b->rep ? 1 : 0, -1, -1 });
+    if (PTR(AddExpr) a = CAST(AddExpr)(e)) {
+        int lhs = add_expr(a->lhs);
+        return add({ add_op, 0, lhs, add_expr(a->rhs) });
+    }
+    if (PTR(MultExpr) m = CAST(MultExpr)(e)) {
+        int lhs = add_expr(m->lhs);
+        return add({ mult_op, 0, lhs, add_expr(m->rhs) });
+    }
+    if (PTR(EqualExpr) q = CAST(EqualExpr)(e)) {
+        int lhs = add_expr(q->lhs);
+        return add({ equal_op, 0, lhs, add_expr(q->rhs) });
+    }
+    for (size_t i = 0; i < leaves.size(); i++)
+        if (leaves[i]->equals(e))
+            return add({ leaf_op, (int)i, -1, -1 });
+    leaves.push_back(e);
+    return add({ leaf_op, (int)leaves.size() - 1, -1, -1 });
+}
+
+// Restores the invariant that no two classes hold the same node: merging
+// two classes can make their parents identical, which merges those too
+void EGraph::rebuild() {
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        std::map<ENode, int> new_memo;
+        std::map<ENode, int> new_order;
+        for (auto &entry : memo) {
+            ENode node = canonical(entry.first);
+            int cls = find(entry.second);
+            int ord = order[entry.first];
+            auto found = new_memo.find(node);
+            if (found == new_memo.end()) {
+                new_memo[node] = cls;
+                new_order[node] = ord;
+            } else {
+                if (find(found->second) != cls) {
+                    merge(found->second, cls);
+                    merged = true;
+                }
+                new_order[node] = std::min(new_order[node], ord);
+            }
+        }
+        memo.swap(new_memo);
+        order.swap(new_order);
+    }
+    classes.clear();
+    for (auto &entry : memo)
+        classes[find(entry.second)].push_back(entry.first);
+    analyze();
+}
+
+void EGraph::analyze() {
+    constants.clear();
+    numeric.clear();
+    for (auto &cls : classes)
+        for (ENode &node : cls.second)
+            if (node.op == num_op || node.op == bool_op)
+                constants[cls.first] = node;
+
+    bool grew = true;
+    while (grew) {
+        grew = false;
+        for (auto &cls : classes) {
+            if (numeric[cls.first])
+                continue;
+            for (ENode &node : cls.second) {
+                bool node_numeric;
+                if (node.op == num_op)
+                    node_numeric = true;
+                else if (node.op == add_op || node.op == mult_op)
+                    node_numeric = numeric[node.lhs] && numeric[node.rhs];
+                else
+                    node_numeric = false;
+                if (node_numeric) {
+                    numeric[cls.first] = true;
+                    grew = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+bool EGraph::is_num(int cls, int rep) {
+    auto found = constants.find(cls);
+    return (found != constants.end()
+            && found->second.op == num_op
+            && found->second.val == rep);
+}
+
+// `node` and `cls` come from the snapshot taken after the last rebuild,
+// so their ids are the roots that `classes`, `constants` and `numeric`
+// are keyed by
+void EGraph::apply_rules(ENode node, int cls) {
+    if (node.op == add_op || node.op == mult_op) {
+        apply_binary_rules(node, cls);
+    } else if (node.op == equal_op) {
+        if (node.lhs == node.rhs && numeric[node.lhs])
+            merge(cls, add({ bool_op, 1, -1, -1 }));
+        auto lhs = constants.find(node.lhs);
+        auto rhs = constants.find(node.rhs);
+        if (lhs != constants.end() && rhs != constants.end()) {
+            bool eq = (lhs->second.op == rhs->second.op
+                       && lhs->second.val == rhs->second.val);
+            merge(cls, add({ bool_op, eq ? 1 : 0, -1, -1 }));
+        }
+    }
+}
+
+void EGraph::apply_binary_rules(ENode node, int cls) {
+    op_t op = node.op;
+    int a = node.lhs;
+    int b = node.rhs;
+    int unit = (op == add_op) ? 0 : 1;
+
+    merge(cls, add({ op, 0, b, a }));
+
+    std::vector<ENode> a_nodes = classes[a];
+    std::vector<ENode> b_nodes = classes[b];
+    for (ENode &inner : a_nodes)
+        if (inner.op == op)
+            merge(cls, add({ op, 0, inner.lhs, add({ op, 0, inner.rhs, b }) }));
+    for (ENode &inner : b_nodes)
+        if (inner.op == op)
+            merge(cls, add({ op, 0, add({ op, 0, a, inner.lhs }), inner.rhs }));
+
+    if (is_num(b, unit) && numeric[a])
+        merge(cls, a);
+    if (is_num(a, unit) && numeric[b])
+        merge(cls, b);
+    if (op == mult_op) {
+        if (is_num(b, 0) && numeric[a])
+            merge(cls, b);
+        if (is_num(a, 0) && numeric[b])
+            merge(cls, a);
+    }
+
+    auto lhs = constants.find(a);
+    auto rhs = constants.find(b);
+    if (lhs != constants.end() && rhs != constants.end()
+        && lhs->second.op == num_op && rhs->second.op == num_op) {
+        unsigned x = (unsigned)lhs->second.val;
+        unsigned y = (unsigned)rhs->second.val;
+        merge(cls, add_num((int)(op == add_op ? x + y : x * y)));
+    }
+}
+
+void EGraph::saturate() {
+    rebuild();
+    for (int i = 0; i < max_iterations; i++) {
+        changed = false;
+        std::vector<std::pair<ENode, int>> snapshot;
+        for (auto &cls : classes)
+            for (ENode &node : cls.second)
+                snapshot.push_back(std::make_pair(node, cls.first));
+        for (auto &item : snapshot) {
+            if (size() > max_nodes)
+                break;
+            apply_rules(item.first, item.second);
+        }
+        rebuild();
+        if (!changed || size() > max_nodes)
+            break;
+    }
+}
+
+// Picks the smallest tree in each class. Ties go to the node that was
+// added first, so an expression that is already minimal comes back as
+// it went in
+PTR(Expr) EGraph::extract(int cls) {
+    std::map<int, long> cost;
+    std::map<int, ENode> best;
+    bool improved = true;
+    while (improved) {
+        improved = false;
+        for (auto &entry : classes) {
+            for (ENode &node : entry.second) {
+                long node_cost;
+                if (node.op == num_op || node.op == bool_op) {
+                    node_cost = 1;
+                } else if (node.op == leaf_op) {
+                    node_cost = expr_size(leaves[node.val]);
+                } else {
+                    auto lhs = cost.find(node.lhs);
+                    auto rhs = cost.find(node.rhs);
+                    if (lhs == cost.end() || rhs == cost.end())
+                        continue;
+                    node_cost = 1 + lhs->second + rhs->second;
+                }
+                auto current = cost.find(entry.first);
+                if (current == cost.end()
+                    || node_cost < current->second
+                    || (node_cost == current->second && order[node] < order[best[entry.first]])) {
+                    cost[entry.first] = node_cost;
+                    best[entry.first] = node;
+                    improved = true;
+                }
+            }
+        }
+    }
+
+    ENode node = best[find(cls)];
+    switch (node.op) {
+        case num_op:
+            return NEW(NumExpr)(node.val);
+        case bool_op:
+            return NEW(BoolExpr)(node.val != 0);
+        case leaf_op:
+            return leaves[node.val];
+        case add_op:
+            return NEW(AddExpr)(extract(node.lhs), extract(node.rhs));
+        case mult_op:
+            return NEW(MultExpr)(extract(node.lhs), extract(node.rhs));
+        default:
+            return NEW(EqualExpr)(extract(node.lhs), extract(node.rhs));
+    }
+}
+
+static bool is_arith(PTR(Expr) e) {
+    return (CAST(AddExpr)(e) != nullptr
+            || CAST(MultExpr)(e) != nullptr
+            || CAST(EqualExpr)(e) != nullptr);
+}
+
+// Simplifies everything below an arithmetic region that the e-graph
+// will see as an opaque leaf
+static PTR(Expr) simplify_leaves(PTR(Expr) e) {
+    if (is_arith(e)) {
+        std::vector<PTR(Expr)> kids;
+        for (PTR(Expr) kid : expr_children(e))
+            kids.push_back(simplify_leaves(kid));
+        return expr_with_children(e, kids);
+    }
+    return simplify(e);
+}
+
+PTR(Expr) simplify(PTR(Expr) e) {
+    if (is_arith(e)) {
+        PTR(Expr) prepared = simplify_leaves(e);
+        EGraph graph;
+        int root = graph.add_expr(prepared);
+        graph.saturate();
+        PTR(Expr) result = graph.extract(root);
+        if (result->equals(prepared))
+            return prepared;
+        return result;
+    }
+    std::vector<PTR(Expr)> kids;
+    for (PTR(Expr) kid : expr_children(e))
+        kids.push_back(simplify(kid));
+    return expr_with_children(e, kids);
+}
+
+static std::string simplify_str(std::string s) {
+    return simplify(parse_str(s))->to_string();
+}
+
+TEST_CASE( "EGraph" ) {
+    SECTION( "Congruence" ) {
+        EGraph graph;
+        int x = graph.add_expr(NEW(VarExpr)("x"));
+        int y = graph.add_expr(NEW(VarExpr)("y"));
+        int x1 = graph.add_expr(NEW(AddExpr)(NEW(VarExpr)("x"), NEW(NumExpr)(1)));
+        int y1 = graph.add_expr(NEW(AddExpr)(NEW(VarExpr)("y"), NEW(NumExpr)(1)));
+        CHECK( graph.add_expr(NEW(VarExpr)("x")) == x );
+        CHECK( ! graph.same(x1, y1) );
+        graph.saturate();
+        CHECK( ! graph.same(x1, y1) );
+        CHECK( ! graph.same(x, y) );
+    }
+    SECTION( "Node limit" ) {
+        EGraph graph;
+        graph.max_nodes = 50;
+        int root = graph.add_expr(NEW(AddExpr)(NEW(VarExpr)("a"),
+                                               NEW(AddExpr)(NEW(VarExpr)("b"),
+                                                            NEW(AddExpr)(NEW(VarExpr)("c"),
+                                                                         NEW(AddExpr)(NEW(VarExpr)("d"), NEW(VarExpr)("e"))))));
+        graph.saturate();
+        CHECK( graph.size() < 200 );
+        CHECK( graph.extract(root)->to_string() == "(a + (b + (c + (d + e))))" );
+    }
+}
+
+TEST_CASE( "Simplify" ) {
+    SECTION( "Identities need numbers" ) {
+        CHECK( simplify_str("x + 0") == "(x + 0)" );
+        CHECK( simplify_str("0 + x") == "(0 + x)" );
+        CHECK( simplify_str("x * 1") == "(x * 1)" );
+        CHECK( simplify_str("x * 0") == "(x * 0)" );
+        CHECK( simplify_str("x == x") == "x == x" );
+        CHECK( simplify_str("(x + 1) + -1") == "(x + 0)" );
+        CHECK( simplify_str("(2 * 3) * 1 == 6") == "_true" );
+    }
+    SECTION( "Reassociation" ) {
+        CHECK( simplify_str("(x + 1) + 2") == "(x + 3)" );
+        CHECK( simplify_str("1 + (x + 2)") == "(3 + x)" );
+        CHECK( simplify_str("2 * (x * 3)") == "(6 * x)" );
+        CHECK( simplify_str("(x + 1) + 2 == x + 3") == "(x + 3) == (x + 3)" );
+    }
+    SECTION( "Wrapping arithmetic" ) {
+        CHECK( simplify_str("(x + 2147483647) + 1") == "(x + -2147483648)" );
+        CHECK( simplify_str("65536 * 65536") == "0" );
+    }
+    SECTION( "Already simple" ) {
+        CHECK( simplify_str("x + y") == "(x + y)" );
+        CHECK( simplify_str("x * (y + 1)") == "(x * (y + 1))" );
+        CHECK( simplify_str("x == 0") == "x == 0" );
+    }
+    SECTION( "Unsafe rewrites are skipped" ) {
+        CHECK( simplify_str("_true + 0") == "(_true + 0)" );
+        CHECK( simplify_str("(1 == 1) * 1") == "(_true * 1)" );
+        CHECK( simplify_str("f(1) * 0") == "(, (f(1)) * 0)" );
+        CHECK( simplify_str("f(1) == f(1)") == ", (f(1)) == , (f(1))" );
+        std::string programs[][2] = {
+            { "(_fun (x) x + 0)(_true)", "no adding booleans" },
+            { "_let f = _fun (x) x * 0 _in f(_fun (y) y)", "no multiplying functions" },
+            { "x == x", "free variable: x" }
+        };
+        for (auto &program : programs) {
+            std::istringstream in(program[0]);
+            CHECK_THROWS_WITH( simplify(parse(in))->interp(Env::empty), program[1] );
+        }
+    }
+    SECTION( "Inside other expressions" ) {
+        CHECK( simplify_str("_fun (n) _if n + (2 + -2) == 0 _then 1 _else f(n + 1 + 2)")
+              == "(_fun (n) (_if (n + 0) == 0 _then 1 _else , (f((n + 3)))))" );
+        CHECK( simplify_str("_let y = 2 * 3 _in y + 0") == "(_let y = 6 _in (y + 0))" );
+    }
+}
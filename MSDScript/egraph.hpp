@@ -0,0 +1,72 @@
+#ifndef egraph_hpp
+#define egraph_hpp
+
+#include <map>
+#include <vector>
+#include "macros.hpp"
+
+class Expr;
+
+// An e-graph over the arithmetic and comparison part of an Expr. Each
+// class holds every form found so far that has the same value, so rules
+// can be applied without choosing between them until extraction
+class EGraph {
+public:
+    typedef enum {
+        num_op,
+        bool_op,
+        leaf_op,
+        add_op,
+        mult_op,
+        equal_op
+    } op_t;
+    
+    // `val` is the number, the boolean, or the index into `leaves`;
+    // `lhs` and `rhs` are class ids, or -1 when unused
+    struct ENode {
+        op_t op;
+        int val;
+        int lhs;
+        int rhs;
+        bool operator<(const ENode &other) const;
+        bool operator==(const ENode &other) const;
+    };
+    
+    int max_nodes;
+    int max_iterations;
+    
+    EGraph();
+    int add_expr(PTR(Expr) e);
+    void saturate();
+    PTR(Expr) extract(int cls);
+    int find(int cls);
+    bool same(int cls1, int cls2);
+    int size();
+    
+private:
+    std::vector<int> parent;
+    std::map<ENode, int> memo;
+    std::map<ENode, int> order;
+    std::map<int, std::vector<ENode>> classes;
+    std::vector<PTR(Expr)> leaves;
+    std::map<int, ENode> constants;
+    // Classes proven to evaluate to a number without failing
+    std::map<int, bool> numeric;
+    bool changed;
+    
+    int add(ENode node);
+    int add_num(int rep);
+    void merge(int cls1, int cls2);
+    ENode canonical(ENode node);
+    void rebuild();
+    void analyze();
+    bool is_num(int cls, int rep);
+    void apply_rules(ENode node, int cls);
+    void apply_binary_rules(ENode node, int cls);
+};
+
+// Algebraic simplification of every arithmetic/comparison region, using
+// an e-graph with MSDScript's wrapping integer ring rules
+PTR(Expr) simplify(PTR(Expr) e);
+
+#endif /* egraph_hpp */
@@ -0,0 +1,73 @@
+#include <string>
+#include "embed.hpp"
+#include "catch.hpp"
+
+// Everything in embed.hpp is header only; these check it both at compile
+// time and at run time
+
+static constexpr auto fib = msd::parse("_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1 _else fib(fib)(x + -1) + fib(fib)(x + -2) _in fib(fib)");
+
+static_assert(msd::run(msd::parse("1 + 2 * 3")).rep == 7, "arithmetic");
+static_assert(msd::run(msd::parse("_let x = 5 _in _let y = x * x _in y + x")).rep == 30, "_let");
+static_assert(msd::run(msd::parse("(_fun (x) x) == _fun (x) x")).kind == msd::bool_val, "function equality");
+static_assert(msd::run(msd::parse("(_fun (x) x) == _fun (x) x")).rep == 1, "function equality");
+static_assert(msd::run(msd::parse("_if 1 == 2 _then 3 _else 4")).rep == 4, "_if");
+static_assert(msd::call(fib, 10).rep == 89, "fib");
+static_assert(msd::call(msd::parse("_let loop = _fun (loop) _fun (n) _if n == 0 _then 0 _else loop(loop)(n + -1) _in loop(loop)"), 600).rep == 0, "tail calls");
+
+static std::string embed_error(int which) {
+    try {
+        switch (which) {
+            case 0:
+                msd::run(msd::parse("1 + x"));
+                break;
+            case 1:
+                msd::run(msd::parse("_true + 1"));
+                break;
+            case 2:
+                msd::run(msd::parse("_if 1 _then 2 _else 3"));
+                break;
+            case 3:
+                msd::run(msd::parse("(1 + 2"));
+                break;
+            case 5:
+                msd::call(msd::parse("_let count = _fun (count) _fun (n) _if n == 0 _then 0 _else 1 + count(count)(n + -1) _in count(count)"), 600);
+                break;
+            default:
+                msd::run(msd::parse("_fun (x) x + 1 )"));
+                break;
+        }
+        return "";
+    } catch (std::runtime_error &err) {
+        return err.what();
+    }
+}
+
+TEST_CASE( "Embedded scripts" ) {
+    SECTION( "Run time calls" ) {
+        for (int i = 0; i < 3; i++)
+            CHECK( msd::call(fib, i + 17).rep == (i == 0 ? 2584 : i == 1 ? 4181 : 6765) );
+        constexpr auto count = msd::parse("_let count = _fun (count) _fun (n) _if n == 0 _then 0 _else 1 + count(count)(n + -1) _in count(count)");
+        CHECK( msd::call(count, 200).rep == 200 );
+        CHECK( msd::call<4096>(count, 1500).rep == 1500 );
+        constexpr auto loop = msd::parse("_let loop = _fun (loop) _fun (n) _if n == 0 _then n _else loop(loop)(n + -1) _in loop(loop)");
+        CHECK( msd::call(loop, 100000).rep == 0 );
+        // Tail calls reuse the same few frames
+        CHECK( msd::call<8>(loop, 100000).rep == 0 );
+        CHECK( msd::run(msd::parse("2147483647 + 1")).rep == -2147483647 - 1 );
+    }
+    SECTION( "Closures" ) {
+        constexpr auto adder = msd::parse("_let y = 3 _in _fun (x) x + y");
+        msd::Value f = msd::run(adder);
+        CHECK( f.kind == msd::fun_val );
+        CHECK( msd::call(adder, 4).rep == 7 );
+    }
+    SECTION( "Errors" ) {
+        CHECK( embed_error(0) == "free variable: x" );
+        CHECK( embed_error(1) == "no adding booleans" );
+        CHECK( embed_error(2) == "numbers cannot be true/false" );
+        CHECK( embed_error(3) == "expected a close parenthesis" );
+        CHECK( embed_error(4) == "expected end of file at )" );
+        CHECK( embed_error(5) == "out of frames" );
+    }
+}
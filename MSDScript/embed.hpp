@@ -0,0 +1,550 @@
+#ifndef embed_hpp
+#define embed_hpp
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+/* Compile-time embedding. msd::parse() reads a script literal into a
+ fixed table of nodes and msd::run() / msd::call() evaluate it, all as
+ constexpr functions, so
+
+     constexpr auto fib = msd::parse("_let fib = ... _in fib(fib)");
+     constexpr int fib10 = msd::call(fib, 10).rep;
+
+ is worked out by the C++ compiler, and a call with an argument only
+ known at run time parses nothing and allocates nothing: the node table
+ is static data and variables live in a fixed array of frames inside a
+ Machine on the stack. The grammar, values and error messages are the
+ same as parse() and interp(); an error found at compile time stops the
+ build. Header only, and independent of the rest of MSDScript.
+
+ A Machine has 1024 frames unless run() or call() is given another
+ count, as in msd::call<4096>(fib, 10). Tail calls reuse them, so a loop
+ can run any number of times, but a call that is not a tail call holds a
+ frame for its argument, plus one for each curried function it went
+ through, until it returns: `count(count)(n + -1) + 1` runs out at a
+ depth of about 500. */
+namespace msd {
+    typedef enum {
+        num_node,
+        bool_node,
+        var_node,
+        add_node,
+        mult_node,
+        equal_node,
+        let_node,
+        if_node,
+        fun_node,
+        call_node
+    } node_t;
+
+    // A variable name, as a slice of the script text
+    struct Name {
+        const char *text = nullptr;
+        int length = 0;
+
+        constexpr bool operator==(const Name &other) const {
+            if (length != other.length)
+                return false;
+            for (int i = 0; i < length; i++) {
+                if (text[i] != other.text[i])
+                    return false;
+            }
+            return true;
+        }
+
+        std::string str() const {
+            return std::string(text, length);
+        }
+    };
+
+    // Children are indices into the same table: lhs and rhs, rhs and
+    // body of a _let, test, then and else, the body of a _fun, or the
+    // function and argument of a call
+    struct Node {
+        node_t kind = num_node;
+        int rep = 0;
+        Name name;
+        int kids[3] = { -1, -1, -1 };
+    };
+
+    // Every node takes at least one character, so a script of N
+    // characters never needs more than N nodes
+    template <std::size_t N>
+    struct Script {
+        Node nodes[N];
+        int size = 0;
+        int root = -1;
+
+        constexpr int add(Node node) {
+            if (size == (int)N)
+                throw std::runtime_error("script too large");
+            nodes[size] = node;
+            return size++;
+        }
+    };
+
+    template <std::size_t N>
+    class Parser {
+    public:
+        Script<N> script;
+
+        constexpr Parser(const char *text, int length) : script(), text(text), length(length), pos(0) { }
+
+        constexpr void parse() {
+            script.root = expr();
+            if (peek_after_spaces() != '\0')
+                throw std::runtime_error(std::string("expected end of file at ") + text[pos]);
+        }
+
+    private:
+        const char *text;
+        int length;
+        int pos;
+
+        static constexpr bool is_space(char c) {
+            return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+        }
+
+        static constexpr bool is_digit(char c) {
+            return c >= '0' && c <= '9';
+        }
+
+        static constexpr bool is_alpha(char c) {
+            return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+        }
+
+        constexpr char peek_after_spaces() {
+            while (pos < length && is_space(text[pos]))
+                pos++;
+            return pos < length ? text[pos] : '\0';
+        }
+
+        constexpr char get() {
+            return pos < length ? text[pos++] : '\0';
+        }
+
+        constexpr Node node(node_t kind, int a, int b = -1, int c = -1) {
+            Node n;
+            n.kind = kind;
+            n.kids[0] = a;
+            n.kids[1] = b;
+            n.kids[2] = c;
+            return n;
+        }
+
+        constexpr int expr() {
+            int e = comparg();
+            if (peek_after_spaces() == '=') {
+                get();
+                if (get() == '=')
+                    e = script.add(node(equal_node, e, expr()));
+            }
+            return e;
+        }
+
+        constexpr int comparg() {
+            int e = addend();
+            if (peek_after_spaces() == '+') {
+                get();
+                e = script.add(node(add_node, e, comparg()));
+            }
+            return e;
+        }
+
+        constexpr int addend() {
+            int e = multicand();
+            if (peek_after_spaces() == '*') {
+                get();
+                e = script.add(node(mult_node, e, addend()));
+            }
+            return e;
+        }
+
+        constexpr int multicand() {
+            int e = inner();
+            while (peek_after_spaces() == '(') {
+                get();
+                e = script.add(node(call_node, e, expr()));
+                if (peek_after_spaces() != ')')
+                    throw std::runtime_error("expected a close parenthesis");
+                get();
+            }
+            return e;
+        }
+
+        constexpr int inner() {
+            char c = peek_after_spaces();
+            if (c == '(') {
+                get();
+                int e = expr();
+                if (peek_after_spaces() != ')')
+                    throw std::runtime_error("expected a close parenthesis");
+                get();
+                return e;
+            }
+            if (c == '-' || is_digit(c))
+                return number();
+            if (is_alpha(c)) {
+                Node v;
+                v.kind = var_node;
+                v.name = alphabetic();
+                return script.add(v);
+            }
+            if (c == '_') {
+                get();
+                Name keyword = alphabetic();
+                if (keyword == word("let"))
+                    return let();
+                if (keyword == word("in"))
+                    return expr();
+                if (keyword == word("true") || keyword == word("false")) {
+                    Node b;
+                    b.kind = bool_node;
+                    b.rep = keyword == word("true");
+                    return script.add(b);
+                }
+                if (keyword == word("if"))
+                    return if_();
+                if (keyword == word("fun"))
+                    return fun();
+                throw std::runtime_error("unexpected keyword _" + keyword.str());
+            }
+            throw std::runtime_error(std::string("expected a digit or open parenthesis at ") + c);
+        }
+
+        constexpr int number() {
+            bool negative = peek_after_spaces() == '-';
+            if (negative)
+                get();
+            unsigned num = 0;
+            while (pos < length && is_digit(text[pos]))
+                num = num * 10 + (unsigned)(get() - '0');
+            Node n;
+            n.kind = num_node;
+            n.rep = (int)(negative ? 0u - num : num);
+            return script.add(n);
+        }
+
+        constexpr Name alphabetic() {
+            Name name;
+            name.text = text + pos;
+            while (pos < length && is_alpha(text[pos])) {
+                pos++;
+                name.length++;
+            }
+            return name;
+        }
+
+        static constexpr Name word(const char *w) {
+            Name name;
+            name.text = w;
+            while (w[name.length] != '\0')
+                name.length++;
+            return name;
+        }
+
+        constexpr int let() {
+            peek_after_spaces();
+            Name name = alphabetic();
+            peek_after_spaces();
+            get(); // `=`
+            int rhs = expr();
+            int body = expr();
+            Node l = node(let_node, rhs, body);
+            l.name = name;
+            return script.add(l);
+        }
+
+        constexpr void keyword(const char *expected, const char *error) {
+            peek_after_spaces();
+            get();
+            if (!(alphabetic() == word(expected)))
+                throw std::runtime_error(error);
+        }
+
+        constexpr int if_() {
+            int test = expr();
+            keyword("then", "expected keyword _then");
+            int then_part = expr();
+            keyword("else", "expected keyword _else");
+            int else_part = expr();
+            return script.add(node(if_node, test, then_part, else_part));
+        }
+
+        constexpr int fun() {
+            if (peek_after_spaces() != '(')
+                throw std::runtime_error("expected an open parenthesis");
+            get();
+            Name arg = alphabetic();
+            if (peek_after_spaces() != ')')
+                throw std::runtime_error("expected a close parenthesis");
+            get();
+            Node f = node(fun_node, expr());
+            f.name = arg;
+            return script.add(f);
+        }
+    };
+
+    template <std::size_t Len>
+    constexpr Script<Len> parse(const char (&text)[Len]) {
+        Parser<Len> parser(text, (int)Len - 1);
+        parser.parse();
+        return parser.script;
+    }
+
+    typedef enum {
+        num_val,
+        bool_val,
+        fun_val
+    } val_t;
+
+    // A closure is its _fun node and the frame it was made in
+    struct Value {
+        val_t kind = num_val;
+        int rep = 0;
+        int fun = -1;
+        int env = -1;
+
+        static constexpr Value num(int n) {
+            Value v;
+            v.rep = n;
+            return v;
+        }
+
+        static constexpr Value boolean(bool b) {
+            Value v;
+            v.kind = bool_val;
+            v.rep = b;
+            return v;
+        }
+    };
+
+    /* Evaluates one script. Each _let and call pushes a frame. The body
+     of a _let, the branch an _if takes and the function a call enters are
+     evaluated in place rather than by recursion, and before entering a
+     function and when eval() returns, the frames pushed since eval()
+     started are compacted down to those its values still reach. So a loop
+     of tail calls runs in a fixed number of frames, while each call still
+     waiting on another keeps its frames until it returns. Needing more
+     than `Frames` at once throws "out of frames". */
+    template <std::size_t N, int Frames = 1024>
+    class Machine {
+    public:
+        constexpr Machine(const Script<N> &script) : script(script), frames(), used(0), forward() { }
+
+        constexpr Value eval(int e, int env) {
+            int mark = used;
+            for (;;) {
+                const Node &n = script.nodes[e];
+                Value result;
+                switch (n.kind) {
+                    case num_node:
+                        used = mark;
+                        return Value::num(n.rep);
+                    case bool_node:
+                        used = mark;
+                        return Value::boolean(n.rep);
+                    case var_node:
+                        result = lookup(n.name, env);
+                        return keep(mark, result);
+                    case add_node: {
+                        Value lhs = eval(n.kids[0], env);
+                        Value rhs = eval(n.kids[1], env);
+                        number_check(lhs, rhs, "no adding booleans", "no adding functions");
+                        used = mark;
+                        return Value::num((int)((unsigned)lhs.rep + (unsigned)rhs.rep));
+                    }
+                    case mult_node: {
+                        Value lhs = eval(n.kids[0], env);
+                        Value rhs = eval(n.kids[1], env);
+                        number_check(lhs, rhs, "no multiplying booleans", "no multiplying functions");
+                        used = mark;
+                        return Value::num((int)((unsigned)lhs.rep * (unsigned)rhs.rep));
+                    }
+                    case equal_node: {
+                        Value lhs = eval(n.kids[0], env);
+                        Value rhs = eval(n.kids[1], env);
+                        used = mark;
+                        return Value::boolean(equals(lhs, rhs));
+                    }
+                    case let_node: {
+                        Value rhs = eval(n.kids[0], env);
+                        env = bind(n.name, rhs, env);
+                        e = n.kids[1];
+                        break;
+                    }
+                    case if_node: {
+                        Value test = eval(n.kids[0], env);
+                        if (test.kind == num_val)
+                            throw std::runtime_error("numbers cannot be true/false");
+                        if (test.kind == fun_val)
+                            throw std::runtime_error("functions cannot be true/false");
+                        e = n.kids[test.rep ? 1 : 2];
+                        break;
+                    }
+                    case fun_node:
+                        result.kind = fun_val;
+                        result.fun = e;
+                        result.env = env;
+                        return keep(mark, result);
+                    case call_node: {
+                        Value f = eval(n.kids[0], env);
+                        Value arg = eval(n.kids[1], env);
+                        callable_check(f);
+                        // The frames this call replaces are dead unless
+                        // the function or its argument reaches them
+                        compact(mark, f, arg);
+                        const Node &fun = script.nodes[f.fun];
+                        env = bind(fun.name, arg, f.env);
+                        e = fun.kids[0];
+                        break;
+                    }
+                    default:
+                        throw std::runtime_error("unknown node");
+                }
+            }
+        }
+
+        constexpr Value call(Value f, Value arg) {
+            callable_check(f);
+            const Node &fun = script.nodes[f.fun];
+            int mark = used;
+            Value result = eval(fun.kids[0], bind(fun.name, arg, f.env));
+            return keep(mark, result);
+        }
+
+    private:
+        struct Frame {
+            Name name;
+            Value val;
+            int rest = -1;
+        };
+
+        const Script<N> &script;
+        Frame frames[Frames];
+        int used;
+        // Where compact() moves each frame, or -1 for one it drops
+        int forward[Frames];
+
+        constexpr int bind(Name name, Value val, int rest) {
+            if (used == Frames)
+                throw std::runtime_error("out of frames");
+            frames[used].name = name;
+            frames[used].val = val;
+            frames[used].rest = rest;
+            return used++;
+        }
+
+        constexpr Value keep(int mark, Value result) {
+            Value none;
+            compact(mark, result, none);
+            return result;
+        }
+
+        /* Drops the frames from `mark` up that neither `a` nor `b` reaches
+         and slides the rest down, fixing up the indices that point at
+         them. A frame only points at older ones, so one pass from the top
+         finds them all. */
+        constexpr void compact(int mark, Value &a, Value &b) {
+            for (int f = mark; f < used; f++)
+                forward[f] = -1;
+            reach(mark, a.env);
+            reach(mark, b.env);
+            for (int f = used - 1; f >= mark; f--) {
+                if (forward[f] == -1)
+                    continue;
+                reach(mark, frames[f].rest);
+                if (frames[f].val.kind == fun_val)
+                    reach(mark, frames[f].val.env);
+            }
+            int to = mark;
+            for (int f = mark; f < used; f++) {
+                if (forward[f] == -1)
+                    continue;
+                forward[f] = to;
+                frames[to] = frames[f];
+                frames[to].rest = moved(mark, frames[to].rest);
+                frames[to].val.env = moved(mark, frames[to].val.env);
+                to++;
+            }
+            a.env = moved(mark, a.env);
+            b.env = moved(mark, b.env);
+            used = to;
+        }
+
+        constexpr void reach(int mark, int env) {
+            if (env != -1 && env >= mark)
+                forward[env] = 0;
+        }
+
+        constexpr int moved(int mark, int env) const {
+            return env != -1 && env >= mark ? forward[env] : env;
+        }
+
+        constexpr Value lookup(Name name, int env) {
+            for (int f = env; f != -1; f = frames[f].rest) {
+                if (frames[f].name == name)
+                    return frames[f].val;
+            }
+            throw std::runtime_error("free variable: " + name.str());
+        }
+
+        static constexpr void callable_check(Value f) {
+            if (f.kind == num_val)
+                throw std::runtime_error("cannot call on a number");
+            if (f.kind == bool_val)
+                throw std::runtime_error("cannot call on a boolean");
+        }
+
+        static constexpr void number_check(Value lhs, Value rhs, const char *bool_error, const char *fun_error) {
+            if (lhs.kind == bool_val)
+                throw std::runtime_error(bool_error);
+            if (lhs.kind == fun_val)
+                throw std::runtime_error(fun_error);
+            if (rhs.kind != num_val)
+                throw std::runtime_error("not a number");
+        }
+
+        // Functions compare by their text, like FunVal::equals
+        constexpr bool equals(Value lhs, Value rhs) {
+            if (lhs.kind != rhs.kind)
+                return false;
+            if (lhs.kind != fun_val)
+                return lhs.rep == rhs.rep;
+            return same_tree(lhs.fun, rhs.fun);
+        }
+
+        constexpr bool same_tree(int a, int b) {
+            if (a == b)
+                return true;
+            if (a == -1 || b == -1)
+                return false;
+            const Node &x = script.nodes[a];
+            const Node &y = script.nodes[b];
+            if (x.kind != y.kind || x.rep != y.rep || !(x.name == y.name))
+                return false;
+            for (int i = 0; i < 3; i++) {
+                if (!same_tree(x.kids[i], y.kids[i]))
+                    return false;
+            }
+            return true;
+        }
+    };
+
+    template <int Frames = 1024, std::size_t N>
+    constexpr Value run(const Script<N> &script) {
+        Machine<N, Frames> machine(script);
+        return machine.eval(script.root, -1);
+    }
+
+    // Calls the function a script evaluates to with a number
+    template <int Frames = 1024, std::size_t N>
+    constexpr Value call(const Script<N> &script, int arg) {
+        Machine<N, Frames> machine(script);
+        return machine.call(machine.eval(script.root, -1), Value::num(arg));
+    }
+}
+
+#endif /* embed_hpp */
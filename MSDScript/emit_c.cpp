@@ -0,0 +1,483 @@
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "emit_c.hpp"
+#include "expr.hpp"
+#include "pass.hpp"
+#include "value.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+
+/* Numbers are odd words holding the value shifted left once, so
+ arithmetic never allocates; booleans and closures are pointers to
+ objects starting with a tag. A call in tail position returns MSD_TAIL
+ after saving its function and argument, and msd_call() keeps calling
+ until it gets a real value, so tail recursion runs in constant stack.
+ Closures live in an arena that is freed when msd_run() returns, and
+ each _fun reuses the last closure it made when the captured values are
+ the same, so an f(f)(n) loop makes one closure instead of one per turn.
+ Closures capturing new values each time still add up until the end.
+ _spawn makes a future holding a closure over its body, which _await
+ runs the first time, so futures are evaluated in order on one thread
+ and one nobody awaits never runs. _fold is a loop calling f(acc)(i).
+ Errors longjmp back to msd_run() with the interpreter's message. */
+static const char *runtime = R"RUNTIME(#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef intptr_t msd_val;
+typedef msd_val (*msd_code)(msd_val *env, msd_val arg);
+
+enum { MSD_BOOL_TAG = 1, MSD_FUN_TAG = 2, MSD_FUTURE_TAG = 3 };
+typedef struct { int tag; int rep; } msd_bool;
+typedef struct { int tag; msd_code code; const char *source; msd_val env[1]; } msd_fun;
+/* `body` is the closure until `done`, then the value */
+typedef struct { int tag; int done; msd_val body; } msd_future;
+
+enum { MSD_RESULT_NUM, MSD_RESULT_BOOL, MSD_RESULT_FUN, MSD_RESULT_ERROR };
+typedef struct { int kind; int num; const char *text; long heap; int futures; } msd_result;
+
+#define MSD_INT(n) ((msd_val)(((uintptr_t)(intptr_t)(int)(n) << 1) | 1))
+#define MSD_IS_INT(v) ((v) & 1)
+#define MSD_NUM(v) ((int)((v) >> 1))
+#define MSD_TAG(v) (*(int *)(v))
+#define MSD_TAIL ((msd_val)0)
+
+static msd_bool msd_true_obj = { MSD_BOOL_TAG, 1 };
+static msd_bool msd_false_obj = { MSD_BOOL_TAG, 0 };
+#define MSD_TRUE ((msd_val)&msd_true_obj)
+#define MSD_FALSE ((msd_val)&msd_false_obj)
+
+static struct {
+    jmp_buf fail;
+    char message[256];
+    char *stack_limit;
+    msd_val tail_fun;
+    msd_val tail_arg;
+    char *chunks;
+    size_t used;
+    size_t size;
+    long heap;
+} msd_rt;
+
+static inline void msd_fail(const char *message) {
+    snprintf(msd_rt.message, sizeof msd_rt.message, "%s", message);
+    longjmp(msd_rt.fail, 1);
+}
+
+static inline msd_val msd_free_var(const char *name) {
+    snprintf(msd_rt.message, sizeof msd_rt.message, "free variable: %s", name);
+    longjmp(msd_rt.fail, 1);
+    return 0;
+}
+
+/* Chunks are chained through their first word */
+static inline void *msd_alloc(size_t size) {
+    void *p;
+    size = (size + 15) & ~(size_t)15;
+    if (msd_rt.chunks == NULL || msd_rt.used + size > msd_rt.size) {
+        size_t chunk = size + 16 > 65536 ? size + 16 : 65536;
+        char *mem = (char *)malloc(chunk);
+        if (mem == NULL)
+            msd_fail("out of memory");
+        *(char **)mem = msd_rt.chunks;
+        msd_rt.chunks = mem;
+        msd_rt.used = 16;
+        msd_rt.size = chunk;
+        msd_rt.heap += (long)chunk;
+    }
+    p = msd_rt.chunks + msd_rt.used;
+    msd_rt.used += size;
+    return p;
+}
+
+static inline void msd_free_all(void) {
+    while (msd_rt.chunks != NULL) {
+        char *next = *(char **)msd_rt.chunks;
+        free(msd_rt.chunks);
+        msd_rt.chunks = next;
+    }
+}
+
+/* Closures never change, so one capturing the same values as `*last`
+   can be that one */
+static inline msd_val msd_closure(msd_fun **last, msd_code code, const char *source, int n, ...) {
+    va_list ap;
+    int i;
+    msd_fun *f = *last;
+    if (f != NULL) {
+        va_start(ap, n);
+        for (i = 0; i < n && f->env[i] == va_arg(ap, msd_val); i++)
+            ;
+        va_end(ap);
+        if (i == n)
+            return (msd_val)f;
+    }
+    f = (msd_fun *)msd_alloc(offsetof(msd_fun, env) + (n > 0 ? n : 1) * sizeof(msd_val));
+    f->tag = MSD_FUN_TAG;
+    f->code = code;
+    f->source = source;
+    va_start(ap, n);
+    for (i = 0; i < n; i++)
+        f->env[i] = va_arg(ap, msd_val);
+    va_end(ap);
+    *last = f;
+    return (msd_val)f;
+}
+
+static inline int msd_truth(msd_val v) {
+    if (MSD_IS_INT(v))
+        msd_fail("numbers cannot be true/false");
+    if (MSD_TAG(v) == MSD_FUN_TAG)
+        msd_fail("functions cannot be true/false");
+    if (MSD_TAG(v) == MSD_FUTURE_TAG)
+        msd_fail("futures cannot be true/false");
+    return ((msd_bool *)v)->rep;
+}
+
+static inline msd_val msd_add(msd_val a, msd_val b) {
+    if (MSD_IS_INT(a) && MSD_IS_INT(b))
+        return MSD_INT((unsigned)MSD_NUM(a) + (unsigned)MSD_NUM(b));
+    if (MSD_IS_INT(a))
+        msd_fail("not a number");
+    msd_fail(MSD_TAG(a) == MSD_BOOL_TAG ? "no adding booleans"
+             : MSD_TAG(a) == MSD_FUTURE_TAG ? "no adding futures" : "no adding functions");
+    return 0;
+}
+
+static inline msd_val msd_mult(msd_val a, msd_val b) {
+    if (MSD_IS_INT(a) && MSD_IS_INT(b))
+        return MSD_INT((unsigned)MSD_NUM(a) * (unsigned)MSD_NUM(b));
+    if (MSD_IS_INT(a))
+        msd_fail("not a number");
+    msd_fail(MSD_TAG(a) == MSD_BOOL_TAG ? "no multiplying booleans"
+             : MSD_TAG(a) == MSD_FUTURE_TAG ? "no multiplying futures" : "no multiplying functions");
+    return 0;
+}
+
+static inline msd_val msd_tail(msd_val f, msd_val arg) {
+    msd_rt.tail_fun = f;
+    msd_rt.tail_arg = arg;
+    return MSD_TAIL;
+}
+
+static inline msd_val msd_call(msd_val f, msd_val arg) {
+    char here;
+    if (&here < msd_rt.stack_limit)
+        msd_fail("native stack exhausted");
+    for (;;) {
+        msd_val result;
+        if (MSD_IS_INT(f))
+            msd_fail("cannot call on a number");
+        if (MSD_TAG(f) == MSD_BOOL_TAG)
+            msd_fail("cannot call on a boolean");
+        if (MSD_TAG(f) == MSD_FUTURE_TAG)
+            msd_fail("cannot call on a future");
+        result = ((msd_fun *)f)->code(((msd_fun *)f)->env, arg);
+        if (result != MSD_TAIL)
+            return result;
+        f = msd_rt.tail_fun;
+        arg = msd_rt.tail_arg;
+    }
+}
+
+static inline msd_val msd_spawn(msd_val body) {
+    msd_future *f = (msd_future *)msd_alloc(sizeof(msd_future));
+    f->tag = MSD_FUTURE_TAG;
+    f->done = 0;
+    f->body = body;
+    return (msd_val)f;
+}
+
+static inline msd_val msd_await(msd_val v) {
+    msd_future *f = (msd_future *)v;
+    if (MSD_IS_INT(v) || MSD_TAG(v) != MSD_FUTURE_TAG)
+        msd_fail("not a future");
+    if (!f->done) {
+        f->body = msd_call(f->body, MSD_INT(0));
+        f->done = 1;
+    }
+    return f->body;
+}
+
+/* Functions are equal when they have the same text, like FunVal::equals,
+   and futures when their values are */
+static inline msd_val msd_equal(msd_val a, msd_val b) {
+    int same;
+    if (a == b)
+        same = 1;
+    else if (MSD_IS_INT(a) || MSD_IS_INT(b) || MSD_TAG(a) != MSD_TAG(b) || MSD_TAG(a) == MSD_BOOL_TAG)
+        same = 0;
+    else if (MSD_TAG(a) == MSD_FUTURE_TAG)
+        return msd_equal(msd_await(a), msd_await(b));
+    else
+        same = strcmp(((msd_fun *)a)->source, ((msd_fun *)b)->source) == 0;
+    return same ? MSD_TRUE : MSD_FALSE;
+}
+
+static inline msd_val msd_fold(msd_val f, msd_val init, msd_val lo, msd_val hi) {
+    msd_val acc = init;
+    long i;
+    if (!MSD_IS_INT(lo) || !MSD_IS_INT(hi))
+        msd_fail("fold bounds must be numbers");
+    for (i = MSD_NUM(lo); i < MSD_NUM(hi); i++)
+        acc = msd_call(msd_call(f, acc), MSD_INT(i));
+    return acc;
+}
+
+static msd_val msd_program(void);
+static void msd_forget_closures(void);
+
+#ifdef __cplusplus
+extern "C"
+#endif
+#ifdef __GNUC__
+__attribute__((visibility("default")))
+#endif
+void msd_run(msd_result *out, long stack_budget) {
+    char base;
+    msd_rt.stack_limit = &base - stack_budget;
+    msd_rt.chunks = NULL;
+    msd_rt.heap = 0;
+    msd_forget_closures();
+    if (setjmp(msd_rt.fail) == 0) {
+        msd_val v = msd_program();
+        if (v == MSD_TAIL)
+            v = msd_call(msd_rt.tail_fun, msd_rt.tail_arg);
+        out->futures = 0;
+        for (; !MSD_IS_INT(v) && MSD_TAG(v) == MSD_FUTURE_TAG; out->futures++)
+            v = msd_await(v);
+        if (MSD_IS_INT(v)) {
+            out->kind = MSD_RESULT_NUM;
+            out->num = MSD_NUM(v);
+        } else if (MSD_TAG(v) == MSD_BOOL_TAG) {
+            out->kind = MSD_RESULT_BOOL;
+            out->num = ((msd_bool *)v)->rep;
+        } else {
+            out->kind = MSD_RESULT_FUN;
+            out->text = ((msd_fun *)v)->source;
+        }
+    } else {
+        out->kind = MSD_RESULT_ERROR;
+        out->text = msd_rt.message;
+    }
+    out->heap = msd_rt.heap;
+    msd_free_all();
+}
+)RUNTIME";
+
+namespace {
+    // Where each variable in scope lives in the generated C: `arg`,
+    // `env[i]` or a local
+    typedef std::map<Symbol, std::string> CScope;
+    
+    class CEmitter {
+    public:
+        std::string functions;
+        // Closures made so far, each with its own msd_last_closure slot
+        int next_fun;
+        
+        CEmitter() : next_fun(0), next_temp(0) { }
+        
+        // Appends statements to `code` that end by returning `e`
+        void tail(PTR(Expr) e, const CScope &scope, std::string &code, std::string indent) {
+            if (PTR(IfExpr) i = CAST(IfExpr)(e)) {
+                std::string test = value(i->test_part, scope, code, indent);
+                code += indent + "if (msd_truth(" + test + ")) {\n";
+                tail(i->then_part, scope, code, indent + "    ");
+                code += indent + "} else {\n";
+                tail(i->else_part, scope, code, indent + "    ");
+                code += indent + "}\n";
+            } else if (PTR(LetExpr) l = CAST(LetExpr)(e)) {
+                CScope inner = scope;
+                inner[l->name] = value(l->rhs, scope, code, indent);
+                tail(l->body, inner, code, indent);
+            } else if (PTR(CallExpr) c = CAST(CallExpr)(e)) {
+                std::string f = value(c->to_be_called, scope, code, indent);
+                std::string a = value(c->actual_arg, scope, code, indent);
+                code += indent + "return msd_tail(" + f + ", " + a + ");\n";
+            } else {
+                code += indent + "return " + value(e, scope, code, indent) + ";\n";
+            }
+        }
+        
+        // Appends statements to `code` computing `e` in order and returns
+        // a constant, `arg`, `env[i]` or a local holding its value
+        std::string value(PTR(Expr) e, const CScope &scope, std::string &code, std::string indent) {
+            if (PTR(NumExpr) n = CAST(NumExpr)(e))
+                return "MSD_INT(" + std::to_string(n->rep) + ")";
+            if (PTR(BoolExpr) b = CAST(BoolExpr)(e))
+                return b->rep ? "MSD_TRUE" : "MSD_FALSE";
+            if (PTR(VarExpr) v = CAST(VarExpr)(e)) {
+                auto found = scope.find(v->name);
+                if (found != scope.end())
+                    return found->second;
+                return temp("msd_free_var(" + quote(v->name.str()) + ")", code, indent);
+            }
+            if (PTR(AddExpr) a = CAST(AddExpr)(e))
+                return binary("msd_add", a->lhs, a->rhs, scope, code, indent);
+            if (PTR(MultExpr) m = CAST(MultExpr)(e))
+                return binary("msd_mult", m->lhs, m->rhs, scope, code, indent);
+            if (PTR(EqualExpr) q = CAST(EqualExpr)(e))
+                return binary("msd_equal", q->lhs, q->rhs, scope, code, indent);
+            if (PTR(CallExpr) c = CAST(CallExpr)(e))
+                return binary("msd_call", c->to_be_called, c->actual_arg, scope, code, indent);
+            if (PTR(LetExpr) l = CAST(LetExpr)(e)) {
+                CScope inner = scope;
+                inner[l->name] = value(l->rhs, scope, code, indent);
+                return value(l->body, inner, code, indent);
+            }
+            if (PTR(IfExpr) i = CAST(IfExpr)(e)) {
+                std::string test = value(i->test_part, scope, code, indent);
+                std::string t = "t" + std::to_string(next_temp++);
+                code += indent + "msd_val " + t + ";\n";
+                code += indent + "if (msd_truth(" + test + ")) {\n";
+                std::string then_val = value(i->then_part, scope, code, indent + "    ");
+                code += indent + "    " + t + " = " + then_val + ";\n";
+                code += indent + "} else {\n";
+                std::string else_val = value(i->else_part, scope, code, indent + "    ");
+                code += indent + "    " + t + " = " + else_val + ";\n";
+                code += indent + "}\n";
+                return t;
+            }
+            if (PTR(FunExpr) f = CAST(FunExpr)(e))
+                return closure(f, scope, code, indent);
+            if (PTR(FoldExpr) d = CAST(FoldExpr)(e)) {
+                std::string f = value(d->fun, scope, code, indent);
+                std::string init = value(d->init, scope, code, indent);
+                std::string lo = value(d->lo, scope, code, indent);
+                std::string hi = value(d->hi, scope, code, indent);
+                return temp("msd_fold(" + f + ", " + init + ", " + lo + ", " + hi + ")", code, indent);
+            }
+            if (PTR(SpawnExpr) s = CAST(SpawnExpr)(e)) {
+                // The body becomes a _fun whose argument it never uses
+                PTR(FunExpr) body = NEW(FunExpr)(Symbol("_spawn"), s->expr);
+                return temp("msd_spawn(" + closure(body, scope, code, indent) + ")", code, indent);
+            }
+            if (PTR(AwaitExpr) a = CAST(AwaitExpr)(e))
+                return temp("msd_await(" + value(a->expr, scope, code, indent) + ")", code, indent);
+            throw std::runtime_error("emit_c: unknown expression");
+        }
+        
+    private:
+        int next_temp;
+        
+        std::string temp(std::string rhs, std::string &code, std::string indent) {
+            std::string t = "t" + std::to_string(next_temp++);
+            code += indent + "msd_val " + t + " = " + rhs + ";\n";
+            return t;
+        }
+        
+        std::string binary(std::string fn, PTR(Expr) lhs, PTR(Expr) rhs, const CScope &scope, std::string &code, std::string indent) {
+            std::string a = value(lhs, scope, code, indent);
+            std::string b = value(rhs, scope, code, indent);
+            return temp(fn + "(" + a + ", " + b + ")", code, indent);
+        }
+        
+        // Emits the _fun as its own C function and returns a local
+        // holding a closure over the variables it uses
+        std::string closure(PTR(FunExpr) f, const CScope &scope, std::string &code, std::string indent) {
+            int id = next_fun++;
+            std::string name = "fun_" + std::to_string(id);
+            std::vector<std::string> captured;
+            CScope inner;
+            for (const std::string &var : free_vars(f)) {
+                auto found = scope.find(var);
+                if (found == scope.end())
+                    continue;
+                inner[var] = "env[" + std::to_string(captured.size()) + "]";
+                captured.push_back(found->second);
+            }
+            inner[f->formal_arg] = "arg";
+            
+            std::string body;
+            tail(f->body, inner, body, "    ");
+            functions += "static msd_val " + name + "(msd_val *env, msd_val arg) {\n"
+                + "    (void)env;\n" + body + "}\n\n";
+            
+            std::string make = "msd_closure(&msd_last_closure[" + std::to_string(id) + "], " + name + ", " + quote("_fun (" + f->formal_arg.str() + ") " + f->body->to_string()) + ", " + std::to_string(captured.size());
+            for (const std::string &c : captured)
+                make += ", " + c;
+            return temp(make + ")", code, indent);
+        }
+        
+        static std::string quote(std::string s) {
+            std::string out = "\"";
+            for (char c : s) {
+                if (c == '"' || c == '\\')
+                    out += '\\';
+                if (c == '\n')
+                    out += "\\n";
+                else
+                    out += c;
+            }
+            return out + "\"";
+        }
+    };
+}
+
+void emit_c(PTR(Expr) e, std::ostream &out) {
+    CEmitter emitter;
+    std::string body;
+    emitter.tail(e, CScope(), body, "    ");
+    int slots = std::max(emitter.next_fun, 1);
+    out << "/* Generated by msdscript --emit-c */\n" << runtime << "\n"
+        << "static msd_fun *msd_last_closure[" << slots << "];\n\n"
+        << "static void msd_forget_closures(void) {\n"
+        << "    memset(msd_last_closure, 0, sizeof msd_last_closure);\n"
+        << "}\n\n"
+        << emitter.functions
+        << "static msd_val msd_program(void) {\n" << body << "}\n";
+}
+
+static std::string emit_c_str(std::string s) {
+    std::ostringstream out;
+    emit_c(parse_str(s), out);
+    std::string c = out.str();
+    return c.substr(c.find("static msd_val msd_program(void);"));
+}
+
+TEST_CASE( "emit_c" ) {
+    SECTION( "Program" ) {
+        std::string c = emit_c_str("1 + 2 * x");
+        CHECK( c.find("static msd_val msd_program(void) {\n"
+                      "    msd_val t0 = msd_free_var(\"x\");\n"
+                      "    msd_val t1 = msd_mult(MSD_INT(2), t0);\n"
+                      "    msd_val t2 = msd_add(MSD_INT(1), t1);\n"
+                      "    return t2;\n"
+                      "}\n") != std::string::npos );
+    }
+    SECTION( "Closures capture only what they use" ) {
+        std::string c = emit_c_str("_let y = 3 _in _let z = 4 _in _fun (x) x + y");
+        CHECK( c.find("static msd_val fun_0(msd_val *env, msd_val arg) {\n"
+                      "    (void)env;\n"
+                      "    msd_val t0 = msd_add(arg, env[0]);\n"
+                      "    return t0;\n"
+                      "}\n") != std::string::npos );
+        CHECK( c.find("msd_closure(&msd_last_closure[0], fun_0, \"_fun (x) (x + y)\", 1, MSD_INT(3))") != std::string::npos );
+    }
+    SECTION( "Tail calls" ) {
+        std::string c = emit_c_str("_let f = _fun (f) _fun (n) _if n == 0 _then 0 _else f(f)(n + -1) _in f(f)(10)");
+        CHECK( c.find("return msd_tail(") != std::string::npos );
+        CHECK( c.find("msd_call(") != std::string::npos );
+    }
+    SECTION( "Folds and futures" ) {
+        std::string c = emit_c_str("_fold(_fun (a) _fun (i) a + i, 0, 1, 10)");
+        CHECK( c.find("msd_val t3 = msd_fold(t2, MSD_INT(0), MSD_INT(1), MSD_INT(10));\n") != std::string::npos );
+        c = emit_c_str("_let y = 2 _in _await _spawn y + 1");
+        CHECK( c.find("static msd_val fun_0(msd_val *env, msd_val arg) {\n"
+                      "    (void)env;\n"
+                      "    msd_val t0 = msd_add(env[0], MSD_INT(1));\n"
+                      "    return t0;\n"
+                      "}\n") != std::string::npos );
+        CHECK( c.find("msd_val t2 = msd_spawn(t1);") != std::string::npos );
+        CHECK( c.find("msd_val t3 = msd_await(t2);") != std::string::npos );
+    }
+}
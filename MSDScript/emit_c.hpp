@@ -0,0 +1,16 @@
+#ifndef emit_c_hpp
+#define emit_c_hpp
+
+#include <iostream>
+#include "macros.hpp"
+
+class Expr;
+
+// Ahead of time compilation. Writes `e` as one standalone C translation
+// unit: the runtime (tagged integers, booleans, closures, a trampoline
+// for tail calls and an arena freed after every run) followed by one C
+// function per _fun and the program itself. Compiled as a shared object,
+// it exports `msd_run`, which NativeProgram loads
+void emit_c(PTR(Expr) e, std::ostream &out);
+
+#endif /* emit_c_hpp */
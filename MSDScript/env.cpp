@@ -1,20 +1,34 @@
+#include <stdexcept>
 #include "env.hpp"
+#include "value.hpp"
+
+PTR(Env) Env::empty = IMMORTAL(NEW(EmptyEnv)());
 
 EmptyEnv::EmptyEnv() {}
 
-PTR(Val) EmptyEnv::lookup(std::string find_name) {
-    throw std::runtime_error("free variable: " + find_name);
+PTR(Val) EmptyEnv::lookup(Symbol find_name) {
+    throw std::runtime_error("free variable: " + find_name.str());
 }
 
-ExtendedEnv::ExtendedEnv(std::string name, PTR(Val) val, PTR(Env) rest) {
+ExtendedEnv::ExtendedEnv(Symbol name, PTR(Val) val, PTR(Env) rest) {
     this->name = name;
     this->val = val;
     this->rest = rest;
 }
 
-PTR(Val) ExtendedEnv::lookup(std::string find_name) {
+PTR(Val) ExtendedEnv::lookup(Symbol find_name) {
     if(find_name == name)
         return val;
     else
         return rest->lookup(find_name);
 }
+
+void ExtendedEnv::gc_children(std::vector<Collectable*> &out) {
+    gc_child(out, val);
+    gc_child(out, rest);
+}
+
+void ExtendedEnv::gc_clear() {
+    val = nullptr;
+    rest = nullptr;
+}
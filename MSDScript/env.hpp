@@ -2,31 +2,36 @@
 #define env_hpp
 
 #include "macros.hpp"
-#include <string>
+#include "symbol.hpp"
+#include "gc.hpp"
 
 class Val;
 
 // Creates a "dictionary" of bound variables for quicker calculation
 // lookup stores values of bound variables, errors out when unbound is foun
-class Env ENABLE_THIS(Env) {
+class Env COLLECTABLE(Env) {
 public:
-    virtual PTR(Val) lookup(std::string find_name) = 0;
+    virtual PTR(Val) lookup(Symbol find_name) = 0;
+    // Shared empty Env for closures that capture nothing
+    static PTR(Env) empty;
 };
 
 class EmptyEnv : public Env {
 public:
     EmptyEnv();
-    PTR(Val) lookup(std::string find_name);
+    PTR(Val) lookup(Symbol find_name);
 };
 
 class ExtendedEnv : public Env {
 public:
-    std::string name;
+    Symbol name;
     PTR(Val) val;
     PTR(Env) rest;
     
-    ExtendedEnv(std::string name, PTR(Val) val, PTR(Env) rest);
-    PTR(Val) lookup(std::string find_name);
+    ExtendedEnv(Symbol name, PTR(Val) val, PTR(Env) rest);
+    PTR(Val) lookup(Symbol find_name);
+    void gc_children(std::vector<Collectable*> &out);
+    void gc_clear();
 };
 
 #endif /* env_hpp */
@@ -0,0 +1,127 @@
+#include <sstream>
+#include <string>
+#include <vector>
+#include "escape.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+#include "env.hpp"
+#include "step.hpp"
+#include "lift.hpp"
+#include "pass.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+
+// Rebuilds `e` with its marks set and reports whether evaluating it can
+// make a closure over the current Env
+static PTR(Expr) escape_rec(PTR(Expr) e, bool &captures) {
+    std::vector<PTR(Expr)> kids = expr_children(e);
+    std::vector<bool> kid_captures(kids.size());
+    captures = false;
+    for (size_t i = 0; i < kids.size(); i++) {
+        bool kid = false;
+        kids[i] = escape_rec(kids[i], kid);
+        kid_captures[i] = kid;
+        captures = captures || kid;
+    }
+    
+    if (PTR(LetExpr) l = CAST(LetExpr)(e)) {
+        PTR(LetExpr) marked = NEW(LetExpr)(l->name, kids[0], kids[1]);
+        marked->stack_frame = !kid_captures[1];
+        return marked;
+    }
+    if (PTR(FunExpr) f = CAST(FunExpr)(e)) {
+        PTR(FunExpr) marked = NEW(FunExpr)(f->formal_arg, kids[0]);
+        marked->stack_frame = !kid_captures[0];
+        if (f->lifted != nullptr) {
+            PTR(FunVal) lifted = NEW(FunVal)(f->formal_arg, kids[0], Env::empty);
+            lifted->stack_frame = marked->stack_frame;
+            marked->lifted = lifted;
+        } else {
+            captures = true;
+        }
+        return marked;
+    }
+    if (PTR(CallExpr) c = CAST(CallExpr)(e)) {
+        PTR(CallExpr) marked = NEW(CallExpr)(kids[0], kids[1]);
+        PTR(FunExpr) fun = CAST(FunExpr)(kids[0]);
+        if (fun != nullptr && fun->lifted == nullptr) {
+            // The closure is called and dropped, so it captures nothing
+            // that outlives this call beyond what its body captures
+            marked->stack_closure = true;
+            captures = kid_captures[1] || !fun->stack_frame;
+        }
+        return marked;
+    }
+    return expr_with_children(e, kids);
+}
+
+PTR(Expr) escape_analysis(PTR(Expr) e) {
+    bool captures = false;
+    return escape_rec(e, captures);
+}
+
+static PTR(Expr) escape_str(std::string s) {
+    return escape_analysis(lift(parse_str(s)));
+}
+
+TEST_CASE( "Escape analysis" ) {
+    SECTION( "Let frames" ) {
+        PTR(LetExpr) l = CAST(LetExpr)(escape_str("_let x = 1 _in x + 2"));
+        REQUIRE( l != nullptr );
+        CHECK( l->stack_frame );
+        l = CAST(LetExpr)(escape_str("_let x = 1 _in _fun (y) x + y"));
+        REQUIRE( l != nullptr );
+        CHECK( ! l->stack_frame );
+        // A lifted function captures nothing
+        l = CAST(LetExpr)(escape_str("_let x = 1 _in _fun (y) y"));
+        REQUIRE( l != nullptr );
+        CHECK( l->stack_frame );
+        // The rhs is evaluated before the frame exists
+        l = CAST(LetExpr)(escape_str("_let f = _fun (y) y + z _in f(1)"));
+        REQUIRE( l != nullptr );
+        CHECK( l->stack_frame );
+    }
+    SECTION( "Call frames" ) {
+        PTR(LetExpr) count = CAST(LetExpr)(escape_str("_let count = _fun (count) _fun (n) _if n == 0 _then 0 _else 1 + count(count)(n + -1) _in count(count)(10)"));
+        REQUIRE( count != nullptr );
+        PTR(FunExpr) outer = CAST(FunExpr)(count->rhs);
+        REQUIRE( outer != nullptr );
+        PTR(FunExpr) inner = CAST(FunExpr)(outer->body);
+        REQUIRE( inner != nullptr );
+        CHECK( outer->lifted != nullptr );
+        CHECK( CAST(FunVal)(outer->lifted)->stack_frame == false );
+        CHECK( inner->stack_frame );
+        CHECK( inner->interp(NEW(EmptyEnv)())->call(NEW(NumVal)(0))
+              ->equals(NEW(NumVal)(0)) );
+    }
+    SECTION( "Closures called in place" ) {
+        PTR(CallExpr) c = CAST(CallExpr)(escape_str("(_fun (x) x + y)(3)"));
+        REQUIRE( c != nullptr );
+        CHECK( c->stack_closure );
+        PTR(LetExpr) l = CAST(LetExpr)(escape_str("_let y = 2 _in (_fun (x) x + y)(3)"));
+        REQUIRE( l != nullptr );
+        CHECK( l->stack_frame );
+        l = CAST(LetExpr)(escape_str("_let y = 2 _in (_fun (x) _fun (z) x + y)(3)"));
+        REQUIRE( l != nullptr );
+        CHECK( ! l->stack_frame );
+    }
+    SECTION( "Same result" ) {
+        std::string programs[] = {
+            "_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1 _else fib(fib)(x + -1) + fib(fib)(x + -2) _in fib(fib)(10)",
+            "_let y = 2 _in (_fun (x) x + y)(3)",
+            "_let add = _fun (a) _fun (b) a + b _in _let inc = add(1) _in inc(inc(5))",
+            "_let y = 2 _in (_fun (x) _fun (z) x + y + z)(3)(4)"
+        };
+        int expected[] = { 89, 5, 7, 9 };
+        for (int i = 0; i < 4; i++) {
+            std::istringstream in(programs[i]);
+            PTR(Expr) plain = parse(in);
+            PTR(Expr) marked = escape_str(programs[i]);
+            CHECK( marked->interp(NEW(EmptyEnv)())
+                  ->equals(NEW(NumVal)(expected[i])) );
+            CHECK( Step::interp_by_steps(marked)
+                  ->equals(NEW(NumVal)(expected[i])) );
+            CHECK( marked->to_string() == plain->to_string() );
+        }
+    }
+}
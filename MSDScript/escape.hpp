@@ -0,0 +1,15 @@
+#ifndef escape_hpp
+#define escape_hpp
+
+#include "macros.hpp"
+
+class Expr;
+
+// Escape analysis. An Env frame can only outlive the call or _let that
+// made it if a closure captures it, and only an unlifted _fun captures
+// anything. Marks every _let and _fun whose body makes no such closure,
+// and every call of a _fun written in place, so interp() keeps those
+// frames and closures on the C++ stack. Run after lift()
+PTR(Expr) escape_analysis(PTR(Expr) e);
+
+#endif /* escape_hpp */
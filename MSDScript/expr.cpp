@@ -3,8 +3,129 @@
 #include "env.hpp"
 #include "cont.hpp"
 #include "step.hpp"
+#include "profile.hpp"
+#include "pass.hpp"
+#include "jit.hpp"
+#include "parallel.hpp"
+#include "future.hpp"
+#include "fold.hpp"
 #include "catch.hpp"
 
+long Expr::fold_fuel = 100000;
+
+static PTR(Val) true_val = IMMORTAL(NEW(BoolVal)(true));
+static PTR(Val) false_val = IMMORTAL(NEW(BoolVal)(false));
+
+// Picks the specialized shape for a site from its operands and the
+// values they had on its first run
+static void quicken(QuickSite &site, PTR(Expr) lhs, PTR(Expr) rhs, NumVal *a, NumVal *b) {
+    if (a == nullptr || b == nullptr) {
+        site.shape = quick_generic;
+        return;
+    }
+    PTR(VarExpr) lhs_var = CAST(VarExpr)(lhs);
+    PTR(VarExpr) rhs_var = CAST(VarExpr)(rhs);
+    PTR(NumExpr) lhs_num = CAST(NumExpr)(lhs);
+    PTR(NumExpr) rhs_num = CAST(NumExpr)(rhs);
+    if (lhs_var != nullptr && rhs_num != nullptr) {
+        site.shape = quick_var_const;
+        site.const_on_left = false;
+        site.lhs_var = lhs_var->name;
+        site.constant = rhs_num->rep;
+    } else if (lhs_num != nullptr && rhs_var != nullptr) {
+        site.shape = quick_var_const;
+        site.const_on_left = true;
+        site.rhs_var = rhs_var->name;
+        site.constant = lhs_num->rep;
+    } else if (lhs_var != nullptr && rhs_var != nullptr) {
+        site.shape = quick_var_var;
+        site.lhs_var = lhs_var->name;
+        site.rhs_var = rhs_var->name;
+    } else {
+        site.shape = quick_num;
+    }
+}
+
+// Evaluates both operands of a +, * or == site. While the site's guards
+// hold, returns true with the two numbers in `a` and `b`, skipping the
+// virtual interp() calls its shape makes unnecessary. Otherwise the site
+// is deoptimized and this returns false with the operand values in `lv`
+// and `rv` for the generic path. Operands have no side effects, so a
+// failed guard may evaluate a variable again
+void QuickSite::share(PTR(Expr) lhs, PTR(Expr) rhs) {
+    NumVal assumed(0);
+    quicken(*this, lhs, rhs, &assumed, &assumed);
+    shared = true;
+}
+
+static bool quick_operands(QuickSite &site, PTR(Expr) const &lhs, PTR(Expr) const &rhs, PTR(Env) const &env,
+                           int &a, int &b, PTR(Val) &lv, PTR(Val) &rv) {
+    switch (site.shape) {
+        case quick_var_const: {
+            PTR(Val) v = env->lookup(site.const_on_left ? site.rhs_var : site.lhs_var);
+            NumVal *n = as_num(v);
+            if (n != nullptr) {
+                a = site.const_on_left ? site.constant : n->rep;
+                b = site.const_on_left ? n->rep : site.constant;
+                return true;
+            }
+            if (!site.shared)
+                site.shape = quick_generic;
+            break;
+        }
+        case quick_var_var: {
+            lv = env->lookup(site.lhs_var);
+            rv = env->lookup(site.rhs_var);
+            NumVal *x = as_num(lv);
+            NumVal *y = as_num(rv);
+            if (x != nullptr && y != nullptr) {
+                a = x->rep;
+                b = y->rep;
+                return true;
+            }
+            if (!site.shared)
+                site.shape = quick_generic;
+            return false;
+        }
+        case quick_num:
+        case quick_unseen: {
+            lv = lhs->interp(env);
+            rv = rhs->interp(env);
+            NumVal *x = as_num(lv);
+            NumVal *y = as_num(rv);
+            if (site.shape == quick_unseen)
+                quicken(site, lhs, rhs, x, y);
+            if (x != nullptr && y != nullptr) {
+                a = x->rep;
+                b = y->rep;
+                return true;
+            }
+            if (!site.shared)
+                site.shape = quick_generic;
+            return false;
+        }
+        case quick_generic:
+            break;
+    }
+    lv = lhs->interp(env);
+    rv = rhs->interp(env);
+    return false;
+}
+
+// Evaluates a closed expression for optimize() on the step machine, so
+// deep recursion cannot overflow and a loop cannot hang compilation.
+// Returns nullptr when it fails, runs out of fuel or is not foldable(),
+// and the caller then keeps the expression as it is
+static PTR(Val) fold_interp(PTR(Expr) e) {
+    if (!foldable(e))
+        return nullptr;
+    try {
+        return Step::interp_by_steps(e, Expr::fold_fuel);
+    } catch (std::runtime_error &) {
+        return nullptr;
+    }
+}
+
 NumExpr::NumExpr(int rep) {
     this->rep = rep;
     this->val = NEW(NumVal)(rep);
@@ -27,17 +148,18 @@ PTR(Val) NumExpr::interp(PTR(Env) env) {
 }
 
 void NumExpr::step_interp() {
-    Step::mode = Step::continue_mode;
-    Step::val = NEW(NumVal)(rep);
-    Step::cont = Step::cont;
+    Step::Registers &regs = *Step::regs;
+    regs.mode = Step::continue_mode;
+    regs.val = NEW(NumVal)(rep);
+    regs.cont = regs.cont;
 }
 
-PTR(Expr) NumExpr::subst(std::string var, PTR(Val) new_val) {
-    return NEW(NumExpr)(rep);
+PTR(Expr) NumExpr::subst(Symbol var, PTR(Val) new_val) {
+    return THIS;
 }
 
 PTR(Expr) NumExpr::optimize() {
-    return NEW(NumExpr)(rep);
+    return THIS;
 }
 
 std::string NumExpr::to_string() {
@@ -47,6 +169,7 @@ std::string NumExpr::to_string() {
 AddExpr::AddExpr(PTR(Expr) lhs, PTR(Expr) rhs) {
     this->lhs = lhs;
     this->rhs = rhs;
+    this->fork = false;
 }
 
 bool AddExpr::equals(PTR(Expr) other_expr) {
@@ -64,28 +187,44 @@ bool AddExpr::has_var() {
 }
 
 PTR(Val) AddExpr::interp(PTR(Env) env) {
-    return lhs->interp(env)->add_to(rhs->interp(env));
+    int a, b;
+    PTR(Val) lv;
+    PTR(Val) rv;
+    if (fork && Parallel::may_fork())
+        Parallel::both(lhs, rhs, env, lv, rv);
+    else if (quick_operands(quick, lhs, rhs, env, a, b, lv, rv))
+        return NEW(NumVal)((unsigned)a + (unsigned)b);
+    return lv->add_to(rv);
 }
 
 void AddExpr::step_interp(){
-    Step::mode = Step::interp_mode;
-    Step::expr = lhs;
-    Step::env = Step::env;
-    Step::cont = NEW(RightThenAddCont)(rhs, Step::env, Step::cont);
+    Step::Registers &regs = *Step::regs;
+    regs.mode = Step::interp_mode;
+    regs.expr = lhs;
+    regs.env = regs.env;
+    regs.cont = NEW(RightThenAddCont)(rhs, regs.env, regs.cont);
 }
 
-PTR(Expr) AddExpr::subst(std::string var, PTR(Val) new_val) {
-    return NEW(AddExpr)(lhs->subst(var, new_val),
-                        rhs->subst(var, new_val));
+PTR(Expr) AddExpr::subst(Symbol var, PTR(Val) new_val) {
+    PTR(Expr) slhs = lhs->subst(var, new_val);
+    PTR(Expr) srhs = rhs->subst(var, new_val);
+    if (slhs == lhs && srhs == rhs)
+        return THIS;
+    return NEW(AddExpr)(slhs, srhs);
 }
 
 PTR(Expr) AddExpr::optimize() {
     PTR(Expr) olhs = lhs->optimize();
     PTR(Expr) orhs = rhs->optimize();
+    PTR(Expr) result = THIS;
+    if (olhs != lhs || orhs != rhs)
+        result = NEW(AddExpr)(olhs, orhs);
     if(olhs->has_var() == false && orhs->has_var() == false){
-        return olhs->interp(NEW(EmptyEnv)())->add_to(orhs->interp(NEW(EmptyEnv)()))->to_expr();
+        PTR(Val) val = fold_interp(result);
+        if (val != nullptr)
+            return val->to_expr();
     }
-    return NEW(AddExpr)(olhs, orhs);
+    return result;
 }
 
 std::string AddExpr::to_string() {
@@ -95,6 +234,7 @@ std::string AddExpr::to_string() {
 MultExpr::MultExpr(PTR(Expr) lhs, PTR(Expr) rhs) {
     this->lhs = lhs;
     this->rhs = rhs;
+    this->fork = false;
 }
 
 bool MultExpr::equals(PTR(Expr) other_expr) {
@@ -112,36 +252,52 @@ bool MultExpr::has_var() {
 }
 
 PTR(Val) MultExpr::interp(PTR(Env) env) {
-    return lhs->interp(env)->mult_with(rhs->interp(env));
+    int a, b;
+    PTR(Val) lv;
+    PTR(Val) rv;
+    if (fork && Parallel::may_fork())
+        Parallel::both(lhs, rhs, env, lv, rv);
+    else if (quick_operands(quick, lhs, rhs, env, a, b, lv, rv))
+        return NEW(NumVal)((unsigned)a * (unsigned)b);
+    return lv->mult_with(rv);
 }
 
 void MultExpr::step_interp() {
-    Step::mode = Step::interp_mode;
-    Step::expr = lhs;
-    Step::env = Step::env;
-    Step::cont = NEW(RightThenMultCont)(rhs, Step::env, Step::cont);
+    Step::Registers &regs = *Step::regs;
+    regs.mode = Step::interp_mode;
+    regs.expr = lhs;
+    regs.env = regs.env;
+    regs.cont = NEW(RightThenMultCont)(rhs, regs.env, regs.cont);
 }
 
-PTR(Expr) MultExpr::subst(std::string var, PTR(Val) new_val)
+PTR(Expr) MultExpr::subst(Symbol var, PTR(Val) new_val)
 {
-    return NEW(MultExpr)(lhs->subst(var, new_val), rhs->subst(var, new_val));
+    PTR(Expr) slhs = lhs->subst(var, new_val);
+    PTR(Expr) srhs = rhs->subst(var, new_val);
+    if (slhs == lhs && srhs == rhs)
+        return THIS;
+    return NEW(MultExpr)(slhs, srhs);
 }
 
 PTR(Expr) MultExpr::optimize() {
     PTR(Expr) olhs = lhs->optimize();
     PTR(Expr) orhs = rhs->optimize();
+    PTR(Expr) result = THIS;
+    if (olhs != lhs || orhs != rhs)
+        result = NEW(MultExpr)(olhs, orhs);
     if(olhs->has_var() == false && orhs->has_var() == false){
-        return olhs->interp(NEW(EmptyEnv)())->mult_with(orhs->interp(NEW(EmptyEnv)()))->to_expr();
+        PTR(Val) val = fold_interp(result);
+        if (val != nullptr)
+            return val->to_expr();
     }
-    return NEW(MultExpr)(lhs->optimize(),
-                         rhs->optimize());
+    return result;
 }
 
 std::string MultExpr::to_string() {
     return "(" + lhs->to_string() + " * " + rhs->to_string() + ")";
 }
 
-VarExpr::VarExpr(std::string name) {
+VarExpr::VarExpr(Symbol name) {
     this->name = name;
 }
 
@@ -162,30 +318,32 @@ PTR(Val) VarExpr::interp(PTR(Env) env) {
 }
 
 void VarExpr::step_interp() {
-    Step::mode = Step::continue_mode;
-    Step::val = Step::env->lookup(name);
-    Step::cont = Step::cont;
+    Step::Registers &regs = *Step::regs;
+    regs.mode = Step::continue_mode;
+    regs.val = regs.env->lookup(name);
+    regs.cont = regs.cont;
 }
 
-PTR(Expr) VarExpr::subst(std::string var, PTR(Val) new_val) {
+PTR(Expr) VarExpr::subst(Symbol var, PTR(Val) new_val) {
     if (name == var)
         return new_val->to_expr();
     else
-        return NEW(VarExpr)(name);
+        return THIS;
 }
 
 PTR(Expr) VarExpr::optimize() {
-    return NEW(VarExpr)(name);
+    return THIS;
 }
 
 std::string VarExpr::to_string() {
     return name;
 }
 
-LetExpr::LetExpr(std::string name, PTR(Expr) rhs, PTR(Expr) body) {
+LetExpr::LetExpr(Symbol name, PTR(Expr) rhs, PTR(Expr) body) {
     this->name = name;
     this->rhs = rhs;
     this->body = body;
+    this->stack_frame = false;
 }
 
 bool LetExpr::equals(PTR(Expr) other_expr) {
@@ -204,33 +362,50 @@ bool LetExpr::has_var() {
 
 PTR(Val) LetExpr::interp(PTR(Env) env) {
     PTR(Val) rhs_val = rhs->interp(env);
+    if (stack_frame) {
+        ExtendedEnv frame(name, rhs_val, env);
+        return body->interp(BORROW(Env, frame));
+    }
     PTR(Env) new_env = NEW(ExtendedEnv)(name, rhs_val, env);
     return body->interp(new_env);
 }
 
 void LetExpr::step_interp() {
-    Step::mode = Step::interp_mode;
-    Step::expr = rhs;
-    Step::env = Step::env;
-    Step::cont = NEW(LetBodyCont)(name, body, Step::env, Step::cont);
-}
-
-PTR(Expr) LetExpr::subst(std::string var, PTR(Val) val) {
-    return NEW(LetExpr)(name,
-                        rhs->subst(var, val),
-                        body->subst(var, val));
-}
-
+    Step::Registers &regs = *Step::regs;
+    regs.mode = Step::interp_mode;
+    regs.expr = rhs;
+    regs.env = regs.env;
+    regs.cont = NEW(LetBodyCont)(name, body, regs.env, regs.cont);
+}
+
+PTR(Expr) LetExpr::subst(Symbol var, PTR(Val) val) {
+    PTR(Expr) srhs = rhs->subst(var, val);
+    // The body cannot see `var` when this _let binds the same name
+    PTR(Expr) sbody = body;
+    if (name != var)
+        sbody = body->subst(var, val);
+    if (srhs == rhs && sbody == body)
+        return THIS;
+    return NEW(LetExpr)(name, srhs, sbody);
+}
+
+// Only values that print back as a closed expression are substituted;
+// a function that captured other bindings would lose them
 PTR(Expr) LetExpr::optimize() {
+    PTR(Expr) orhs = rhs->optimize();
     if(body->has_var()){
-        rhs = rhs->optimize();
-        return (body->subst(name, rhs->interp(NEW(EmptyEnv)()))->optimize());
+        PTR(Val) val = fold_interp(orhs);
+        if (val != nullptr && free_vars(val->to_expr()).empty())
+            return (body->subst(name, val)->optimize());
     }
-    else return NEW(LetExpr)(name, rhs->optimize(), body->optimize());
+    PTR(Expr) obody = body->optimize();
+    if (orhs == rhs && obody == body)
+        return THIS;
+    return NEW(LetExpr)(name, orhs, obody);
 }
 
 std::string LetExpr::to_string() {
-    return "(_let " + name + " = " + rhs->to_string() + " _in " + body->to_string() + ")";
+    return "(_let " + name.str() + " = " + rhs->to_string() + " _in " + body->to_string() + ")";
 }
 
 BoolExpr::BoolExpr(bool rep) {
@@ -254,17 +429,18 @@ PTR(Val) BoolExpr::interp(PTR(Env) env) {
 }
 
 void BoolExpr::step_interp() {
-    Step::mode = Step::continue_mode;
-    Step::val = NEW(BoolVal)(rep);
-    Step::cont = Step::cont;
+    Step::Registers &regs = *Step::regs;
+    regs.mode = Step::continue_mode;
+    regs.val = NEW(BoolVal)(rep);
+    regs.cont = regs.cont;
 }
 
-PTR(Expr) BoolExpr::subst(std::string var, PTR(Val) new_val) {
-    return NEW(BoolExpr)(rep);
+PTR(Expr) BoolExpr::subst(Symbol var, PTR(Val) new_val) {
+    return THIS;
 }
 
 PTR(Expr) BoolExpr::optimize(){
-    return NEW(BoolExpr)(rep);
+    return THIS;
 }
 
 std::string BoolExpr::to_string() {
@@ -277,6 +453,7 @@ std::string BoolExpr::to_string() {
 EqualExpr::EqualExpr(PTR(Expr) lhs, PTR(Expr) rhs) {
     this->lhs = lhs;
     this->rhs = rhs;
+    this->fork = false;
 }
 
 bool EqualExpr::equals(PTR(Expr) other_expr) {
@@ -294,30 +471,44 @@ bool EqualExpr::has_var() {
 }
 
 PTR(Val) EqualExpr::interp(PTR(Env) env) {
-    PTR(Val) olhs = lhs->interp(env);
-    PTR(Val) orhs = rhs->interp(env);
+    int a, b;
+    PTR(Val) olhs;
+    PTR(Val) orhs;
+    if (fork && Parallel::may_fork())
+        Parallel::both(lhs, rhs, env, olhs, orhs);
+    else if (quick_operands(quick, lhs, rhs, env, a, b, olhs, orhs))
+        return (a == b) ? true_val : false_val;
     return NEW(BoolVal)(olhs->equals(orhs));
 }
 
 void EqualExpr::step_interp() {
-    Step::mode = Step::interp_mode;
-    Step::expr = lhs;
-    Step::env = Step::env;
-    Step::cont = NEW(RightThenEqualsCont)(rhs, Step::env, Step::cont);
+    Step::Registers &regs = *Step::regs;
+    regs.mode = Step::interp_mode;
+    regs.expr = lhs;
+    regs.env = regs.env;
+    regs.cont = NEW(RightThenEqualsCont)(rhs, regs.env, regs.cont);
 }
 
-PTR(Expr) EqualExpr::subst(std::string var, PTR(Val) val) {
-    return NEW(EqualExpr)(lhs->subst(var, val),
-                          rhs->subst(var, val));
+PTR(Expr) EqualExpr::subst(Symbol var, PTR(Val) val) {
+    PTR(Expr) slhs = lhs->subst(var, val);
+    PTR(Expr) srhs = rhs->subst(var, val);
+    if (slhs == lhs && srhs == rhs)
+        return THIS;
+    return NEW(EqualExpr)(slhs, srhs);
 }
 
 PTR(Expr) EqualExpr::optimize() {
     PTR(Expr) olhs = lhs->optimize();
     PTR(Expr) orhs = rhs->optimize();
+    PTR(Expr) result = THIS;
+    if (olhs != lhs || orhs != rhs)
+        result = NEW(EqualExpr)(olhs, orhs);
     if(olhs->has_var() || orhs->has_var())
-        return NEW(EqualExpr)(olhs, orhs);
-    else
-        return NEW(BoolExpr)(olhs->interp(NEW(EmptyEnv)())->equals(orhs->interp(NEW(EmptyEnv)())));
+        return result;
+    PTR(Val) val = fold_interp(result);
+    if (val != nullptr)
+        return val->to_expr();
+    return result;
 }
 
 std::string EqualExpr::to_string() {
@@ -347,36 +538,47 @@ bool IfExpr::has_var() {
 }
 
 PTR(Val) IfExpr::interp(PTR(Env) env) {
-    if(test_part->interp(env)->is_true())
+    bool took_then = test_part->interp(env)->is_true();
+    if (Profile::current != nullptr)
+        Profile::current->record_branch(this, took_then);
+    if(took_then)
         return then_part->interp(env);
     else
         return else_part->interp(env);
 }
 
 void IfExpr::step_interp() {
-    Step::mode = Step::interp_mode;
-    Step::expr = test_part;
-    Step::env = Step::env;
-    Step::cont = NEW(IfBranchCont)(then_part, else_part, Step::env, Step::cont);
+    Step::Registers &regs = *Step::regs;
+    regs.mode = Step::interp_mode;
+    regs.expr = test_part;
+    regs.env = regs.env;
+    regs.cont = NEW(IfBranchCont)(then_part, else_part, regs.env, regs.cont);
 }
 
-PTR(Expr) IfExpr::subst(std::string var, PTR(Val) val) {
-    return NEW(IfExpr)(test_part->subst(var, val),
-                       then_part->subst(var, val),
-                       else_part->subst(var, val));
+PTR(Expr) IfExpr::subst(Symbol var, PTR(Val) val) {
+    PTR(Expr) stest = test_part->subst(var, val);
+    PTR(Expr) sthen = then_part->subst(var, val);
+    PTR(Expr) selse = else_part->subst(var, val);
+    if (stest == test_part && sthen == then_part && selse == else_part)
+        return THIS;
+    return NEW(IfExpr)(stest, sthen, selse);
 }
 
 PTR(Expr) IfExpr::optimize() {
     if (! test_part->has_var()) {
-        if (test_part->interp(NEW(EmptyEnv)())->is_true()) {
+        PTR(BoolVal) test_val = CAST(BoolVal)(fold_interp(test_part));
+        if (test_val != nullptr && test_val->rep) {
             return then_part->optimize();
-        } else {
+        } else if (test_val != nullptr) {
             return else_part->optimize();
         }
     }
-    return NEW(IfExpr)(test_part->optimize(),
-                       then_part->optimize(),
-                       else_part->optimize());
+    PTR(Expr) otest = test_part->optimize();
+    PTR(Expr) othen = then_part->optimize();
+    PTR(Expr) oelse = else_part->optimize();
+    if (otest == test_part && othen == then_part && oelse == else_part)
+        return THIS;
+    return NEW(IfExpr)(otest, othen, oelse);
 }
 
 std::string IfExpr::to_string() {
@@ -385,9 +587,12 @@ std::string IfExpr::to_string() {
     " _else " + else_part->to_string() + ")";
 }
 
-FunExpr::FunExpr(std::string arg, PTR(Expr) body) {
+FunExpr::FunExpr(Symbol arg, PTR(Expr) body) {
     this->formal_arg = arg;
     this->body = body;
+    this->lifted = nullptr;
+    this->stack_frame = false;
+    this->jit = nullptr;
 }
 
 bool FunExpr::equals(PTR(Expr) other_expr) {
@@ -404,33 +609,54 @@ bool FunExpr::has_var() {
 }
 
 PTR(Val) FunExpr::interp(PTR(Env) env) {
-    return NEW(FunVal)(formal_arg, body, env);
+    if (lifted != nullptr)
+        return lifted;
+    PTR(FunVal) closure = NEW(FunVal)(formal_arg, body, env);
+    closure->stack_frame = stack_frame;
+    if (JitEntry::enabled && jit == nullptr)
+        jit = NEW(JitEntry)(formal_arg, body);
+    closure->jit = jit;
+    return closure;
 }
 
 void FunExpr::step_interp() {
-    Step::mode = Step::continue_mode;
-    Step::val = NEW(FunVal)(formal_arg, body, Step::env);
-    Step::cont = Step::cont;
+    Step::Registers &regs = *Step::regs;
+    regs.mode = Step::continue_mode;
+    if (lifted != nullptr)
+        regs.val = lifted;
+    else
+        regs.val = NEW(FunVal)(formal_arg, body, regs.env);
+    regs.cont = regs.cont;
 }
 
-PTR(Expr) FunExpr::subst(std::string var, PTR(Val) val) {
+PTR(Expr) FunExpr::subst(Symbol var, PTR(Val) val) {
+    // A lifted function has no free variables to replace
+    if(lifted != nullptr)
+        return THIS;
     if(var == formal_arg){
-        return NEW(FunExpr)(formal_arg, body);
+        return THIS;
     }
-    return NEW(FunExpr)(formal_arg, body->subst(var, val));
+    PTR(Expr) sbody = body->subst(var, val);
+    if (sbody == body)
+        return THIS;
+    return NEW(FunExpr)(formal_arg, sbody);
 }
 
 PTR(Expr) FunExpr::optimize() {
-    return NEW(FunExpr)(formal_arg, body->optimize());
+    PTR(Expr) obody = body->optimize();
+    if (obody == body)
+        return THIS;
+    return NEW(FunExpr)(formal_arg, obody);
 }
 
 std::string FunExpr::to_string() {
-    return "(_fun (" + formal_arg + ") " + body->to_string() + ")";
+    return "(_fun (" + formal_arg.str() + ") " + body->to_string() + ")";
 }
 
 CallExpr::CallExpr(PTR(Expr) to_be, PTR(Expr) actual) {
     this->to_be_called = to_be;
     this->actual_arg = actual;
+    this->stack_closure = false;
 }
 
 bool CallExpr::equals(PTR(Expr) other_expr) {
@@ -447,27 +673,201 @@ bool CallExpr::has_var() {
 }
 
 PTR(Val) CallExpr::interp(PTR(Env)env) {
+    if (Profile::current != nullptr)
+        Profile::current->record_call(this);
+    if (stack_closure) {
+        FunExpr *fun = (FunExpr *)&*to_be_called;
+        FunVal closure(fun->formal_arg, fun->body, env);
+        closure.stack_frame = fun->stack_frame;
+        return closure.call(actual_arg->interp(env));
+    }
     return to_be_called->interp(env)->call(actual_arg->interp(env));
 }
 
 void CallExpr::step_interp() {
-    Step::mode = Step::interp_mode;
-    Step::expr = to_be_called;
-    Step::cont = NEW(ArgThenCallCont)(actual_arg, Step::env, Step::cont);
+    Step::Registers &regs = *Step::regs;
+    regs.mode = Step::interp_mode;
+    regs.expr = to_be_called;
+    regs.cont = NEW(ArgThenCallCont)(actual_arg, regs.env, regs.cont);
 }
 
-PTR(Expr) CallExpr::subst(std::string var, PTR(Val) val) {
-    return NEW(CallExpr)(to_be_called->subst(var, val), actual_arg->subst(var, val));
+PTR(Expr) CallExpr::subst(Symbol var, PTR(Val) val) {
+    PTR(Expr) scalled = to_be_called->subst(var, val);
+    PTR(Expr) sarg = actual_arg->subst(var, val);
+    if (scalled == to_be_called && sarg == actual_arg)
+        return THIS;
+    return NEW(CallExpr)(scalled, sarg);
 }
 
 PTR(Expr) CallExpr::optimize() {
-    return NEW(CallExpr)(to_be_called->optimize(), actual_arg->optimize());
+    PTR(Expr) ocalled = to_be_called->optimize();
+    PTR(Expr) oarg = actual_arg->optimize();
+    if (ocalled == to_be_called && oarg == actual_arg)
+        return THIS;
+    return NEW(CallExpr)(ocalled, oarg);
 }
 
 std::string CallExpr::to_string() {
     return ", (" + to_be_called->to_string() + "(" + actual_arg->to_string() + "))";
 }
 
+SpawnExpr::SpawnExpr(PTR(Expr) expr) {
+    this->expr = expr;
+}
+
+bool SpawnExpr::equals(PTR(Expr) other_expr) {
+    PTR(SpawnExpr) other_spawn_expr = CAST(SpawnExpr)(other_expr);
+    if (other_spawn_expr == nullptr)
+        return false;
+    else
+        return expr->equals(other_spawn_expr->expr);
+}
+
+// Never folded, and foldable() keeps a _let from evaluating one, so
+// optimize() starts no threads
+bool SpawnExpr::has_var() {
+    return true;
+}
+
+PTR(Val) SpawnExpr::interp(PTR(Env) env) {
+    return NEW(FutureVal)(Future::spawn(expr, env, false));
+}
+
+void SpawnExpr::step_interp() {
+    Step::Registers &regs = *Step::regs;
+    regs.mode = Step::continue_mode;
+    regs.val = NEW(FutureVal)(Future::spawn(expr, regs.env, true));
+}
+
+PTR(Expr) SpawnExpr::subst(Symbol var, PTR(Val) val) {
+    PTR(Expr) sexpr = expr->subst(var, val);
+    if (sexpr == expr)
+        return THIS;
+    return NEW(SpawnExpr)(sexpr);
+}
+
+PTR(Expr) SpawnExpr::optimize() {
+    PTR(Expr) oexpr = expr->optimize();
+    if (oexpr == expr)
+        return THIS;
+    return NEW(SpawnExpr)(oexpr);
+}
+
+std::string SpawnExpr::to_string() {
+    return "(_spawn " + expr->to_string() + ")";
+}
+
+AwaitExpr::AwaitExpr(PTR(Expr) expr) {
+    this->expr = expr;
+}
+
+bool AwaitExpr::equals(PTR(Expr) other_expr) {
+    PTR(AwaitExpr) other_await_expr = CAST(AwaitExpr)(other_expr);
+    if (other_await_expr == nullptr)
+        return false;
+    else
+        return expr->equals(other_await_expr->expr);
+}
+
+bool AwaitExpr::has_var() {
+    return expr->has_var();
+}
+
+PTR(Val) AwaitExpr::interp(PTR(Env) env) {
+    return FutureVal::await(expr->interp(env));
+}
+
+void AwaitExpr::step_interp() {
+    Step::Registers &regs = *Step::regs;
+    regs.mode = Step::interp_mode;
+    regs.expr = expr;
+    regs.cont = NEW(AwaitCont)(regs.cont);
+}
+
+PTR(Expr) AwaitExpr::subst(Symbol var, PTR(Val) val) {
+    PTR(Expr) sexpr = expr->subst(var, val);
+    if (sexpr == expr)
+        return THIS;
+    return NEW(AwaitExpr)(sexpr);
+}
+
+// Awaiting a _spawn right away is the same as evaluating it here
+PTR(Expr) AwaitExpr::optimize() {
+    PTR(Expr) oexpr = expr->optimize();
+    if (PTR(SpawnExpr) s = CAST(SpawnExpr)(oexpr))
+        return s->expr;
+    if (oexpr == expr)
+        return THIS;
+    return NEW(AwaitExpr)(oexpr);
+}
+
+std::string AwaitExpr::to_string() {
+    return "(_await " + expr->to_string() + ")";
+}
+
+FoldExpr::FoldExpr(PTR(Expr) fun, PTR(Expr) init, PTR(Expr) lo, PTR(Expr) hi) {
+    this->fun = fun;
+    this->init = init;
+    this->lo = lo;
+    this->hi = hi;
+}
+
+bool FoldExpr::equals(PTR(Expr) other_expr) {
+    PTR(FoldExpr) other_fold_expr = CAST(FoldExpr)(other_expr);
+    if (other_fold_expr == nullptr)
+        return false;
+    else
+        return (fun->equals(other_fold_expr->fun)
+                && init->equals(other_fold_expr->init)
+                && lo->equals(other_fold_expr->lo)
+                && hi->equals(other_fold_expr->hi));
+}
+
+// Calls fun like a CallExpr, so it is never folded either, and
+// foldable() keeps a _let from evaluating one
+bool FoldExpr::has_var() {
+    return true;
+}
+
+PTR(Val) FoldExpr::interp(PTR(Env) env) {
+    PTR(Val) fun_val = fun->interp(env);
+    PTR(Val) init_val = init->interp(env);
+    PTR(Val) lo_val = lo->interp(env);
+    return Fold::run(fun_val, init_val, lo_val, hi->interp(env));
+}
+
+void FoldExpr::step_interp() {
+    Step::Registers &regs = *Step::regs;
+    regs.mode = Step::interp_mode;
+    regs.expr = fun;
+    regs.cont = NEW(FoldCont)(CAST(FoldExpr)(THIS), std::vector<PTR(Val)>(), regs.env, regs.cont);
+}
+
+PTR(Expr) FoldExpr::subst(Symbol var, PTR(Val) val) {
+    PTR(Expr) sfun = fun->subst(var, val);
+    PTR(Expr) sinit = init->subst(var, val);
+    PTR(Expr) slo = lo->subst(var, val);
+    PTR(Expr) shi = hi->subst(var, val);
+    if (sfun == fun && sinit == init && slo == lo && shi == hi)
+        return THIS;
+    return NEW(FoldExpr)(sfun, sinit, slo, shi);
+}
+
+PTR(Expr) FoldExpr::optimize() {
+    PTR(Expr) ofun = fun->optimize();
+    PTR(Expr) oinit = init->optimize();
+    PTR(Expr) olo = lo->optimize();
+    PTR(Expr) ohi = hi->optimize();
+    if (ofun == fun && oinit == init && olo == lo && ohi == hi)
+        return THIS;
+    return NEW(FoldExpr)(ofun, oinit, olo, ohi);
+}
+
+std::string FoldExpr::to_string() {
+    return "_fold(" + fun->to_string() + ", " + init->to_string()
+    + ", " + lo->to_string() + ", " + hi->to_string() + ")";
+}
+
 TEST_CASE( "Equals" ) {
     SECTION( "NumExpr" ) {
         CHECK( (NEW(NumExpr)(1))
@@ -660,6 +1060,64 @@ TEST_CASE( "Subst" ) {
         CHECK( (NEW(IfExpr)(NEW(BoolExpr)(false), NEW(NumExpr)(5), NEW(VarExpr)("x")))->subst("x", NEW(NumVal)(2))
               ->equals(NEW(IfExpr)(NEW(BoolExpr)(false), NEW(NumExpr)(5), NEW(NumExpr)(2))));
     }
+    SECTION( "Shadowing" ) {
+        PTR(Expr) let = NEW(LetExpr)("x", NEW(NumExpr)(1), NEW(VarExpr)("x"));
+        CHECK( let->subst("x", NEW(NumVal)(5)) == let );
+        PTR(Expr) fun = NEW(FunExpr)("x", NEW(VarExpr)("x"));
+        CHECK( fun->subst("x", NEW(NumVal)(5)) == fun );
+    }
+    SECTION( "Unchanged subtrees are shared" ) {
+        PTR(Expr) left = NEW(MultExpr)(NEW(VarExpr)("y"), NEW(NumExpr)(2));
+        PTR(Expr) right = NEW(CallExpr)(NEW(VarExpr)("f"), NEW(VarExpr)("x"));
+        PTR(AddExpr) e = NEW(AddExpr)(left, right);
+        CHECK( e->subst("z", NEW(NumVal)(5)) == e );
+        PTR(AddExpr) changed = CAST(AddExpr)(e->subst("x", NEW(NumVal)(5)));
+        REQUIRE( changed != nullptr );
+        CHECK( changed->lhs == left );
+        CHECK( changed->rhs != right );
+    }
+}
+
+TEST_CASE( "Quickening" ) {
+    PTR(Env) five = NEW(ExtendedEnv)("n", NEW(NumVal)(5), NEW(EmptyEnv)());
+    PTR(Env) yes = NEW(ExtendedEnv)("n", NEW(BoolVal)(true), NEW(EmptyEnv)());
+    SECTION( "Shapes" ) {
+        PTR(AddExpr) dec = NEW(AddExpr)(NEW(VarExpr)("n"), NEW(NumExpr)(-1));
+        CHECK( dec->quick.shape == quick_unseen );
+        CHECK( dec->interp(five)->equals(NEW(NumVal)(4)) );
+        CHECK( dec->quick.shape == quick_var_const );
+        CHECK( dec->interp(five)->equals(NEW(NumVal)(4)) );
+        PTR(MultExpr) twice = NEW(MultExpr)(NEW(NumExpr)(2), NEW(VarExpr)("n"));
+        CHECK( twice->interp(five)->equals(NEW(NumVal)(10)) );
+        CHECK( twice->quick.shape == quick_var_const );
+        CHECK( twice->interp(five)->equals(NEW(NumVal)(10)) );
+        PTR(AddExpr) sum = NEW(AddExpr)(NEW(VarExpr)("n"), NEW(VarExpr)("n"));
+        CHECK( sum->interp(five)->equals(NEW(NumVal)(10)) );
+        CHECK( sum->quick.shape == quick_var_var );
+        CHECK( sum->interp(five)->equals(NEW(NumVal)(10)) );
+        PTR(EqualExpr) zero = NEW(EqualExpr)(NEW(VarExpr)("n"), NEW(NumExpr)(0));
+        CHECK( zero->interp(five)->equals(NEW(BoolVal)(false)) );
+        CHECK( zero->quick.shape == quick_var_const );
+        CHECK( zero->interp(NEW(ExtendedEnv)("n", NEW(NumVal)(0), NEW(EmptyEnv)()))->equals(NEW(BoolVal)(true)) );
+        PTR(AddExpr) nested = NEW(AddExpr)(NEW(NumExpr)(1), NEW(AddExpr)(NEW(VarExpr)("n"), NEW(NumExpr)(1)));
+        CHECK( nested->interp(five)->equals(NEW(NumVal)(7)) );
+        CHECK( nested->quick.shape == quick_num );
+    }
+    SECTION( "Guards" ) {
+        PTR(EqualExpr) zero = NEW(EqualExpr)(NEW(VarExpr)("n"), NEW(NumExpr)(0));
+        zero->interp(five);
+        CHECK( zero->interp(yes)->equals(NEW(BoolVal)(false)) );
+        CHECK( zero->quick.shape == quick_generic );
+        CHECK( zero->interp(five)->equals(NEW(BoolVal)(false)) );
+        PTR(AddExpr) sum = NEW(AddExpr)(NEW(VarExpr)("n"), NEW(VarExpr)("n"));
+        sum->interp(five);
+        CHECK_THROWS_WITH( sum->interp(yes), "no adding booleans" );
+        CHECK( sum->quick.shape == quick_generic );
+        CHECK( sum->interp(five)->equals(NEW(NumVal)(10)) );
+        PTR(AddExpr) never = NEW(AddExpr)(NEW(VarExpr)("n"), NEW(NumExpr)(1));
+        CHECK_THROWS_WITH( never->interp(yes), "no adding booleans" );
+        CHECK( never->quick.shape == quick_generic );
+    }
 }
 
 TEST_CASE( "Has_Var" ) {
@@ -775,6 +1233,52 @@ TEST_CASE( "Optimize" ) {
         CHECK( (NEW(CallExpr)(NEW(NumExpr)(4), NEW(NumExpr)(4)))->optimize()
               ->equals(NEW(CallExpr)(NEW(NumExpr)(4), NEW(NumExpr)(4))));
     }
+    SECTION( "Errors are left for run time" ) {
+        CHECK( (NEW(AddExpr)(NEW(NumExpr)(1), NEW(BoolExpr)(true)))->optimize()
+              ->equals(NEW(AddExpr)(NEW(NumExpr)(1), NEW(BoolExpr)(true))));
+        CHECK( (NEW(IfExpr)(NEW(NumExpr)(1), NEW(NumExpr)(2), NEW(NumExpr)(3)))->optimize()
+              ->equals(NEW(IfExpr)(NEW(NumExpr)(1), NEW(NumExpr)(2), NEW(NumExpr)(3))));
+        CHECK( (NEW(LetExpr)("y", NEW(VarExpr)("x"), NEW(VarExpr)("y")))->optimize()
+              ->equals(NEW(LetExpr)("y", NEW(VarExpr)("x"), NEW(VarExpr)("y"))));
+    }
+    SECTION( "Closures keep their bindings" ) {
+        PTR(Expr) add_y = NEW(LetExpr)("y", NEW(NumExpr)(5), NEW(FunExpr)("x", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("y"))));
+        PTR(Expr) e = NEW(LetExpr)("f", add_y, NEW(CallExpr)(NEW(VarExpr)("f"), NEW(NumExpr)(1)));
+        CHECK( e->optimize()->interp(NEW(EmptyEnv)())
+              ->equals(NEW(NumVal)(6)));
+    }
+    SECTION( "Fuel" ) {
+        // _let loop = (_fun (f) f(f))(_fun (f) f(f)) _in loop + 1
+        PTR(Expr) self_apply = NEW(FunExpr)("f", NEW(CallExpr)(NEW(VarExpr)("f"), NEW(VarExpr)("f")));
+        PTR(Expr) loop = NEW(LetExpr)("loop", NEW(CallExpr)(self_apply, self_apply),
+                                      NEW(AddExpr)(NEW(VarExpr)("loop"), NEW(NumExpr)(1)));
+        CHECK( loop->optimize()->equals(loop) );
+        long saved_fuel = Expr::fold_fuel;
+        Expr::fold_fuel = 0;
+        PTR(Expr) call = NEW(LetExpr)("x", NEW(CallExpr)(NEW(FunExpr)("y", NEW(AddExpr)(NEW(VarExpr)("y"), NEW(NumExpr)(1))), NEW(NumExpr)(2)),
+                                      NEW(VarExpr)("x"));
+        CHECK( call->optimize()->equals(call) );
+        Expr::fold_fuel = saved_fuel;
+        CHECK( call->optimize()->equals(NEW(NumExpr)(3)) );
+    }
+    SECTION( "Unchanged subtrees are shared" ) {
+        PTR(Expr) fun = NEW(FunExpr)("x", NEW(IfExpr)(NEW(EqualExpr)(NEW(VarExpr)("x"), NEW(NumExpr)(0)),
+                                                   NEW(BoolExpr)(true),
+                                                   NEW(CallExpr)(NEW(VarExpr)("f"), NEW(VarExpr)("x"))));
+        CHECK( fun->optimize() == fun );
+        PTR(LetExpr) let = NEW(LetExpr)("y", NEW(VarExpr)("z"), NEW(AddExpr)(fun, NEW(MultExpr)(NEW(NumExpr)(2), NEW(NumExpr)(3))));
+        PTR(LetExpr) opt = CAST(LetExpr)(let->optimize());
+        REQUIRE( opt != nullptr );
+        CHECK( opt->rhs == let->rhs );
+        CHECK( CAST(AddExpr)(opt->body)->lhs == fun );
+    }
+    SECTION( "Input is not changed" ) {
+        PTR(LetExpr) let = NEW(LetExpr)("x", NEW(AddExpr)(NEW(NumExpr)(1), NEW(NumExpr)(2)), NEW(VarExpr)("x"));
+        PTR(Expr) rhs = let->rhs;
+        CHECK( let->optimize()->equals(NEW(NumExpr)(3)) );
+        CHECK( let->rhs == rhs );
+        CHECK( let->rhs->equals(NEW(AddExpr)(NEW(NumExpr)(1), NEW(NumExpr)(2))) );
+    }
 }
 
 TEST_CASE( "to_string" ) {
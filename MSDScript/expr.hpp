@@ -3,6 +3,8 @@
 
 #include <string>
 #include "macros.hpp"
+#include "symbol.hpp"
+#include "jit.hpp"
 
 class Env;
 class Val;
@@ -18,9 +20,11 @@ public:
     // Prevents stack overflow interpetation
     virtual void step_interp() = 0;
     // To substitute a number in place of a variable
-    virtual PTR(Expr) subst(std::string var, PTR(Val) val) = 0;
+    virtual PTR(Expr) subst(Symbol var, PTR(Val) val) = 0;
     // To "simplify" or optimize the input to its fastest version
     virtual PTR(Expr) optimize() = 0;
+    // Most steps optimize() may spend evaluating any one closed expression
+    static long fold_fuel;
     // Converts Expr to string
     virtual std::string to_string() = 0;
 };
@@ -36,15 +40,47 @@ public:
     
     PTR(Val) interp(PTR(Env) env);
     void step_interp();
-    PTR(Expr) subst(std::string var, PTR(Val) val);
+    PTR(Expr) subst(Symbol var, PTR(Val) val);
     PTR(Expr) optimize();
     std::string to_string();
 };
 
+// How a +, * or == site has behaved in interp() so far. A site starts
+// out unseen, specializes on its first run if both operands were
+// numbers, and falls back to generic for good the first time a guard
+// sees anything else
+typedef enum {
+    quick_unseen,
+    quick_var_const,    // a variable and a number literal
+    quick_var_var,      // two variables
+    quick_num,          // any operands
+    quick_generic
+} quick_t;
+
+struct QuickSite {
+    quick_t shape;
+    bool const_on_left;
+    Symbol lhs_var;
+    Symbol rhs_var;
+    int constant;
+    // Set by share(); the site then never changes
+    bool shared;
+    
+    QuickSite() : shape(quick_unseen), const_on_left(false), constant(0), shared(false) { }
+    // Specializes the site ahead of time as if both operands were
+    // numbers, for a tree that threads will run at once. A guard that
+    // fails there takes the generic path without falling back for good
+    void share(PTR(Expr) lhs, PTR(Expr) rhs);
+};
+
 class AddExpr : public Expr {
 public:
     PTR(Expr) lhs;
     PTR(Expr) rhs;
+    QuickSite quick;
+    // Set by Program when both operands make calls, so --parallel may
+    // evaluate them at once
+    bool fork;
     
     AddExpr(PTR(Expr) lhs, PTR(Expr) rhs);
     bool equals(PTR(Expr) other_expr);
@@ -52,7 +88,7 @@ public:
     
     PTR(Val) interp(PTR(Env) env);
     void step_interp();
-    PTR(Expr) subst(std::string var, PTR(Val) val);
+    PTR(Expr) subst(Symbol var, PTR(Val) val);
     PTR(Expr) optimize();
     std::string to_string();
 };
@@ -61,6 +97,10 @@ class MultExpr : public Expr {
 public:
     PTR(Expr) lhs;
     PTR(Expr) rhs;
+    QuickSite quick;
+    // Set by Program when both operands make calls, so --parallel may
+    // evaluate them at once
+    bool fork;
     
     MultExpr(PTR(Expr) lhs, PTR(Expr) rhs);
     bool equals(PTR(Expr) other_expr);
@@ -68,40 +108,42 @@ public:
     
     PTR(Val) interp(PTR(Env) env);
     void step_interp();
-    PTR(Expr) subst(std::string var, PTR(Val) val);
+    PTR(Expr) subst(Symbol var, PTR(Val) val);
     PTR(Expr) optimize();
     std::string to_string();
 };
 
 class VarExpr : public Expr {
 public:
-    std::string name;
+    Symbol name;
     
-    VarExpr(std::string name);
+    VarExpr(Symbol name);
     bool equals(PTR(Expr) other_expr);
     bool has_var();
     
     
     PTR(Val) interp(PTR(Env) env);
     void step_interp();
-    PTR(Expr) subst(std::string var, PTR(Val) val);
+    PTR(Expr) subst(Symbol var, PTR(Val) val);
     PTR(Expr) optimize();
     std::string to_string();
 };
 
 class LetExpr : public Expr {
 public:
-    std::string name;
+    Symbol name;
     PTR(Expr) rhs;
     PTR(Expr) body;
+    // Set by escape_analysis() when no closure can capture the new binding
+    bool stack_frame;
     
-    LetExpr(std::string name, PTR(Expr) rhs, PTR(Expr) body);
+    LetExpr(Symbol name, PTR(Expr) rhs, PTR(Expr) body);
     bool equals(PTR(Expr) other_expr);
     bool has_var();
     
     PTR(Val) interp(PTR(Env) env);
     void step_interp();
-    PTR(Expr) subst(std::string var, PTR(Val) new_val);
+    PTR(Expr) subst(Symbol var, PTR(Val) new_val);
     PTR(Expr) optimize();
     std::string to_string();
 };
@@ -116,7 +158,7 @@ public:
     
     PTR(Val) interp(PTR(Env) env);
     void step_interp();
-    PTR(Expr) subst(std::string var, PTR(Val) val);
+    PTR(Expr) subst(Symbol var, PTR(Val) val);
     PTR(Expr) optimize();
     std::string to_string();
 };
@@ -125,6 +167,10 @@ class EqualExpr : public Expr {
 public:
     PTR(Expr) lhs;
     PTR(Expr) rhs;
+    QuickSite quick;
+    // Set by Program when both operands make calls, so --parallel may
+    // evaluate them at once
+    bool fork;
     
     EqualExpr(PTR(Expr) lhs, PTR(Expr) rhs);
     bool equals(PTR(Expr) other_expr);
@@ -132,7 +178,7 @@ public:
     
     PTR(Val) interp(PTR(Env) env);
     void step_interp();
-    PTR(Expr) subst(std::string var, PTR(Val) val);
+    PTR(Expr) subst(Symbol var, PTR(Val) val);
     PTR(Expr) optimize();
     std::string to_string();
 };
@@ -149,23 +195,29 @@ public:
     
     PTR(Val) interp(PTR(Env) env);
     void step_interp();
-    PTR(Expr) subst(std::string var, PTR(Val) val);
+    PTR(Expr) subst(Symbol var, PTR(Val) val);
     PTR(Expr) optimize();
     std::string to_string();
 };
 
 class FunExpr : public Expr {
 public:
-    std::string formal_arg;
+    Symbol formal_arg;
     PTR(Expr) body;
+    // Set by lift() when the function has no free variables
+    PTR(Val) lifted;
+    // Set by escape_analysis() when no closure can capture the argument
+    bool stack_frame;
+    // Made the first time interp() runs this _fun with the JIT enabled
+    PTR(JitEntry) jit;
     
-    FunExpr(std::string arg, PTR(Expr) body);
+    FunExpr(Symbol arg, PTR(Expr) body);
     bool equals(PTR(Expr) other_expr);
     bool has_var();
     
     PTR(Val) interp(PTR(Env) env);
     void step_interp();
-    PTR(Expr) subst(std::string var, PTR(Val) val);
+    PTR(Expr) subst(Symbol var, PTR(Val) val);
     PTR(Expr) optimize();
     std::string to_string();
 };
@@ -174,6 +226,9 @@ class CallExpr : public Expr {
 public:
     PTR(Expr) to_be_called;
     PTR(Expr) actual_arg;
+    // Set by escape_analysis() when to_be_called is a _fun that is only
+    // ever called right here
+    bool stack_closure;
     
     CallExpr(PTR(Expr) to_be, PTR(Expr) actual);
     bool equals(PTR(Expr) other_expr);
@@ -181,7 +236,59 @@ public:
     
     PTR(Val) interp(PTR(Env) env);
     void step_interp();
-    PTR(Expr) subst(std::string var, PTR(Val) val);
+    PTR(Expr) subst(Symbol var, PTR(Val) val);
+    PTR(Expr) optimize();
+    std::string to_string();
+};
+
+// Starts evaluating `expr` on another thread and is a FutureVal for its
+// value right away
+class SpawnExpr : public Expr {
+public:
+    PTR(Expr) expr;
+    
+    SpawnExpr(PTR(Expr) expr);
+    bool equals(PTR(Expr) other_expr);
+    bool has_var();
+    
+    PTR(Val) interp(PTR(Env) env);
+    void step_interp();
+    PTR(Expr) subst(Symbol var, PTR(Val) val);
+    PTR(Expr) optimize();
+    std::string to_string();
+};
+
+// Waits for the FutureVal `expr` evaluates to and is its value
+class AwaitExpr : public Expr {
+public:
+    PTR(Expr) expr;
+    
+    AwaitExpr(PTR(Expr) expr);
+    bool equals(PTR(Expr) other_expr);
+    bool has_var();
+    
+    PTR(Val) interp(PTR(Env) env);
+    void step_interp();
+    PTR(Expr) subst(Symbol var, PTR(Val) val);
+    PTR(Expr) optimize();
+    std::string to_string();
+};
+
+// _fold(fun, init, lo, hi), which Fold::run evaluates
+class FoldExpr : public Expr {
+public:
+    PTR(Expr) fun;
+    PTR(Expr) init;
+    PTR(Expr) lo;
+    PTR(Expr) hi;
+    
+    FoldExpr(PTR(Expr) fun, PTR(Expr) init, PTR(Expr) lo, PTR(Expr) hi);
+    bool equals(PTR(Expr) other_expr);
+    bool has_var();
+    
+    PTR(Val) interp(PTR(Env) env);
+    void step_interp();
+    PTR(Expr) subst(Symbol var, PTR(Val) val);
     PTR(Expr) optimize();
     std::string to_string();
 };
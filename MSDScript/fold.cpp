@@ -0,0 +1,316 @@
+#include <algorithm>
+#include <atomic>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "fold.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+#include "env.hpp"
+#include "step.hpp"
+#include "compile.hpp"
+#include "profile.hpp"
+#include "parse.hpp"
+#include "pass.hpp"
+#include "catch.hpp"
+
+int Fold::threads = 0;
+long Fold::parallel_min = 1 << 20;
+int Fold::max_degree = 8;
+
+namespace {
+    std::atomic<long> native_count(0);
+    std::atomic<long> parallel_count(0);
+
+    // Coefficients of a polynomial in the loop index, lowest power first.
+    // Arithmetic wraps like NumVal's
+    typedef std::vector<unsigned> Poly;
+
+    Poly poly_add(const Poly &p, const Poly &q) {
+        Poly sum(std::max(p.size(), q.size()), 0);
+        for (size_t k = 0; k < p.size(); k++)
+            sum[k] += p[k];
+        for (size_t k = 0; k < q.size(); k++)
+            sum[k] += q[k];
+        return sum;
+    }
+
+    Poly poly_mult(const Poly &p, const Poly &q) {
+        Poly product(p.size() + q.size() - 1, 0);
+        for (size_t j = 0; j < p.size(); j++)
+            for (size_t k = 0; k < q.size(); k++)
+                product[j + k] += p[j] * q[k];
+        return product;
+    }
+
+    // Sets `out` to `e` as a polynomial in `index`, or returns false when
+    // `e` uses `acc` or anything but literals, +, * and variables. Other
+    // variables are read from `env` and must be numbers
+    bool poly_of(PTR(Expr) e, Symbol acc, Symbol index, PTR(Env) env, Poly &out) {
+        if (PTR(NumExpr) n = CAST(NumExpr)(e)) {
+            out = { (unsigned)n->rep };
+            return true;
+        }
+        if (PTR(VarExpr) v = CAST(VarExpr)(e)) {
+            if (v->name == index) {
+                out = { 0, 1 };
+                return true;
+            }
+            if (v->name == acc)
+                return false;
+            PTR(Val) val;
+            try {
+                val = env->lookup(v->name);
+            } catch (std::runtime_error &) {
+                return false;
+            }
+            NumVal *num = as_num(val);
+            if (num == nullptr)
+                return false;
+            out = { (unsigned)num->rep };
+            return true;
+        }
+        Poly lhs, rhs;
+        if (PTR(AddExpr) a = CAST(AddExpr)(e)) {
+            if (!poly_of(a->lhs, acc, index, env, lhs) || !poly_of(a->rhs, acc, index, env, rhs))
+                return false;
+            out = poly_add(lhs, rhs);
+            return true;
+        }
+        if (PTR(MultExpr) m = CAST(MultExpr)(e)) {
+            if (!poly_of(m->lhs, acc, index, env, lhs) || !poly_of(m->rhs, acc, index, env, rhs))
+                return false;
+            if ((int)(lhs.size() + rhs.size()) - 2 > Fold::max_degree)
+                return false;
+            out = poly_mult(lhs, rhs);
+            return true;
+        }
+        return false;
+    }
+
+    bool is_var(PTR(Expr) e, Symbol name) {
+        PTR(VarExpr) v = CAST(VarExpr)(e);
+        return v != nullptr && v->name == name;
+    }
+
+    // Matches `_fun (a) _fun (i) a + e` and the other forms Fold runs
+    // natively
+    bool native_form(PTR(Val) f, Poly &poly, bool &add) {
+        PTR(FunVal) outer = CAST(FunVal)(f);
+        if (outer == nullptr)
+            return false;
+        PTR(FunExpr) inner = CAST(FunExpr)(outer->body);
+        if (inner == nullptr || inner->formal_arg == outer->formal_arg)
+            return false;
+        Symbol acc = outer->formal_arg;
+        PTR(Expr) lhs;
+        PTR(Expr) rhs;
+        if (PTR(AddExpr) a = CAST(AddExpr)(inner->body)) {
+            add = true;
+            lhs = a->lhs;
+            rhs = a->rhs;
+        } else if (PTR(MultExpr) m = CAST(MultExpr)(inner->body)) {
+            add = false;
+            lhs = m->lhs;
+            rhs = m->rhs;
+        } else {
+            return false;
+        }
+        PTR(Expr) step;
+        if (is_var(lhs, acc))
+            step = rhs;
+        else if (is_var(rhs, acc))
+            step = lhs;
+        else
+            return false;
+        return poly_of(step, acc, inner->formal_arg, outer->env, poly);
+    }
+
+    unsigned eval(const Poly &poly, unsigned x) {
+        unsigned value = 0;
+        for (size_t k = poly.size(); k > 0; k--)
+            value = value * x + poly[k - 1];
+        return value;
+    }
+
+    // Combines the polynomial's values over [from, to)
+    unsigned reduce(const Poly &poly, bool add, long from, long to) {
+        unsigned acc = add ? 0 : 1;
+        if (add) {
+            for (long i = from; i < to; i++)
+                acc += eval(poly, (unsigned)i);
+        } else {
+            for (long i = from; i < to; i++)
+                acc *= eval(poly, (unsigned)i);
+        }
+        return acc;
+    }
+}
+
+PTR(Val) Fold::run(PTR(Val) f, PTR(Val) init, PTR(Val) lo, PTR(Val) hi) {
+    PTR(Val) result = run_without_calls(f, init, lo, hi);
+    if (result != nullptr)
+        return result;
+    PTR(Val) acc = init;
+    for (long i = as_num(lo)->rep; i < as_num(hi)->rep; i++)
+        acc = f->call(acc)->call(NEW(NumVal)((int)i));
+    return acc;
+}
+
+PTR(Val) Fold::run_without_calls(PTR(Val) f, PTR(Val) init, PTR(Val) lo, PTR(Val) hi) {
+    NumVal *lo_num = as_num(lo);
+    NumVal *hi_num = as_num(hi);
+    if (lo_num == nullptr || hi_num == nullptr)
+        throw std::runtime_error("fold bounds must be numbers");
+    long first = lo_num->rep;
+    long end = hi_num->rep;
+    if (end <= first)
+        return init;
+
+    Poly poly;
+    bool add = false;
+    NumVal *init_num = as_num(init);
+    // Like the JIT, stays out of the way of a profile counting calls
+    if (init_num != nullptr && Profile::current == nullptr && native_form(f, poly, add)) {
+        native_count++;
+        long count = end - first;
+        int n = threads;
+        if (n <= 0)
+            n = std::max(1, (int)std::thread::hardware_concurrency());
+        unsigned total;
+        if (n > 1 && count >= parallel_min) {
+            parallel_count++;
+            long chunk = (count + n - 1) / n;
+            std::vector<unsigned> partial(n);
+            std::vector<std::thread> workers;
+            for (int t = 1; t < n; t++) {
+                long from = std::min(end, first + t * chunk);
+                long to = std::min(end, from + chunk);
+                workers.emplace_back([&poly, &partial, add, t, from, to]() {
+                    partial[t] = reduce(poly, add, from, to);
+                });
+            }
+            partial[0] = reduce(poly, add, first, std::min(end, first + chunk));
+            for (std::thread &worker : workers)
+                worker.join();
+            total = partial[0];
+            for (int t = 1; t < n; t++)
+                total = add ? total + partial[t] : total * partial[t];
+        } else {
+            total = reduce(poly, add, first, end);
+        }
+        unsigned start = (unsigned)init_num->rep;
+        return NEW(NumVal)((int)(add ? start + total : start * total));
+    }
+    return nullptr;
+}
+
+long Fold::native_runs() {
+    return native_count;
+}
+
+long Fold::parallel_runs() {
+    return parallel_count;
+}
+
+static PTR(Val) fold_interp(std::string s) {
+    return parse_str(s)->interp(Env::empty);
+}
+
+static PTR(Val) fold_steps(std::string s) {
+    return Step::interp_by_steps(parse_str(s));
+}
+
+static PTR(Val) fold_compiled(std::string s) {
+    return interp_compiled(parse_str(s));
+}
+
+TEST_CASE( "Fold" ) {
+    SECTION( "Native loops" ) {
+        long before = Fold::native_runs();
+        CHECK( fold_interp("_fold(_fun (a) _fun (i) a + 1, 0, 0, 5000)")
+              ->equals(NEW(NumVal)(5000)) );
+        CHECK( fold_interp("_fold(_fun (a) _fun (i) a + i, 0, 0, 101)")
+              ->equals(NEW(NumVal)(5050)) );
+        CHECK( fold_interp("_fold(_fun (a) _fun (i) i * i + a, 0, 1, 11)")
+              ->equals(NEW(NumVal)(385)) );
+        CHECK( fold_interp("_fold(_fun (a) _fun (i) a * i, 1, 1, 11)")
+              ->equals(NEW(NumVal)(3628800)) );
+        CHECK( fold_interp("_let k = 3 _in _fold(_fun (a) _fun (i) a + k * (i + -1), 2, 1, 5)")
+              ->equals(NEW(NumVal)(20)) );
+        CHECK( Fold::native_runs() == before + 5 );
+        CHECK( fold_steps("_fold(_fun (a) _fun (i) a + i, 0, 0, 101)")
+              ->equals(NEW(NumVal)(5050)) );
+        CHECK( fold_compiled("_let k = 2 _in _fold(_fun (a) _fun (i) a + i * k, 0, 0, 101)")
+              ->equals(NEW(NumVal)(10100)) );
+        CHECK( Fold::native_runs() == before + 7 );
+    }
+    SECTION( "Calling f" ) {
+        long before = Fold::native_runs();
+        CHECK( fold_interp("_fold(_fun (a) _fun (i) _if i == 3 _then a _else a + i, 0, 0, 6)")
+              ->equals(NEW(NumVal)(12)) );
+        CHECK( fold_steps("_fold(_fun (a) _fun (i) _if i == 3 _then a _else a + i, 0, 0, 6)")
+              ->equals(NEW(NumVal)(12)) );
+        CHECK( fold_interp("_let k = _true _in _fold(_fun (a) _fun (i) _if k _then a + i _else a, 0, 0, 4)")
+              ->equals(NEW(NumVal)(6)) );
+        CHECK( fold_interp("_fold(_fun (a) _fun (a) a + a, 0, 0, 4)")
+              ->equals(NEW(NumVal)(6)) );
+        CHECK( fold_interp("_fold(_fun (f) _fun (i) _fun (x) f(x) + i, _fun (x) x, 0, 3)")->call(NEW(NumVal)(10))
+              ->equals(NEW(NumVal)(13)) );
+        CHECK( Fold::native_runs() == before );
+    }
+    SECTION( "Ranges and errors" ) {
+        CHECK( fold_interp("_fold(_fun (a) _fun (i) a + i, _true, 5, 5)")
+              ->equals(NEW(BoolVal)(true)) );
+        CHECK( fold_interp("_fold(_fun (a) _fun (i) a + i, 7, 5, -5)")
+              ->equals(NEW(NumVal)(7)) );
+        CHECK( fold_interp("_fold(_fun (a) _fun (i) a + i, 0, -3, 3)")
+              ->equals(NEW(NumVal)(-3)) );
+        CHECK_THROWS_WITH( fold_interp("_fold(_fun (a) _fun (i) a + i, _true, 0, 3)"), "no adding booleans" );
+        CHECK_THROWS_WITH( fold_interp("_fold(_fun (a) _fun (i) i + a, _true, 0, 3)"), "not a number" );
+        CHECK_THROWS_WITH( fold_interp("_fold(_fun (a) _fun (i) a + k, 0, 0, 3)"), "free variable: k" );
+        CHECK_THROWS_WITH( fold_interp("_fold(_fun (a) _fun (i) a + i, 0, _true, 3)"), "fold bounds must be numbers" );
+        CHECK_THROWS_WITH( fold_interp("_fold(1, 0, 0, 3)"), "cannot call on a number" );
+    }
+    SECTION( "Steps" ) {
+        // One call of f at a time, so fuel and time slices bound the loop
+        std::string slow = "_fold(_fun (a) _fun (i) _if i == 0 _then a _else a + i, 0, 0, 100000000)";
+        CHECK_THROWS_WITH( Step::interp_by_steps(parse_str(slow), 1000), "out of fuel" );
+        PTR(Expr) e = parse_str(slow);
+        Step::Registers state;
+        Step::start(state, e, Env::empty);
+        CHECK( Step::resume(state, 500) == 500 );
+        CHECK( ! Step::done(state) );
+        CHECK( fold_steps("_fold(_fun (a) _fun (i) _if i == 0 _then a _else a + i, 0, -3, 4)")
+              ->equals(NEW(NumVal)(0)) );
+        CHECK_THROWS_WITH( fold_steps("_fold(1, 0, 0, 3)"), "cannot call on a number" );
+        CHECK_THROWS_WITH( fold_steps("_fold(_fun (a) 1, 0, 0, 3)"), "cannot call on a number" );
+        // Left for run time by the fold pass
+        long saved_fuel = Expr::fold_fuel;
+        Expr::fold_fuel = 1000;
+        PTR(Expr) optimized = PassManager::for_level(2)->run(parse_str("_let x = " + slow + " _in x + 1"));
+        CHECK( optimized->to_string().find("_fold") != std::string::npos );
+        Expr::fold_fuel = saved_fuel;
+    }
+    SECTION( "Split across threads" ) {
+        int saved_threads = Fold::threads;
+        long saved_min = Fold::parallel_min;
+        Fold::threads = 4;
+        Fold::parallel_min = 100;
+        long before = Fold::parallel_runs();
+        std::string programs[][2] = {
+            { "_fold(_fun (a) _fun (i) a + i * i, 7, 0, 1001)",
+              "_fold(_fun (a) _fun (i) _let x = i _in a + x * x, 7, 0, 1001)" },
+            { "_fold(_fun (a) _fun (i) (i + 1) * a, 1, 0, 999)",
+              "_fold(_fun (a) _fun (i) _let x = i _in (x + 1) * a, 1, 0, 999)" },
+            { "_fold(_fun (a) _fun (i) a + 100000 * i * i, 3, -50000, 50003)",
+              "_fold(_fun (a) _fun (i) _let x = i _in a + 100000 * x * x, 3, -50000, 50003)" }
+        };
+        for (auto &program : programs)
+            CHECK( fold_interp(program[0])->equals(fold_interp(program[1])) );
+        CHECK( Fold::parallel_runs() == before + 3 );
+        Fold::threads = saved_threads;
+        Fold::parallel_min = saved_min;
+    }
+}
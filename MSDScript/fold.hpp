@@ -0,0 +1,35 @@
+#ifndef fold_hpp
+#define fold_hpp
+
+#include "macros.hpp"
+
+class Val;
+
+/* The counted loop behind _fold(f, init, lo, hi), whose value is
+ f(...f(f(init)(lo))(lo + 1)...)(hi + -1), or init when hi <= lo. When
+ f is written `_fun (a) _fun (i) a + e` or `a * e`, either way round,
+ and e uses only i, number literals, +, * and variables bound to
+ numbers, e is turned into a polynomial in i and the loop runs on plain
+ ints without calling f. Wrapping + and * are associative, so a range of
+ at least `parallel_min` steps is then split across `threads` threads.
+ Anything else calls f for every step. */
+class Fold {
+public:
+    // 0 makes one per core
+    static int threads;
+    static long parallel_min;
+    // Polynomials of higher degree than this are left to f
+    static int max_degree;
+
+    static PTR(Val) run(PTR(Val) f, PTR(Val) init, PTR(Val) lo, PTR(Val) hi);
+    // The fold's value when it needs no calls of f, because the range is
+    // empty or f has a native form, or nullptr when f has to be called.
+    // The step machine then calls f itself, one call per step
+    static PTR(Val) run_without_calls(PTR(Val) f, PTR(Val) init, PTR(Val) lo, PTR(Val) hi);
+
+    // Folds that ran without calling f, and how many of those were split
+    static long native_runs();
+    static long parallel_runs();
+};
+
+#endif /* fold_hpp */
@@ -0,0 +1,240 @@
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "future.hpp"
+#include "copy.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+#include "env.hpp"
+#include "step.hpp"
+#include "gc.hpp"
+#include "profile.hpp"
+#include "parse.hpp"
+#include "pass.hpp"
+#include "catch.hpp"
+
+int Future::threads = 0;
+std::atomic<bool> Future::cancelling(false);
+thread_local bool Future::in_pool = false;
+
+namespace {
+    std::mutex pool_lock;
+    std::condition_variable pool_ready;
+    std::deque<std::shared_ptr<Future>> pool_queue;
+    std::vector<std::thread> pool;
+    bool stopping = false;
+    std::atomic<long> spawn_count(0);
+    std::atomic<long> in_place_count(0);
+
+    // Ends the pool before the statics above are destroyed
+    struct PoolGuard {
+        ~PoolGuard() { Future::stop(); }
+    } pool_guard;
+}
+
+Future::Future(PTR(Expr) expr, PTR(Env) env, bool steps) : state(queued) {
+    this->expr = expr;
+    this->env = env;
+    this->steps = steps;
+}
+
+std::shared_ptr<Future> Future::spawn(PTR(Expr) expr, PTR(Env) env, bool steps) {
+    spawn_count++;
+    if (GC::enabled || Profile::current != nullptr) {
+        std::shared_ptr<Future> future(new Future(expr, env, steps));
+        future->state = running;
+        in_place_count++;
+        future->run();
+        return future;
+    }
+    std::shared_ptr<Future> future;
+    {
+        // Gone before the future is queued, so only the pool holds the copy
+        ThreadCopy copy(true);
+        PTR(Expr) expr_copy = copy.expr(expr);
+        PTR(Env) env_copy = copy.env(env);
+        if (!copy.ok)
+            throw std::runtime_error("cannot spawn this expression");
+        future.reset(new Future(expr_copy, env_copy, steps));
+    }
+    std::lock_guard<std::mutex> hold(pool_lock);
+    if (pool.empty()) {
+        int count = threads;
+        if (count <= 0)
+            count = std::max(1, (int)std::thread::hardware_concurrency());
+        stopping = false;
+        for (int i = 0; i < count; i++)
+            pool.emplace_back(work);
+    }
+    pool_queue.push_back(future);
+    pool_ready.notify_one();
+    return future;
+}
+
+bool Future::claim() {
+    state_t expected = queued;
+    return state.compare_exchange_strong(expected, running);
+}
+
+void Future::run() {
+    PTR(Val) value = nullptr;
+    std::exception_ptr thrown;
+    try {
+        if (steps)
+            value = Step::interp_by_steps(expr, env, -1);
+        else
+            value = expr->interp(env);
+    } catch (...) {
+        thrown = std::current_exception();
+    }
+    std::lock_guard<std::mutex> hold(lock);
+    result = value;
+    error = thrown;
+    value = nullptr;
+    expr = nullptr;
+    env = nullptr;
+    state = finished;
+    done.notify_all();
+}
+
+PTR(Val) Future::await() {
+    if (claim()) {
+        in_place_count++;
+        run();
+    }
+    std::unique_lock<std::mutex> hold(lock);
+    done.wait(hold, [this] { return state == finished; });
+    if (error)
+        std::rethrow_exception(error);
+    // Copied under the lock, so threads awaiting at once never count
+    // references to the result together
+    ThreadCopy copy(true);
+    return copy.val(result);
+}
+
+void Future::work() {
+    in_pool = true;
+    while (1) {
+        std::shared_ptr<Future> future;
+        {
+            std::unique_lock<std::mutex> hold(pool_lock);
+            pool_ready.wait(hold, [] { return stopping || !pool_queue.empty(); });
+            if (stopping)
+                return;
+            future = pool_queue.front();
+            pool_queue.pop_front();
+        }
+        if (future->claim())
+            future->run();
+    }
+}
+
+void Future::stop() {
+    std::vector<std::thread> ending;
+    {
+        std::lock_guard<std::mutex> hold(pool_lock);
+        stopping = true;
+        pool_queue.clear();
+        ending.swap(pool);
+    }
+    cancelling = true;
+    pool_ready.notify_all();
+    for (std::thread &thread : ending)
+        thread.join();
+    cancelling = false;
+}
+
+long Future::spawns() {
+    return spawn_count;
+}
+
+long Future::ran_in_place() {
+    return in_place_count;
+}
+
+static PTR(Val) future_interp(std::string s) {
+    return parse_str(s)->interp(Env::empty);
+}
+
+static PTR(Val) future_steps(std::string s) {
+    return Step::interp_by_steps(parse_str(s));
+}
+
+TEST_CASE( "Futures" ) {
+    std::string fib = "_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1 _else fib(fib)(x + -1) + fib(fib)(x + -2) _in ";
+    SECTION( "Values" ) {
+        long before = Future::spawns();
+        CHECK( future_interp("_let a = _spawn 1 + 2 _in _await a + 1")
+              ->equals(NEW(NumVal)(4)) );
+        CHECK( future_interp(fib + "_let a = _spawn fib(fib)(15) _in _let b = _spawn fib(fib)(14) _in _await a + _await b")
+              ->equals(NEW(NumVal)(1597)) );
+        CHECK( future_steps(fib + "_let a = _spawn fib(fib)(15) _in _let b = _spawn fib(fib)(14) _in _await a + _await b")
+              ->equals(NEW(NumVal)(1597)) );
+        CHECK( Future::spawns() == before + 5 );
+        CHECK( future_interp("_await _spawn _fun (x) x * 2")->call(NEW(NumVal)(4))
+              ->equals(NEW(NumVal)(8)) );
+    }
+    SECTION( "Closures" ) {
+        CHECK( future_interp("_let f = _spawn 5 _in _let g = _fun (x) _await f + x _in g(1) + g(2)")
+              ->equals(NEW(NumVal)(13)) );
+        CHECK( future_interp("_let y = 10 _in _let g = _fun (x) x + y _in _await _spawn g(_await _spawn g(1))")
+              ->equals(NEW(NumVal)(21)) );
+        CHECK( future_steps("_let y = 10 _in _let f = _spawn y _in _let g = _fun (x) _spawn _await f + x _in _await g(1) + _await g(2)")
+              ->equals(NEW(NumVal)(23)) );
+    }
+    SECTION( "Comparing" ) {
+        CHECK( future_interp("_let f = _spawn 1 _in f == f")
+              ->equals(NEW(BoolVal)(true)) );
+        CHECK( future_interp("(_spawn 1 + 1) == (_spawn 2)")
+              ->equals(NEW(BoolVal)(true)) );
+        CHECK( future_interp("(_spawn 1) == (_spawn 2)")
+              ->equals(NEW(BoolVal)(false)) );
+        CHECK( future_interp("(_spawn 1) == 1")
+              ->equals(NEW(BoolVal)(false)) );
+        CHECK( future_steps("(_spawn 1) == (_spawn 1)")
+              ->equals(NEW(BoolVal)(true)) );
+    }
+    SECTION( "Errors" ) {
+        CHECK_THROWS_WITH( future_interp("_await _spawn _true + 1"), "no adding booleans" );
+        CHECK_THROWS_WITH( future_steps("_await _spawn _true + 1"), "no adding booleans" );
+        CHECK_THROWS_WITH( future_interp("_let f = _spawn x _in 1 + _await f"), "free variable: x" );
+        CHECK_THROWS_WITH( future_interp("_await 1"), "not a future" );
+        CHECK_THROWS_WITH( future_interp("(_spawn 1) + 1"), "no adding futures" );
+        // Never awaited, so the error goes nowhere
+        CHECK( future_interp("_let f = _spawn _true + 1 _in 2")->equals(NEW(NumVal)(2)) );
+    }
+    SECTION( "Optimizing" ) {
+        // Optimizing must neither start the loop nor wait for it
+        std::string loop = "_let loop = _fun (loop) _fun (n) loop(loop)(n) _in loop(loop)(0)";
+        long before = Future::spawns();
+        PTR(Expr) e = PassManager::for_level(2)->run(parse_str("_let f = _spawn (" + loop + ") _in f"));
+        CHECK( e->to_string().find("_spawn") != std::string::npos );
+        CHECK( PassManager::for_level(2)->run(parse_str("_let f = _spawn 1 _in _await f"))->to_string().find("_await") != std::string::npos );
+        CHECK( Future::spawns() == before );
+        CHECK_THROWS_WITH( future_interp("_spawn 1")->to_expr(), "cannot turn a future into an expression" );
+    }
+    SECTION( "Stopping" ) {
+        // A spawned loop nobody awaits must not keep the process from
+        // exiting, which stops the pool
+        std::string loop = "_let loop = _fun (loop) _fun (n) loop(loop)(n) _in loop(loop)(0)";
+        CHECK( future_interp("_let f = _spawn " + loop + " _in 1")->equals(NEW(NumVal)(1)) );
+        CHECK( future_steps("_let f = _spawn " + loop + " _in 2")->equals(NEW(NumVal)(2)) );
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        Future::stop();
+        CHECK( future_interp("_await _spawn 3")->equals(NEW(NumVal)(3)) );
+    }
+    SECTION( "Awaiting inside the pool" ) {
+        Future::stop();
+        Future::threads = 1;
+        long before = Future::ran_in_place();
+        CHECK( future_interp("_await _spawn (_await _spawn (_await _spawn 3) + 1) + 1")
+              ->equals(NEW(NumVal)(5)) );
+        CHECK( Future::ran_in_place() > before );
+        Future::stop();
+        Future::threads = 0;
+    }
+}
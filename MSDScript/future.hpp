@@ -0,0 +1,77 @@
+#ifndef future_hpp
+#define future_hpp
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include "macros.hpp"
+
+class Expr;
+class Env;
+class Val;
+
+/* The work behind a FutureVal. spawn() copies the expression and its Env
+ with ThreadCopy and queues the copy for a pool of `threads` threads,
+ started by the first spawn(). await() waits for the value and returns a
+ copy of it for the calling thread, or rethrows what evaluating it threw.
+ A future no thread has started is run by the thread awaiting it, so a
+ pool thread waiting on a future never waits on work queued behind it.
+ While the collector or a profile is on, spawn() evaluates on the calling
+ thread at once, since neither can be shared. Held by std::shared_ptr,
+ whose count is atomic, because any thread with a copy of the FutureVal
+ may drop the last reference. */
+class Future {
+public:
+    // Threads in the pool; 0 makes one per core
+    static int threads;
+
+    // `steps` evaluates on the step machine, for a _spawn reached there
+    static std::shared_ptr<Future> spawn(PTR(Expr) expr, PTR(Env) env, bool steps);
+    PTR(Val) await();
+    // Ends the pool. Futures still queued run when they are awaited, and
+    // ones running in the pool fail with "cancelled" at their next call
+    // or step, so a script that never ends cannot keep the process from
+    // exiting
+    static void stop();
+    // Throws "cancelled" on a pool thread that stop() is ending. Called
+    // at every call and step, next to GC::safe_point()
+    static void poll() {
+        if (cancelling.load(std::memory_order_relaxed) && in_pool)
+            throw std::runtime_error("cancelled");
+    }
+
+    // Futures made, and how many of those ran on the thread that made or
+    // awaited them instead of in the pool
+    static long spawns();
+    static long ran_in_place();
+
+private:
+    typedef enum {
+        queued,
+        running,
+        finished
+    } state_t;
+
+    PTR(Expr) expr;
+    PTR(Env) env;
+    bool steps;
+    std::atomic<state_t> state;
+    std::mutex lock;
+    std::condition_variable done;
+    PTR(Val) result;
+    std::exception_ptr error;
+
+    static std::atomic<bool> cancelling;
+    static thread_local bool in_pool;
+
+    Future(PTR(Expr) expr, PTR(Env) env, bool steps);
+    // True for the one thread that gets to run a queued future
+    bool claim();
+    void run();
+    static void work();
+};
+
+#endif /* future_hpp */
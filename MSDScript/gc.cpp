@@ -0,0 +1,161 @@
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+#include "gc.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+#include "env.hpp"
+#include "cont.hpp"
+#include "step.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+
+bool GC::enabled = false;
+long GC::threshold = 100000;
+long GC::collections = 0;
+long GC::freed = 0;
+long GC::peak = 0;
+double GC::total_pause = 0;
+double GC::longest_pause = 0;
+long GC::tracked = 0;
+long GC::next_collection = 100000;
+
+// Never destroyed, because objects in static variables may be freed
+// after it would have been
+static std::unordered_set<Collectable*> &heap() {
+    static std::unordered_set<Collectable*> *objects = new std::unordered_set<Collectable*>();
+    return *objects;
+}
+
+Collectable::Collectable() {
+    if (GC::enabled) {
+        heap().insert(this);
+        if (++GC::tracked > GC::peak)
+            GC::peak = GC::tracked;
+    }
+}
+
+Collectable::Collectable(const Collectable &other) : Collectable() { }
+
+Collectable::~Collectable() {
+    if (GC::tracked > 0 && heap().erase(this) > 0)
+        GC::tracked--;
+}
+
+long GC::heap_size() {
+    return tracked;
+}
+
+void GC::collect() {
+#if MSD_PTR_MODE == MSD_PTR_COUNTED
+    auto start = std::chrono::steady_clock::now();
+    
+    // References from outside the heap. An object nothing owns yet is
+    // still being built, so it counts as a root too, and so does one
+    // that is IMMORTAL
+    const long reached = -1;
+    std::unordered_map<Collectable*, long> outside;
+    outside.reserve(heap().size());
+    for (Collectable *obj : heap()) {
+        long refs = obj->msd_refs;
+        if (refs == msd::RefCounted::immortal_refs)
+            outside[obj] = LONG_MAX;
+        else
+            outside[obj] = (refs == 0 ? 1 : refs);
+    }
+    std::vector<Collectable*> kids;
+    for (Collectable *obj : heap()) {
+        kids.clear();
+        obj->gc_children(kids);
+        for (Collectable *kid : kids) {
+            auto found = outside.find(kid);
+            if (found != outside.end())
+                found->second--;
+        }
+    }
+    
+    std::vector<Collectable*> todo;
+    for (auto &entry : outside) {
+        if (entry.second > 0) {
+            entry.second = reached;
+            todo.push_back(entry.first);
+        }
+    }
+    while (!todo.empty()) {
+        Collectable *obj = todo.back();
+        todo.pop_back();
+        kids.clear();
+        obj->gc_children(kids);
+        for (Collectable *kid : kids) {
+            auto found = outside.find(kid);
+            if (found != outside.end() && found->second != reached) {
+                found->second = reached;
+                todo.push_back(kid);
+            }
+        }
+    }
+    
+    // Holding a reference to every garbage object keeps them all alive
+    // until every cycle is broken, then letting go frees them
+    std::vector<PTR(Collectable)> garbage;
+    for (auto &entry : outside) {
+        if (entry.second != reached)
+            garbage.push_back(PTR(Collectable)(entry.first));
+    }
+    for (PTR(Collectable) &obj : garbage)
+        obj->gc_clear();
+    freed += (long)garbage.size();
+    garbage.clear();
+    
+    std::chrono::duration<double> pause = std::chrono::steady_clock::now() - start;
+    collections++;
+    total_pause += pause.count();
+    longest_pause = std::max(longest_pause, pause.count());
+#endif
+    next_collection = std::max(threshold, 2 * tracked);
+}
+
+void GC::report(std::ostream &out) {
+    out << "gc: " << collections << " collections, " << freed << " objects freed" << std::endl;
+    out << "gc: pauses " << total_pause * 1000 << " ms in total, longest " << longest_pause * 1000 << " ms" << std::endl;
+    out << "gc: heap " << tracked << " objects now, " << peak << " at most" << std::endl;
+}
+
+#if MSD_PTR_MODE == MSD_PTR_COUNTED
+TEST_CASE( "GC" ) {
+    bool saved_enabled = GC::enabled;
+    long saved_threshold = GC::threshold;
+    GC::enabled = true;
+    SECTION( "Cycles" ) {
+        long freed = GC::freed;
+        {
+            // What a recursive _let would make: the closure's Env holds
+            // the closure
+            PTR(ExtendedEnv) env = NEW(ExtendedEnv)("f", nullptr, Env::empty);
+            PTR(FunVal) f = NEW(FunVal)("x", NEW(VarExpr)("x"), env);
+            env->val = f;
+            GC::collect();
+            CHECK( GC::freed == freed );
+            CHECK( f->call(NEW(NumVal)(3))->equals(NEW(NumVal)(3)) );
+        }
+        long before = GC::heap_size();
+        GC::collect();
+        CHECK( GC::freed == freed + 2 );
+        CHECK( GC::heap_size() == before - 2 );
+    }
+    SECTION( "Running programs" ) {
+        GC::threshold = 50;
+        GC::collect();
+        long collections = GC::collections;
+        PTR(Expr) count = parse_str("_let count = _fun (count) _fun (n) _if n == 0 _then 0 _else 1 + count(count)(n + -1) _in count(count)(3000)");
+        CHECK( Step::interp_by_steps(count)->equals(NEW(NumVal)(3000)) );
+        CHECK( count->interp(Env::empty)->equals(NEW(NumVal)(3000)) );
+        CHECK( GC::collections > collections );
+    }
+    GC::enabled = saved_enabled;
+    GC::threshold = saved_threshold;
+}
+#endif
@@ -0,0 +1,80 @@
+#ifndef gc_hpp
+#define gc_hpp
+
+#include <iostream>
+#include <vector>
+#include "macros.hpp"
+#include "slab.hpp"
+
+/* Val, Env and Cont derive from Collectable through COLLECTABLE, which
+ also gives them what ENABLE_THIS would. With intrusive counts the count
+ lives in Collectable's base, so the collector can read it. */
+#if MSD_PTR_MODE == MSD_PTR_COUNTED
+class Collectable : public msd::RefCounted {
+# define COLLECTABLE(T) : public Collectable
+#elif MSD_PTR_MODE == MSD_PTR_SHARED
+class Collectable {
+# define COLLECTABLE(T) : public std::enable_shared_from_this<T>, public Collectable
+#else
+class Collectable {
+# define COLLECTABLE(T) : public Collectable
+#endif
+public:
+    Collectable();
+    Collectable(const Collectable &);
+    virtual ~Collectable();
+    // Every Val, Env and Cont lives in the slabs
+    static void *operator new(std::size_t size) { return Slab::allocate(size); }
+    static void operator delete(void *p, std::size_t size) { Slab::deallocate(p, size); }
+    // Adds every Val, Env and Cont this object points to
+    virtual void gc_children(std::vector<Collectable*> &out) { }
+    // Drops those pointers, to break up a garbage cycle
+    virtual void gc_clear() { }
+};
+
+template <typename T>
+inline void gc_child(std::vector<Collectable*> &out, PTR(T) const &p) {
+    if (p != nullptr)
+        out.push_back(&*p);
+}
+
+/* Mark-sweep collector for the cycles reference counting cannot free,
+ such as a closure whose Env holds the closure itself. While `enabled`,
+ every Val, Env and Cont made is added to the heap, and at a safe point
+ (a step of the step machine or a function call) after the heap has
+ grown past the last collection's live size, or `threshold`, whichever
+ is larger, it is collected. Roots are the objects referred to from
+ outside the heap: the step machine registers, every PTR held on the
+ interpreter's C++ stack and the AST. They are found by taking each
+ object's reference count and subtracting the references that come from
+ other heap objects, so no root has to be registered by hand. Anything
+ not reachable from a root is garbage and is freed by clearing its
+ pointers. Needs intrusive counts; single threaded. */
+class GC {
+public:
+    static bool enabled;
+    static long threshold;
+    
+    static long collections;
+    static long freed;
+    static long peak;
+    static double total_pause;
+    static double longest_pause;
+    
+    static void collect();
+    static long heap_size();
+    static void report(std::ostream &out);
+    
+    static void safe_point() {
+        if (enabled && tracked >= next_collection)
+            collect();
+    }
+    
+private:
+    static long tracked;
+    static long next_collection;
+    
+    friend class Collectable;
+};
+
+#endif /* gc_hpp */
@@ -0,0 +1,333 @@
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include "jit.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+#include "env.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_NATIVE 1
+#include <sys/mman.h>
+#include <cstring>
+#endif
+
+bool JitEntry::enabled = true;
+long JitEntry::hot_calls = 1000;
+long JitEntry::stack_budget = 4 * 1024 * 1024;
+
+// Native functions take the argument and the lowest stack address they
+// may use, and return the result with a flag that is set when they gave
+// up, which comes back in rax and rdx
+struct JitResult {
+    long value;
+    long bailed;
+};
+typedef JitResult (*JitCode)(long arg, char *limit);
+
+namespace {
+    /* Emits code for one function. Values are 32 bit ints in eax, the
+     argument is kept at [rbp-8], temporaries go on the stack, and a self
+     call is a plain `call` to the start of the function. A self call that
+     comes back with rdx set makes the caller give up too, so giving up
+     at any depth unwinds the whole native call. */
+    class Emitter {
+    public:
+        std::vector<unsigned char> out;
+        bool ok;
+        Symbol arg;
+        Symbol self;
+        bool has_self;
+        
+        Emitter(Symbol arg) : ok(true), arg(arg), has_self(false) { }
+        
+        void function(PTR(Expr) body) {
+            bytes({ 0x55 });                        // push rbp
+            bytes({ 0x48, 0x89, 0xE5 });            // mov rbp, rsp
+            bytes({ 0x57 });                        // push rdi
+            bytes({ 0x48, 0x83, 0xEC, 0x08 });      // sub rsp, 8
+            bytes({ 0x48, 0x39, 0xF4 });            // cmp rsp, rsi
+            bytes({ 0x0F, 0x82 });                  // jb bail
+            bail_jumps.push_back(rel32());
+            value(body);
+            bytes({ 0x31, 0xD2 });                  // xor edx, edx
+            bytes({ 0xC9, 0xC3 });                  // leave; ret
+            size_t bail = out.size();
+            bytes({ 0xBA, 0x01, 0x00, 0x00, 0x00 }); // mov edx, 1
+            bytes({ 0xC9, 0xC3 });                  // leave; ret
+            for (size_t at : bail_jumps)
+                patch(at, bail);
+        }
+        
+    private:
+        std::vector<size_t> bail_jumps;
+        
+        void bytes(std::initializer_list<unsigned char> bs) {
+            out.insert(out.end(), bs);
+        }
+        
+        void imm32(int v) {
+            for (int i = 0; i < 4; i++)
+                out.push_back((unsigned char)(((unsigned)v >> (8 * i)) & 0xFF));
+        }
+        
+        // Leaves room for a rel32 and returns where it is
+        size_t rel32() {
+            size_t at = out.size();
+            imm32(0);
+            return at;
+        }
+        
+        void patch(size_t at, size_t target) {
+            int rel = (int)target - (int)(at + 4);
+            for (int i = 0; i < 4; i++)
+                out[at + i] = (unsigned char)(((unsigned)rel >> (8 * i)) & 0xFF);
+        }
+        
+        // `f(f)(arg)`, where every self call must use the same `f`
+        PTR(Expr) self_call_arg(PTR(Expr) e) {
+            PTR(CallExpr) outer = CAST(CallExpr)(e);
+            if (outer == nullptr)
+                return nullptr;
+            PTR(CallExpr) inner = CAST(CallExpr)(outer->to_be_called);
+            if (inner == nullptr)
+                return nullptr;
+            PTR(VarExpr) f = CAST(VarExpr)(inner->to_be_called);
+            PTR(VarExpr) f2 = CAST(VarExpr)(inner->actual_arg);
+            if (f == nullptr || f2 == nullptr || f->name != f2->name || f->name == arg)
+                return nullptr;
+            if (has_self && self != f->name)
+                return nullptr;
+            has_self = true;
+            self = f->name;
+            return outer->actual_arg;
+        }
+        
+        // Arithmetic with one operand a literal uses the immediate form
+        void binary(PTR(Expr) lhs, PTR(Expr) rhs, unsigned char imm_op, std::initializer_list<unsigned char> reg_op) {
+            PTR(NumExpr) lhs_num = CAST(NumExpr)(lhs);
+            PTR(NumExpr) rhs_num = CAST(NumExpr)(rhs);
+            if (rhs_num != nullptr || lhs_num != nullptr) {
+                value(rhs_num != nullptr ? lhs : rhs);
+                if (imm_op == 0x69)
+                    bytes({ 0x69, 0xC0 });          // imul eax, eax, imm32
+                else
+                    bytes({ imm_op });              // add eax, imm32
+                imm32(rhs_num != nullptr ? rhs_num->rep : lhs_num->rep);
+                return;
+            }
+            value(lhs);
+            bytes({ 0x50 });                        // push rax
+            value(rhs);
+            bytes({ 0x59 });                        // pop rcx
+            bytes(reg_op);
+        }
+        
+        void value(PTR(Expr) e) {
+            if (!ok)
+                return;
+            if (PTR(NumExpr) n = CAST(NumExpr)(e)) {
+                bytes({ 0xB8 });                    // mov eax, imm32
+                imm32(n->rep);
+            } else if (PTR(VarExpr) v = CAST(VarExpr)(e)) {
+                if (v->name != arg) {
+                    ok = false;
+                    return;
+                }
+                bytes({ 0x8B, 0x45, 0xF8 });        // mov eax, [rbp-8]
+            } else if (PTR(AddExpr) a = CAST(AddExpr)(e)) {
+                binary(a->lhs, a->rhs, 0x05, { 0x01, 0xC8 });       // add eax, ecx
+            } else if (PTR(MultExpr) m = CAST(MultExpr)(e)) {
+                binary(m->lhs, m->rhs, 0x69, { 0x0F, 0xAF, 0xC1 }); // imul eax, ecx
+            } else if (PTR(IfExpr) i = CAST(IfExpr)(e)) {
+                std::vector<size_t> to_else;
+                branch_if_false(i->test_part, to_else);
+                value(i->then_part);
+                bytes({ 0xE9 });                    // jmp end
+                size_t to_end = rel32();
+                for (size_t at : to_else)
+                    patch(at, out.size());
+                value(i->else_part);
+                patch(to_end, out.size());
+            } else if (PTR(Expr) actual = self_call_arg(e)) {
+                value(actual);
+                bytes({ 0x89, 0xC7 });              // mov edi, eax
+                bytes({ 0xE8 });                    // call start
+                patch(rel32(), 0);
+                bytes({ 0x85, 0xD2 });              // test edx, edx
+                bytes({ 0x0F, 0x85 });              // jnz bail
+                bail_jumps.push_back(rel32());
+            } else {
+                ok = false;
+            }
+        }
+        
+        void branch_if_false(PTR(Expr) test, std::vector<size_t> &to_else) {
+            if (!ok)
+                return;
+            if (PTR(BoolExpr) b = CAST(BoolExpr)(test)) {
+                if (!b->rep) {
+                    bytes({ 0xE9 });                // jmp else
+                    to_else.push_back(rel32());
+                }
+                return;
+            }
+            PTR(EqualExpr) q = CAST(EqualExpr)(test);
+            if (q == nullptr) {
+                ok = false;
+                return;
+            }
+            PTR(NumExpr) lhs_num = CAST(NumExpr)(q->lhs);
+            PTR(NumExpr) rhs_num = CAST(NumExpr)(q->rhs);
+            if (rhs_num != nullptr || lhs_num != nullptr) {
+                value(rhs_num != nullptr ? q->lhs : q->rhs);
+                bytes({ 0x3D });                    // cmp eax, imm32
+                imm32(rhs_num != nullptr ? rhs_num->rep : lhs_num->rep);
+            } else {
+                value(q->lhs);
+                bytes({ 0x50 });                    // push rax
+                value(q->rhs);
+                bytes({ 0x59 });                    // pop rcx
+                bytes({ 0x39, 0xC1 });              // cmp ecx, eax
+            }
+            bytes({ 0x0F, 0x85 });                  // jne else
+            to_else.push_back(rel32());
+        }
+    };
+}
+
+JitEntry::JitEntry(Symbol formal_arg, PTR(Expr) body) {
+    this->state = cold;
+    this->calls = 0;
+    this->formal_arg = formal_arg;
+    this->body = body;
+    this->code = nullptr;
+    this->code_size = 0;
+}
+
+JitEntry::~JitEntry() {
+#ifdef JIT_NATIVE
+    if (code != nullptr)
+        munmap(code, code_size);
+#endif
+}
+
+void JitEntry::compile() {
+    state = failed;
+#ifdef JIT_NATIVE
+    Emitter emitter(formal_arg);
+    emitter.function(body);
+    if (!emitter.ok)
+        return;
+    self_name = emitter.self;
+    code_size = emitter.out.size();
+    void *mem = mmap(nullptr, code_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return;
+    memcpy(mem, emitter.out.data(), code_size);
+    if (mprotect(mem, code_size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, code_size);
+        return;
+    }
+    code = mem;
+    state = compiled;
+#endif
+}
+
+void JitEntry::prepare() {
+    if (state == cold)
+        compile();
+}
+
+bool JitEntry::try_call(PTR(Env) env, PTR(Val) actual_arg, PTR(Val) &result) {
+    if (state == failed)
+        return false;
+    if (state == cold) {
+        if (++calls < hot_calls)
+            return false;
+        compile();
+        if (state != compiled)
+            return false;
+    }
+    NumVal *n = as_num(actual_arg);
+    if (n == nullptr)
+        return false;
+    // f(f) has to make another closure of this same function, which it
+    // does exactly when `f` is the function whose body is the FunExpr
+    // that owns this entry
+    if (self_name != Symbol()) {
+        PTR(Val) f_val;
+        try {
+            f_val = env->lookup(self_name);
+        } catch (std::runtime_error &) {
+            return false;
+        }
+        PTR(FunVal) f = CAST(FunVal)(f_val);
+        if (f == nullptr || f->formal_arg != self_name)
+            return false;
+        PTR(FunExpr) made = CAST(FunExpr)(f->body);
+        if (made == nullptr || &*made->jit != this)
+            return false;
+    }
+    char *limit = (char *)__builtin_frame_address(0) - stack_budget;
+    JitResult r = ((JitCode)code)(n->rep, limit);
+    if (r.bailed)
+        return false;
+    result = NEW(NumVal)((int)r.value);
+    return true;
+}
+
+TEST_CASE( "JIT" ) {
+    long saved_hot = JitEntry::hot_calls;
+    JitEntry::hot_calls = 5;
+    std::string fib = "_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1 _else fib(fib)(x + -1) + fib(fib)(x + -2) _in fib(fib)";
+    SECTION( "Hot functions" ) {
+        PTR(Val) f = parse_str(fib)->interp(NEW(EmptyEnv)());
+        PTR(FunVal) fv = CAST(FunVal)(f);
+        REQUIRE( fv != nullptr );
+        REQUIRE( fv->jit != nullptr );
+        CHECK( f->call(NEW(NumVal)(10))->equals(NEW(NumVal)(89)) );
+#ifdef JIT_NATIVE
+        CHECK( fv->jit->state == JitEntry::compiled );
+        CHECK( fv->jit->self_name == Symbol("fib") );
+#endif
+        CHECK( f->call(NEW(NumVal)(20))->equals(NEW(NumVal)(10946)) );
+        CHECK( f->call(NEW(NumVal)(0))->equals(NEW(NumVal)(1)) );
+        PTR(Expr) arith = parse_str("_let f = _fun (x) (x * 3 + 2 * x) * (x + x) + 7 _in f(1) + f(2) + f(3) + f(4) + f(5) + f(6) + f(-4)");
+        CHECK( arith->interp(NEW(EmptyEnv)())->equals(arith->optimize()->interp(NEW(EmptyEnv)())) );
+        CHECK( parse_str("_let f = _fun (x) x * 65536 * 65536 + 1 _in f(1)+f(1)+f(1)+f(1)+f(1)+f(1)")->interp(NEW(EmptyEnv)())
+              ->equals(NEW(NumVal)(6)) );
+    }
+    SECTION( "Guards" ) {
+        PTR(Val) f = parse_str(fib)->interp(NEW(EmptyEnv)());
+        CHECK( f->call(NEW(NumVal)(10))->equals(NEW(NumVal)(89)) );
+        CHECK_THROWS_WITH( f->call(NEW(BoolVal)(true)), "no adding booleans" );
+        // `f` is bound to some other function, so f(f) is not a self call
+        PTR(Expr) other = parse_str("_let g = _fun (g) _fun (x) x + 100 _in _let f = _fun (f) _fun (x) _if x == 0 _then 0 _else f(f)(x + -1) _in _let h = f(g) _in h(1) + h(1) + h(1) + h(1) + h(1) + h(1)");
+        CHECK( other->interp(NEW(EmptyEnv)())->equals(NEW(NumVal)(600)) );
+    }
+    SECTION( "Bodies that are not compiled" ) {
+        PTR(Val) f = parse_str("_let y = 3 _in _fun (x) x + y")->interp(NEW(EmptyEnv)());
+        for (int i = 0; i < 10; i++)
+            CHECK( f->call(NEW(NumVal)(i))->equals(NEW(NumVal)(i + 3)) );
+        CHECK( CAST(FunVal)(f)->jit->state == JitEntry::failed );
+    }
+    SECTION( "Deep recursion gives up" ) {
+        long saved_budget = JitEntry::stack_budget;
+        JitEntry::stack_budget = 4096;
+        PTR(Expr) count = parse_str("_let count = _fun (count) _fun (n) _if n == 0 _then 0 _else 1 + count(count)(n + -1) _in count(count)(100000)");
+        CHECK( count->interp(NEW(EmptyEnv)())->equals(NEW(NumVal)(100000)) );
+        JitEntry::stack_budget = saved_budget;
+        CHECK( count->interp(NEW(EmptyEnv)())->equals(NEW(NumVal)(100000)) );
+    }
+    SECTION( "Disabled" ) {
+        JitEntry::enabled = false;
+        PTR(Val) f = parse_str(fib)->interp(NEW(EmptyEnv)());
+        CHECK( CAST(FunVal)(f)->jit == nullptr );
+        CHECK( f->call(NEW(NumVal)(10))->equals(NEW(NumVal)(89)) );
+        JitEntry::enabled = true;
+    }
+    JitEntry::hot_calls = saved_hot;
+}
@@ -0,0 +1,56 @@
+#ifndef jit_hpp
+#define jit_hpp
+
+#include <vector>
+#include "macros.hpp"
+#include "symbol.hpp"
+
+class Expr;
+class Env;
+class Val;
+
+/* Tiered JIT for hot integer functions (x86-64 Linux only; everywhere
+ else nothing is ever compiled). Every FunExpr run by interp() gets one
+ JitEntry shared by all closures it makes, and FunVal::call counts calls
+ on it. Once a function has been called `hot_calls` times its body is
+ compiled to native code if it only uses its argument, number literals,
+ +, *, ==, _if and calls of itself written as `f(f)(arg)`. Native code
+ runs only when the argument is a number and `f` really is the function
+ that made this closure; otherwise, or if native recursion gets too deep,
+ the call runs in the interpreter. */
+class JitEntry ENABLE_THIS(JitEntry) {
+public:
+    typedef enum {
+        cold,
+        compiled,
+        failed
+    } state_t;
+    
+    state_t state;
+    long calls;
+    Symbol formal_arg;
+    PTR(Expr) body;
+    // The `f` in `f(f)(arg)` self calls
+    Symbol self_name;
+    
+    JitEntry(Symbol formal_arg, PTR(Expr) body);
+    ~JitEntry();
+    // Returns true with `result` set when native code ran the call
+    bool try_call(PTR(Env) env, PTR(Val) actual_arg, PTR(Val) &result);
+    // Compiles now instead of after `hot_calls` calls, so try_call()
+    // only reads the entry from then on
+    void prepare();
+    
+    static bool enabled;
+    static long hot_calls;
+    // Bytes of C++ stack native recursion may use before giving up
+    static long stack_budget;
+    
+private:
+    void *code;
+    size_t code_size;
+    
+    void compile();
+};
+
+#endif /* jit_hpp */
@@ -0,0 +1,97 @@
+#include <unordered_set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "lift.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+#include "env.hpp"
+#include "step.hpp"
+#include "pass.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+
+// Rebuilds `e` bottom up, collecting its free variables on the way so
+// each _fun is checked without walking its body again
+static PTR(Expr) lift_rec(PTR(Expr) e, std::unordered_set<Symbol> &free) {
+    if (PTR(VarExpr) v = CAST(VarExpr)(e)) {
+        free.insert(v->name);
+        return e;
+    }
+    std::vector<PTR(Expr)> kids = expr_children(e);
+    std::vector<std::unordered_set<Symbol>> kid_free(kids.size());
+    for (size_t i = 0; i < kids.size(); i++)
+        kids[i] = lift_rec(kids[i], kid_free[i]);
+    
+    if (PTR(LetExpr) l = CAST(LetExpr)(e))
+        kid_free[1].erase(l->name);
+    PTR(FunExpr) f = CAST(FunExpr)(e);
+    if (f != nullptr)
+        kid_free[0].erase(f->formal_arg);
+    for (std::unordered_set<Symbol> &vars : kid_free)
+        free.insert(vars.begin(), vars.end());
+    
+    if (f != nullptr && free.empty()) {
+        if (f->lifted != nullptr && kids[0] == f->body)
+            return e;
+        PTR(FunExpr) lifted = NEW(FunExpr)(f->formal_arg, kids[0]);
+        lifted->lifted = NEW(FunVal)(f->formal_arg, kids[0], Env::empty);
+        return lifted;
+    }
+    return expr_with_children(e, kids);
+}
+
+PTR(Expr) lift(PTR(Expr) e) {
+    std::unordered_set<Symbol> free;
+    return lift_rec(e, free);
+}
+
+static PTR(Expr) lift_str(std::string s) {
+    return lift(parse_str(s));
+}
+
+TEST_CASE( "Lift" ) {
+    SECTION( "Closed functions" ) {
+        PTR(FunExpr) f = CAST(FunExpr)(lift_str("_fun (x) x + 1"));
+        REQUIRE( f != nullptr );
+        REQUIRE( f->lifted != nullptr );
+        CHECK( f->interp(NEW(EmptyEnv)()) == f->lifted );
+        CHECK( f->interp(NEW(ExtendedEnv)("y", NEW(NumVal)(1), NEW(EmptyEnv)())) == f->lifted );
+        CHECK( CAST(FunVal)(f->lifted)->env == Env::empty );
+        CHECK( lift(f) == f );
+    }
+    SECTION( "Functions with free variables" ) {
+        PTR(FunExpr) f = CAST(FunExpr)(lift_str("_fun (x) x + y"));
+        REQUIRE( f != nullptr );
+        CHECK( f->lifted == nullptr );
+        PTR(LetExpr) l = CAST(LetExpr)(lift_str("_let y = 1 _in _fun (x) x + y"));
+        REQUIRE( l != nullptr );
+        CHECK( CAST(FunExpr)(l->body)->lifted == nullptr );
+        PTR(LetExpr) s = CAST(LetExpr)(lift_str("_let y = 2 _in _fun (x) _await _spawn x + y"));
+        REQUIRE( s != nullptr );
+        CHECK( CAST(FunExpr)(s->body)->lifted == nullptr );
+        CHECK( lift_str("_let y = 2 _in _let f = _fun (x) _await _spawn x + y _in f(1)")->interp(Env::empty)
+              ->equals(NEW(NumVal)(3)) );
+    }
+    SECTION( "Inner functions" ) {
+        // The outer function uses nothing from outside, but the inner one
+        // captures x, so only the outer is lifted
+        PTR(FunExpr) f = CAST(FunExpr)(lift_str("_fun (x) _fun (y) x + y"));
+        REQUIRE( f != nullptr );
+        CHECK( f->lifted != nullptr );
+        CHECK( CAST(FunExpr)(f->body)->lifted == nullptr );
+        PTR(FunExpr) g = CAST(FunExpr)(lift_str("_fun (x) _fun (y) y"));
+        CHECK( CAST(FunExpr)(g->body)->lifted != nullptr );
+    }
+    SECTION( "Same result" ) {
+        std::string fib = "_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1 _else fib(fib)(x + -1) + fib(fib)(x + -2) _in fib(fib)(10)";
+        PTR(Expr) e = lift_str(fib);
+        CHECK( e->to_string() == lift_str(fib)->to_string() );
+        CHECK( e->interp(NEW(EmptyEnv)())
+              ->equals(NEW(NumVal)(89)) );
+        CHECK( Step::interp_by_steps(e)
+              ->equals(NEW(NumVal)(89)) );
+        CHECK( lift_str("_let f = _fun (x) x * 2 _in _let g = _fun (y) f(y) + 1 _in g(4)")->interp(NEW(EmptyEnv)())
+              ->equals(NEW(NumVal)(9)) );
+    }
+}
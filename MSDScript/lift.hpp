@@ -0,0 +1,14 @@
+#ifndef lift_hpp
+#define lift_hpp
+
+#include "macros.hpp"
+
+class Expr;
+
+// Lambda lifting. Every _fun without free variables gets one FunVal,
+// built once over the shared empty Env, that all evaluations of it
+// return, so making the closure allocates nothing and a call never keeps
+// the surrounding bindings alive
+PTR(Expr) lift(PTR(Expr) e);
+
+#endif /* lift_hpp */
@@ -3,21 +3,181 @@
 
 #include <memory>
 
-#if 0
+/* How objects are owned, chosen here for the whole codebase:
+ MSD_PTR_RAW     plain pointers that are never freed
+ MSD_PTR_SHARED  std::shared_ptr
+ MSD_PTR_COUNTED msd::ref, a count kept inside each object (the default)
+ Counts are plain integers unless MSD_ATOMIC_REFS is defined, which a
+ build must do if two threads can copy pointers to the same object. */
+#define MSD_PTR_RAW 0
+#define MSD_PTR_SHARED 1
+#define MSD_PTR_COUNTED 2
+
+#ifndef MSD_PTR_MODE
+# define MSD_PTR_MODE MSD_PTR_COUNTED
+#endif
+
+#if MSD_PTR_MODE == MSD_PTR_RAW
 
 # define NEW(T) new T
 # define PTR(T) T*
 # define CAST(T) dynamic_cast<T*>
 # define THIS this
 # define ENABLE_THIS(T) /* empty */
+# define BORROW(T, obj) (&(obj))
+# define IMMORTAL(p) (p)
 
-#else
+#elif MSD_PTR_MODE == MSD_PTR_SHARED
 
 # define NEW(T) std::make_shared<T>
 # define PTR(T) std::shared_ptr<T>
 # define CAST(T) std::dynamic_pointer_cast<T>
 # define THIS shared_from_this()
 # define ENABLE_THIS(T) : public std::enable_shared_from_this<T>
+// Points at an object that is not owned, like a local, without counting
+// references; it must not outlive the object
+# define BORROW(T, obj) std::shared_ptr<T>(std::shared_ptr<T>(), &(obj))
+# define IMMORTAL(p) (p)
+
+#else
+
+# include <atomic>
+# include <cstddef>
+# include <functional>
+# include <type_traits>
+# include <utility>
+
+# define NEW(T) msd::make_ref<T>
+# define PTR(T) msd::ref<T>
+# define CAST(T) msd::ref_cast<T>
+# define THIS msd::ref_this(this)
+# define ENABLE_THIS(T) : public msd::RefCounted
+// Points at an object that is not owned, like a local. The object gets
+// one reference that is never dropped, so counting can never free it;
+// the pointer must not outlive it
+# define BORROW(T, obj) msd::borrow<T>(obj)
+// Marks an object as never freed and returns it. Pointers to it stop
+// counting references, so threads can copy them without writing to it
+# define IMMORTAL(p) msd::immortal(p)
+
+namespace msd {
+    // Every class held by PTR derives from this, through ENABLE_THIS
+    class RefCounted {
+    public:
+        // The count of an object IMMORTAL has marked
+        static const long immortal_refs = -1;
+
+        RefCounted() : msd_refs(0) { }
+        // A copy is a new object nobody points to yet
+        RefCounted(const RefCounted &) : msd_refs(0) { }
+        RefCounted &operator=(const RefCounted &) { return *this; }
+        virtual ~RefCounted() { }
+
+#ifdef MSD_ATOMIC_REFS
+        mutable std::atomic<long> msd_refs;
+#else
+        mutable long msd_refs;
+#endif
+    };
+
+    template <typename T>
+    class ref {
+    public:
+        ref() : p(nullptr) { }
+        ref(std::nullptr_t) : p(nullptr) { }
+        explicit ref(T *p) : p(p) { retain(); }
+        ref(const ref &other) : p(other.p) { retain(); }
+        ref(ref &&other) noexcept : p(other.p) { other.p = nullptr; }
+        template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+        ref(const ref<U> &other) : p(other.get()) { retain(); }
+        template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+        ref(ref<U> &&other) noexcept : p(other.get()) { other.forget(); }
+        ~ref() { release(); }
+
+        ref &operator=(const ref &other) {
+            ref(other).swap(*this);
+            return *this;
+        }
+        ref &operator=(ref &&other) noexcept {
+            ref(std::move(other)).swap(*this);
+            return *this;
+        }
+
+        T *operator->() const { return p; }
+        T &operator*() const { return *p; }
+        T *get() const { return p; }
+        explicit operator bool() const { return p != nullptr; }
+        void reset() { ref().swap(*this); }
+        void swap(ref &other) noexcept { std::swap(p, other.p); }
+        // Gives up the pointer without dropping its reference, for the
+        // converting move
+        void forget() { p = nullptr; }
+
+    private:
+        T *p;
+
+        void retain() {
+            if (p != nullptr && p->msd_refs != RefCounted::immortal_refs)
+                ++p->msd_refs;
+        }
+        void release() {
+            if (p != nullptr && p->msd_refs != RefCounted::immortal_refs && --p->msd_refs == 0)
+                delete p;
+        }
+    };
+
+    template <typename T, typename U>
+    bool operator==(const ref<T> &a, const ref<U> &b) { return a.get() == b.get(); }
+    template <typename T, typename U>
+    bool operator!=(const ref<T> &a, const ref<U> &b) { return a.get() != b.get(); }
+    template <typename T>
+    bool operator==(const ref<T> &a, std::nullptr_t) { return a.get() == nullptr; }
+    template <typename T>
+    bool operator==(std::nullptr_t, const ref<T> &a) { return a.get() == nullptr; }
+    template <typename T>
+    bool operator!=(const ref<T> &a, std::nullptr_t) { return a.get() != nullptr; }
+    template <typename T>
+    bool operator!=(std::nullptr_t, const ref<T> &a) { return a.get() != nullptr; }
+    template <typename T, typename U>
+    bool operator<(const ref<T> &a, const ref<U> &b) { return std::less<const void *>()(a.get(), b.get()); }
+
+    template <typename T, typename... Args>
+    ref<T> make_ref(Args&&... args) {
+        return ref<T>(new T(std::forward<Args>(args)...));
+    }
+
+    template <typename T, typename U>
+    ref<T> ref_cast(const ref<U> &other) {
+        return ref<T>(dynamic_cast<T*>(other.get()));
+    }
+
+    template <typename T>
+    ref<T> ref_this(T *self) {
+        return ref<T>(self);
+    }
+
+    template <typename T>
+    ref<T> immortal(ref<T> p) {
+        if (p != nullptr)
+            p->msd_refs = RefCounted::immortal_refs;
+        return p;
+    }
+
+    template <typename T, typename U>
+    ref<T> borrow(U &obj) {
+        ++obj.msd_refs;
+        return ref<T>(&obj);
+    }
+}
+
+namespace std {
+    template <typename T>
+    struct hash<msd::ref<T>> {
+        size_t operator()(const msd::ref<T> &r) const {
+            return hash<T*>()(r.get());
+        }
+    };
+}
 
 #endif
 
@@ -1,10 +1,25 @@
 #include <iostream>
+#include <sstream>
 #include "parse.hpp"
 #include "env.hpp"
 #include "value.hpp"
 #include "expr.hpp"
 #include "cont.hpp"
 #include "step.hpp"
+#include "checkpoint.hpp"
+#include "pass.hpp"
+#include "profile.hpp"
+#include "lift.hpp"
+#include "escape.hpp"
+#include "compile.hpp"
+#include "jit.hpp"
+#include "emit_c.hpp"
+#include "native.hpp"
+#include "program.hpp"
+#include "parallel.hpp"
+#include "server.hpp"
+#include "gc.hpp"
+#include "slab.hpp"
 
 #define CATCH_CONFIG_RUNNER
 #include "catch.hpp"
@@ -13,30 +28,210 @@ int main(int argc, char **argv) {
     try {
         bool optimize_mode = false;
         bool step_mode = false;
+        bool compiled_mode = false;
+        bool stats_mode = false;
+        bool emit_mode = false;
+        bool gc_stats = false;
+        int threads = 0;
+        int parallel = 0;
+        const char *native_path = nullptr;
+        const char *profile_out = nullptr;
+        const char *profile_in = nullptr;
+        long checkpoint_steps = -1;
+        const char *checkpoint_out = nullptr;
+        const char *resume_in = nullptr;
+        const char *serve_path = nullptr;
+        int workers = 0;
+        PTR(PassManager) passes = PassManager::for_level(2);
         PTR(Expr) e;
-        if ((argc > 1) && !strcmp(argv[1], "--opt")){
-            optimize_mode = true;
-            argc--;
-            argv++;
-        } else if ((argc > 1) && !strcmp(argv[1], "--step")) {
-            step_mode = true;
+        while (argc > 1 && argv[1][0] == '-') {
+            if (!strcmp(argv[1], "--opt")) {
+                optimize_mode = true;
+            } else if (!strcmp(argv[1], "-O0") || !strcmp(argv[1], "-O1") || !strcmp(argv[1], "-O2")) {
+                optimize_mode = true;
+                passes = PassManager::for_level(argv[1][2] - '0');
+            } else if (!strcmp(argv[1], "--passes") && argc > 2) {
+                optimize_mode = true;
+                passes = PassManager::for_names(argv[2]);
+                argc--;
+                argv++;
+            } else if (!strcmp(argv[1], "--fuel") && argc > 2) {
+                Expr::fold_fuel = atol(argv[2]);
+                argc--;
+                argv++;
+            } else if (!strcmp(argv[1], "--opt-stats")) {
+                optimize_mode = true;
+                stats_mode = true;
+            } else if (!strcmp(argv[1], "--profile-out") && argc > 2) {
+                profile_out = argv[2];
+                argc--;
+                argv++;
+            } else if (!strcmp(argv[1], "--profile-in") && argc > 2) {
+                optimize_mode = true;
+                profile_in = argv[2];
+                argc--;
+                argv++;
+            } else if (!strcmp(argv[1], "--max-depth") && argc > 2) {
+                Step::max_interp_depth = atoi(argv[2]);
+                argc--;
+                argv++;
+            } else if (!strcmp(argv[1], "--step")) {
+                step_mode = true;
+            } else if (!strcmp(argv[1], "--checkpoint") && argc > 3) {
+                step_mode = true;
+                checkpoint_steps = atol(argv[2]);
+                if (checkpoint_steps < 0)
+                    throw std::runtime_error("--checkpoint needs at least 0 steps");
+                checkpoint_out = argv[3];
+                argc -= 2;
+                argv += 2;
+            } else if (!strcmp(argv[1], "--resume") && argc > 2) {
+                step_mode = true;
+                resume_in = argv[2];
+                argc--;
+                argv++;
+            } else if (!strcmp(argv[1], "--compiled")) {
+                compiled_mode = true;
+            } else if (!strcmp(argv[1], "--emit-c")) {
+                emit_mode = true;
+            } else if (!strcmp(argv[1], "--native") && argc > 2) {
+                native_path = argv[2];
+                argc--;
+                argv++;
+            } else if (!strcmp(argv[1], "--gc")) {
+                GC::enabled = true;
+            } else if (!strcmp(argv[1], "--gc-stats")) {
+                GC::enabled = true;
+                gc_stats = true;
+            } else if (!strcmp(argv[1], "--alloc-bench")) {
+                Slab::benchmark(std::cout, { 1, 8, 32 });
+                return 0;
+            } else if (!strcmp(argv[1], "--threads") && argc > 2) {
+                threads = atoi(argv[2]);
+                if (threads < 1)
+                    throw std::runtime_error("--threads needs at least 1");
+                argc--;
+                argv++;
+            } else if (!strcmp(argv[1], "--parallel") && argc > 2) {
+                parallel = atoi(argv[2]);
+                if (parallel < 1)
+                    throw std::runtime_error("--parallel needs at least 1");
+                argc--;
+                argv++;
+            } else if (!strcmp(argv[1], "--serve") && argc > 2) {
+                serve_path = argv[2];
+                argc--;
+                argv++;
+            } else if (!strcmp(argv[1], "--workers") && argc > 2) {
+                workers = atoi(argv[2]);
+                if (workers < 1)
+                    throw std::runtime_error("--workers needs at least 1");
+                argc--;
+                argv++;
+            } else if (!strcmp(argv[1], "--request-steps") && argc > 2) {
+                Server::max_steps = atol(argv[2]);
+                argc--;
+                argv++;
+            } else if (!strcmp(argv[1], "--no-jit")) {
+                JitEntry::enabled = false;
+            } else {
+                throw std::runtime_error((std::string)"unknown flag " + argv[1]);
+            }
             argc--;
             argv++;
         }
+        if (serve_path != nullptr) {
+            Server server(workers);
+            if (!strcmp(serve_path, "-"))
+                server.serve(std::cin, std::cout);
+            else
+                server.listen(serve_path);
+            return 0;
+        }
+        if (native_path != nullptr) {
+            NativeProgram program(native_path);
+            try {
+                std::cout << program.run()->to_string() << std::endl;
+            } catch (std::runtime_error err) {
+                std::cerr << err.what() << std::endl;
+                return 2;
+            }
+            return 0;
+        }
         if (argc > 1) {
             std::ifstream prog_in(argv[1]);
             e = parse(prog_in);
         } else {
             e = parse(std::cin);
         }
+        if (profile_in != nullptr) {
+            std::ifstream in(profile_in);
+            if (!in)
+                throw std::runtime_error((std::string)"cannot read " + profile_in);
+            passes->add_setup_pass(NEW(ProfilePass)(Profile::read(in, e)));
+        }
+        if (emit_mode) {
+            emit_c(passes->run(e), std::cout);
+            return 0;
+        }
+        if (!optimize_mode)
+            e = escape_analysis(lift(e));
+        if (profile_out != nullptr)
+            Profile::current = NEW(Profile)(e);
         try {
             if(optimize_mode){
-                std::cout << e->optimize()->to_string() << std::endl;
+                std::cout << passes->run(e)->to_string() << std::endl;
+                if (stats_mode)
+                    passes->report(std::cerr);
             } else if(step_mode) {
-                std::cout << Step::interp_by_steps(e)->to_string() << std::endl;
+                Step::Registers state;
+                if (resume_in != nullptr) {
+                    std::ifstream in(resume_in, std::ios::binary);
+                    if (!in)
+                        throw std::runtime_error((std::string)"cannot read " + resume_in);
+                    std::ostringstream bytes;
+                    bytes << in.rdbuf();
+                    Checkpoint::load(e, bytes.str(), state);
+                } else {
+                    Step::start(state, e, Env::empty);
+                }
+                Step::resume(state, checkpoint_steps);
+                if (!Step::done(state)) {
+                    std::ofstream out(checkpoint_out, std::ios::binary);
+                    out << Checkpoint::save(e, state);
+                    if (!out)
+                        throw std::runtime_error((std::string)"cannot write " + checkpoint_out);
+                    std::cerr << "checkpoint saved to " << checkpoint_out << std::endl;
+                    return 0;
+                }
+                std::cout << state.val->to_string() << std::endl;
+            } else if(threads > 0) {
+                Program program(e);
+                std::cout << program.run_on_threads(threads)[0]->to_string() << std::endl;
+            } else if(parallel > 0) {
+                Program program(e);
+                Parallel::start(parallel);
+                PTR(Val) result;
+                try {
+                    result = program.run();
+                } catch (std::runtime_error &err) {
+                    Parallel::stop();
+                    throw;
+                }
+                Parallel::stop();
+                std::cout << result->to_string() << std::endl;
+            } else if(compiled_mode) {
+                std::cout << interp_compiled(e)->to_string() << std::endl;
             } else {
                 std::cout << e->interp(NEW(EmptyEnv)())->to_string() << std::endl;
             }
+            if (gc_stats)
+                GC::report(std::cerr);
+            if (profile_out != nullptr) {
+                std::ofstream out(profile_out);
+                Profile::current->write(out);
+                Profile::current = nullptr;
+            }
         }catch (std::runtime_error err) {
             std::cerr << err.what() << std::endl;
             return 2;
@@ -0,0 +1,167 @@
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "native.hpp"
+#include "emit_c.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+#include "env.hpp"
+#include "future.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+
+long NativeProgram::stack_size = 256L * 1024 * 1024;
+
+NativeProgram::NativeProgram(std::string so_path) {
+    heap_bytes = 0;
+    handle = dlopen(so_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr)
+        throw std::runtime_error((std::string)"cannot load " + so_path + ": " + dlerror());
+    entry = (void (*)(msd_result *, long))dlsym(handle, "msd_run");
+    if (entry == nullptr) {
+        dlclose(handle);
+        throw std::runtime_error("not an MSDScript program: " + so_path);
+    }
+}
+
+NativeProgram::~NativeProgram() {
+    dlclose(handle);
+}
+
+namespace {
+    struct NativeRun {
+        void (*entry)(msd_result *out, long stack_budget);
+        long stack_budget;
+        msd_result result;
+    };
+    
+    void *native_thread(void *arg) {
+        NativeRun *run = (NativeRun *)arg;
+        run->entry(&run->result, run->stack_budget);
+        return nullptr;
+    }
+}
+
+PTR(Val) NativeProgram::run() {
+    NativeRun run;
+    run.entry = entry;
+    // Leaves room below the limit for the runtime's own calls
+    run.stack_budget = stack_size - 64 * 1024;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, stack_size);
+    pthread_t thread;
+    int failed = pthread_create(&thread, &attr, native_thread, &run);
+    pthread_attr_destroy(&attr);
+    if (failed)
+        throw std::runtime_error("cannot start native program");
+    pthread_join(thread, nullptr);
+    heap_bytes = run.result.heap;
+    
+    PTR(Val) result = nullptr;
+    switch (run.result.kind) {
+        case 0:
+            result = NEW(NumVal)(run.result.num);
+            break;
+        case 1:
+            result = NEW(BoolVal)(run.result.num != 0);
+            break;
+        case 2: {
+            PTR(FunExpr) f = CAST(FunExpr)(parse_str(run.result.text));
+            result = NEW(FunVal)(f->formal_arg, f->body, NEW(EmptyEnv)());
+            break;
+        }
+        default:
+            throw std::runtime_error(run.result.text);
+    }
+    // The runtime awaited each future around the result
+    for (int i = 0; i < run.result.futures; i++)
+        result = NEW(FutureVal)(Future::spawn(result->to_expr(), NEW(EmptyEnv)(), false));
+    return result;
+}
+
+void NativeProgram::build(PTR(Expr) e, std::string so_path) {
+    std::string c_path = so_path + ".c";
+    {
+        std::ofstream out(c_path);
+        if (!out)
+            throw std::runtime_error("cannot write " + c_path);
+        emit_c(e, out);
+    }
+    const char *cc = getenv("CC");
+    std::string command = (std::string)(cc != nullptr ? cc : "cc")
+        + " -O2 -shared -fPIC -o '" + so_path + "' '" + c_path + "'";
+    if (system(command.c_str()) != 0)
+        throw std::runtime_error("cannot compile " + c_path);
+}
+
+static PTR(Val) native_run(std::string s, std::string so_path) {
+    NativeProgram::build(parse_str(s), so_path);
+    NativeProgram program(so_path);
+    return program.run();
+}
+
+TEST_CASE( "Native programs" ) {
+    if (system("cc --version > /dev/null 2>&1") != 0)
+        return;
+    char dir[] = "/tmp/msdnativeXXXXXX";
+    REQUIRE( mkdtemp(dir) != nullptr );
+    std::string so = (std::string)dir + "/prog.so";
+    
+    CHECK( native_run("_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1 _else fib(fib)(x + -1) + fib(fib)(x + -2) _in fib(fib)(20)", so)
+          ->equals(NEW(NumVal)(10946)) );
+    CHECK( native_run("_let x = 2 _in (_fun (y) x * y == 6)(3)", so)
+          ->equals(NEW(BoolVal)(true)) );
+    CHECK( native_run("(_fun (x) x) == _fun (x) x", so)
+          ->equals(NEW(BoolVal)(true)) );
+    CHECK( native_run("1 == _true", so)
+          ->equals(NEW(BoolVal)(false)) );
+    CHECK( native_run("2147483647 + 1", so)
+          ->equals(NEW(NumVal)(-2147483647 - 1)) );
+    CHECK( native_run("_let y = 1 _in _fun (x) x + y", so)->to_string()
+          == "_fun (x) (x + y)" );
+    // Deep recursion and a long tail-call loop
+    CHECK( native_run("_let count = _fun (count) _fun (n) _if n == 0 _then 0 _else 1 + count(count)(n + -1) _in count(count)(100000)", so)
+          ->equals(NEW(NumVal)(100000)) );
+    {
+        NativeProgram::build(parse_str("_let loop = _fun (loop) _fun (n) _if n == 0 _then _true _else loop(loop)(n + -1) _in loop(loop)(10000000)"), so);
+        NativeProgram program(so);
+        CHECK( program.run()->equals(NEW(BoolVal)(true)) );
+        // One closure for the whole loop
+        CHECK( program.heap_bytes <= 65536 );
+    }
+    CHECK( native_run("_let add = _fun (a) _fun (b) a + b _in (add(1))(2) + (add(2))(3) + (add(1))(4)", so)
+          ->equals(NEW(NumVal)(13)) );
+    CHECK( native_run("_fold(_fun (a) _fun (i) a + i, 0, 1, 10)", so)
+          ->equals(NEW(NumVal)(45)) );
+    CHECK( native_run("_fold(_fun (a) _fun (i) a, _true, 5, 1)", so)
+          ->equals(NEW(BoolVal)(true)) );
+    CHECK( native_run("_let a = _spawn 3 * 4 _in _let b = _spawn 1 _in _await a + _await b", so)
+          ->equals(NEW(NumVal)(13)) );
+    CHECK( native_run("(_spawn 1 + 1) == (_spawn 2)", so)
+          ->equals(NEW(BoolVal)(true)) );
+    CHECK( native_run("_spawn 5", so)->to_string() == "_spawn 5" );
+    // Never awaited, so neither the error nor the loop happens
+    CHECK( native_run("_let f = _spawn _true + 1 _in 2", so)
+          ->equals(NEW(NumVal)(2)) );
+    CHECK( native_run("_let f = _spawn (_let loop = _fun (loop) _fun (n) loop(loop)(n) _in loop(loop)(0)) _in 3", so)
+          ->equals(NEW(NumVal)(3)) );
+    
+    CHECK_THROWS_WITH( native_run("1 + x", so), "free variable: x" );
+    CHECK_THROWS_WITH( native_run("_true + 1", so), "no adding booleans" );
+    CHECK_THROWS_WITH( native_run("1 * _fun (x) x", so), "not a number" );
+    CHECK_THROWS_WITH( native_run("_if 1 _then 2 _else 3", so), "numbers cannot be true/false" );
+    CHECK_THROWS_WITH( native_run("_true(1)", so), "cannot call on a boolean" );
+    CHECK_THROWS_WITH( native_run("_fold(_fun (a) _fun (i) a, 0, _true, 3)", so), "fold bounds must be numbers" );
+    CHECK_THROWS_WITH( native_run("_await 1", so), "not a future" );
+    CHECK_THROWS_WITH( native_run("(_spawn 1) + 1", so), "no adding futures" );
+    CHECK_THROWS_WITH( native_run("_await _spawn _true + 1", so), "no adding booleans" );
+    CHECK_THROWS_WITH( NativeProgram((std::string)dir + "/missing.so"), Catch::Contains("cannot load") );
+    
+    unlink(so.c_str());
+    unlink((so + ".c").c_str());
+    rmdir(dir);
+}
@@ -0,0 +1,51 @@
+#ifndef native_hpp
+#define native_hpp
+
+#include <string>
+#include "macros.hpp"
+
+class Expr;
+class Val;
+
+// Must match `msd_result` in the runtime emit_c() writes
+struct msd_result {
+    int kind;
+    int num;
+    const char *text;
+    long heap;
+    // How many futures the result was inside
+    int futures;
+};
+
+/* A program translated by emit_c() and compiled to a shared object,
+ loaded with dlopen. run() evaluates it on a thread with a stack of
+ `stack_size` bytes and turns the result into a Val; errors come back as
+ the same runtime_error the interpreter would throw. A function result
+ keeps its text but not the variables it captured, so it prints and
+ compares like the interpreter's but should not be called. Closures are
+ only freed when the run ends, so a loop that makes a closure over new
+ values on every turn grows until then; one that only calls f(f) again
+ does not. A _spawn runs when it is first awaited, on the same thread.
+ One program must not be run from two threads at once. */
+class NativeProgram {
+public:
+    NativeProgram(std::string so_path);
+    ~NativeProgram();
+    PTR(Val) run();
+    // Bytes the last run() took for closures
+    long heap_bytes;
+    
+    // Writes `e` as C next to `so_path` and compiles it with $CC (cc by
+    // default)
+    static void build(PTR(Expr) e, std::string so_path);
+    static long stack_size;
+    
+private:
+    void *handle;
+    void (*entry)(msd_result *out, long stack_budget);
+    
+    NativeProgram(const NativeProgram &);
+    NativeProgram &operator=(const NativeProgram &);
+};
+
+#endif /* native_hpp */
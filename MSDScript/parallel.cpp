@@ -0,0 +1,246 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include "parallel.hpp"
+#include "copy.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+#include "env.hpp"
+#include "program.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+
+struct Parallel::Task {
+    PTR(Expr) expr;
+    PTR(Env) env;
+    int depth;
+    PTR(Val) result;
+    std::exception_ptr error;
+    std::atomic<bool> done;
+};
+
+struct Parallel::Worker {
+    std::mutex lock;
+    std::deque<Task*> tasks;
+};
+
+int Parallel::max_depth = 0;
+thread_local Parallel::Worker *Parallel::current = nullptr;
+thread_local int Parallel::depth = 0;
+std::vector<Parallel::Worker*> Parallel::workers;
+
+namespace {
+    std::vector<std::thread> threads;
+    std::atomic<bool> stopping(false);
+    // Tasks sitting in any deque, so idle workers know when to look
+    std::atomic<long> queued(0);
+    std::mutex idle_lock;
+    std::condition_variable idle;
+    std::atomic<long> fork_count(0);
+    std::atomic<long> steal_count(0);
+}
+
+void Parallel::start(int count) {
+    stop();
+    if (count < 2)
+        return;
+    max_depth = 3;
+    for (int n = 1; n < count; n *= 2)
+        max_depth++;
+    for (int i = 0; i < count; i++)
+        workers.push_back(new Worker());
+    current = workers[0];
+    depth = 0;
+    stopping = false;
+    for (int i = 1; i < count; i++)
+        threads.emplace_back(work, workers[i]);
+}
+
+void Parallel::stop() {
+    stopping = true;
+    idle.notify_all();
+    for (std::thread &thread : threads)
+        thread.join();
+    threads.clear();
+    for (Worker *worker : workers)
+        delete worker;
+    workers.clear();
+    current = nullptr;
+}
+
+long Parallel::forks() {
+    return fork_count;
+}
+
+long Parallel::steals() {
+    return steal_count;
+}
+
+// Takes the oldest task from the first deque that has one, starting
+// after the caller's own so thieves spread out
+Parallel::Task *Parallel::find_task() {
+    if (queued == 0)
+        return nullptr;
+    size_t start = 0;
+    for (size_t i = 0; i < workers.size(); i++) {
+        if (workers[i] == current)
+            start = i + 1;
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        Worker *victim = workers[(start + i) % workers.size()];
+        std::lock_guard<std::mutex> hold(victim->lock);
+        if (!victim->tasks.empty()) {
+            Task *task = victim->tasks.front();
+            victim->tasks.pop_front();
+            queued--;
+            if (victim != current)
+                steal_count++;
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+void Parallel::run(Task *task) {
+    int saved_depth = depth;
+    depth = task->depth;
+    try {
+        task->result = task->expr->interp(task->env);
+    } catch (...) {
+        task->error = std::current_exception();
+    }
+    depth = saved_depth;
+    // The owner may destroy the task as soon as this is set
+    task->done.store(true, std::memory_order_release);
+}
+
+void Parallel::work(Worker *self) {
+    current = self;
+    depth = 0;
+    while (!stopping) {
+        Task *task = find_task();
+        if (task != nullptr) {
+            run(task);
+        } else {
+            std::unique_lock<std::mutex> hold(idle_lock);
+            idle.wait_for(hold, std::chrono::milliseconds(1), [] {
+                return queued > 0 || stopping;
+            });
+        }
+    }
+}
+
+void Parallel::both(PTR(Expr) lhs, PTR(Expr) rhs, PTR(Env) env, PTR(Val) &lv, PTR(Val) &rv) {
+#if MSD_PTR_MODE == MSD_PTR_COUNTED
+    PTR(Env) task_env;
+    {
+        // Gone before the task is pushed, so only the thief holds the copy
+        ThreadCopy copy(false);
+        task_env = copy.env(env);
+        if (!copy.ok)
+            task_env = nullptr;
+    }
+    if (task_env == nullptr) {
+        lv = lhs->interp(env);
+        rv = rhs->interp(env);
+        return;
+    }
+#else
+    PTR(Env) task_env = env;
+#endif
+    Task task;
+    task.expr = rhs;
+    task.env = task_env;
+    task.depth = depth + 1;
+    task.done = false;
+    task_env = nullptr;
+    {
+        std::lock_guard<std::mutex> hold(current->lock);
+        current->tasks.push_back(&task);
+    }
+    queued++;
+    fork_count++;
+    idle.notify_one();
+
+    // Takes the task back unless a thief has it
+    auto reclaim = [&task]() {
+        std::lock_guard<std::mutex> hold(current->lock);
+        if (!current->tasks.empty() && current->tasks.back() == &task) {
+            current->tasks.pop_back();
+            queued--;
+            return true;
+        }
+        return false;
+    };
+    auto wait = [&task]() {
+        while (!task.done.load(std::memory_order_acquire)) {
+            Task *other = find_task();
+            if (other != nullptr)
+                run(other);
+            else
+                std::this_thread::yield();
+        }
+    };
+
+    // Both operands are one fork deeper, wherever they run
+    struct Deeper {
+        Deeper() { depth++; }
+        ~Deeper() { depth--; }
+    } deeper;
+    try {
+        lv = lhs->interp(env);
+    } catch (...) {
+        if (!reclaim())
+            wait();
+        throw;
+    }
+    if (reclaim()) {
+        rv = rhs->interp(env);
+        return;
+    }
+    wait();
+    if (task.error)
+        std::rethrow_exception(task.error);
+    rv = task.result;
+}
+
+TEST_CASE( "Parallel" ) {
+    std::string fib = "_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1 _else fib(fib)(x + -1) + fib(fib)(x + -2) _in fib(fib)(18)";
+    SECTION( "Sites that fork" ) {
+        Program program(parse_str("_let f = _fun (x) x _in (f(1) + f(2)) * (1 + f(3))"));
+        PTR(LetExpr) let = CAST(LetExpr)(program.expr);
+        REQUIRE( let != nullptr );
+        PTR(MultExpr) mult = CAST(MultExpr)(let->body);
+        REQUIRE( mult != nullptr );
+        CHECK( mult->fork );
+        CHECK( CAST(AddExpr)(mult->lhs)->fork );
+        CHECK( ! CAST(AddExpr)(mult->rhs)->fork );
+    }
+    SECTION( "Same results" ) {
+        Parallel::start(4);
+        Program program(parse_str(fib));
+        long before = Parallel::forks();
+        CHECK( program.run()->equals(NEW(NumVal)(4181)) );
+        CHECK( Parallel::forks() > before );
+        Program closures(parse_str("_let y = 3 _in _let f = _fun (x) _fun (z) x + y + z _in f(1)(2) + f(4)(5) == 18"));
+        CHECK( closures.run()->equals(NEW(BoolVal)(true)) );
+        Program returned(parse_str("_let f = _fun (x) _fun (z) x + z _in f(1) == f(1)"));
+        CHECK( returned.run()->equals(NEW(BoolVal)(true)) );
+        Parallel::stop();
+        CHECK( program.run()->equals(NEW(NumVal)(4181)) );
+    }
+    SECTION( "Errors" ) {
+        Parallel::start(4);
+        Program left(parse_str("_let f = _fun (x) x + 1 _in f(_true) + f(_false)"));
+        CHECK_THROWS_WITH( left.run(), "no adding booleans" );
+        Program right(parse_str("_let f = _fun (x) x + 1 _in f(1) * f(_false)"));
+        CHECK_THROWS_WITH( right.run(), "no adding booleans" );
+        Parallel::stop();
+    }
+}
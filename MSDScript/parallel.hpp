@@ -0,0 +1,55 @@
+#ifndef parallel_hpp
+#define parallel_hpp
+
+#include <vector>
+#include "macros.hpp"
+
+class Expr;
+class Env;
+class Val;
+
+/* Fork-join evaluation of the operands of +, * and == for --parallel.
+ start(n) makes n - 1 worker threads and makes the calling thread the
+ nth; each has its own deque of tasks. A site Program has marked `fork`
+ (both operands make calls) that is reached fewer than `max_depth` forks
+ deep pushes its right operand onto its thread's deque and evaluates the
+ left one itself. Idle workers steal the oldest task from any deque.
+ When the left operand is done the site takes its task back if nobody
+ stole it, and otherwise runs other tasks until the thief has finished.
+ A stolen operand runs on its own copy of the Env and every value in it,
+ apart from IMMORTAL objects such as the Program's tree, so the two
+ threads never change the same reference count. */
+class Parallel {
+public:
+    // Forks a thread may be nested inside before it stops forking. Set by
+    // start() to enough to give every thread a few tasks
+    static int max_depth;
+    
+    static void start(int threads);
+    static void stop();
+    
+    // True on a thread start() set up that is not yet max_depth deep
+    static bool may_fork() {
+        return current != nullptr && depth < max_depth;
+    }
+    // Sets `lv` and `rv` to the values of `lhs` and `rhs`, evaluating
+    // them at once when another thread is free
+    static void both(PTR(Expr) lhs, PTR(Expr) rhs, PTR(Env) env, PTR(Val) &lv, PTR(Val) &rv);
+    
+    // Tasks pushed, and how many of those other threads stole
+    static long forks();
+    static long steals();
+    
+private:
+    struct Task;
+    struct Worker;
+    static thread_local Worker *current;
+    static thread_local int depth;
+    static std::vector<Worker*> workers;
+    
+    static Task *find_task();
+    static void run(Task *task);
+    static void work(Worker *self);
+};
+
+#endif /* parallel_hpp */
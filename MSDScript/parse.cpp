@@ -17,8 +17,10 @@ static PTR(Expr) parse_variable(std::istream &in);
 static PTR(Expr) parse_let(std::istream &in);
 static PTR(Expr) parse_if(std::istream &in);
 static PTR(Expr) parse_fun(std::istream &in);
+static PTR(Expr) parse_fold(std::istream &in);
 static std::string parse_keyword(std::istream &in);
 static std::string parse_alphabetic(std::istream &in, std::string prefix);
+static Symbol parse_symbol(std::istream &in);
 static char peek_after_spaces(std::istream &in);
 
 PTR(Expr) parse(std::istream &in) {
@@ -118,6 +120,12 @@ static PTR(Expr) parse_inner(std::istream &in) {
             expr = parse_if(in);
         } else if (keyword == "_fun" ){
             expr = parse_fun(in);
+        } else if (keyword == "_spawn") {
+            expr = NEW(SpawnExpr)(parse_expr(in));
+        } else if (keyword == "_await") {
+            expr = NEW(AwaitExpr)(parse_multicand(in));
+        } else if (keyword == "_fold") {
+            expr = parse_fold(in);
         } else {
             throw std::runtime_error((std::string)"unexpected keyword " + keyword);
         }
@@ -129,8 +137,7 @@ static PTR(Expr) parse_inner(std::istream &in) {
 
 static PTR(Expr) parse_let(std::istream &in) {
     char c = peek_after_spaces(in);
-    std::string name = "";
-    name += parse_alphabetic(in, name);
+    Symbol name = parse_symbol(in);
     c = peek_after_spaces(in);
     c = in.get();
     c = peek_after_spaces(in);
@@ -152,7 +159,7 @@ static PTR(Expr) parse_number(std::istream &in) {
 }
 
 static PTR(Expr) parse_variable(std::istream &in) {
-    return NEW(VarExpr)(parse_alphabetic(in, ""));
+    return NEW(VarExpr)(parse_symbol(in));
 }
 
 static PTR(Expr) parse_if(std::istream &in) {
@@ -174,7 +181,7 @@ static PTR(Expr) parse_fun(std::istream &in) {
         throw std::runtime_error("expected an open parenthesis");
     }
     c = in.get();
-    std::string variable = parse_alphabetic(in, "");
+    Symbol variable = parse_symbol(in);
     c = peek_after_spaces(in);
     if (c != ')') {
         throw std::runtime_error("expected a close parenthesis");
@@ -184,6 +191,31 @@ static PTR(Expr) parse_fun(std::istream &in) {
     return NEW(FunExpr)(variable, expr);
 }
 
+// The four operands of _fold, in parentheses and separated by commas
+static PTR(Expr) parse_fold(std::istream &in) {
+    char c = peek_after_spaces(in);
+    if (c != '(') {
+        throw std::runtime_error("expected an open parenthesis");
+    }
+    c = in.get();
+    PTR(Expr) args[4];
+    for (int i = 0; i < 4; i++) {
+        if (i > 0) {
+            c = peek_after_spaces(in);
+            if (c != ',')
+                throw std::runtime_error("expected a comma");
+            c = in.get();
+        }
+        args[i] = parse_expr(in);
+    }
+    c = peek_after_spaces(in);
+    if (c != ')') {
+        throw std::runtime_error("expected a close parenthesis");
+    }
+    c = in.get();
+    return NEW(FoldExpr)(args[0], args[1], args[2], args[3]);
+}
+
 static std::string parse_keyword(std::istream &in) {
     in.get(); // consume `_`
     return parse_alphabetic(in, "_");
@@ -200,6 +232,12 @@ static std::string parse_alphabetic(std::istream &in, std::string prefix) {
     return name;
 }
 
+// Variable names are interned as they are read, so the tree never holds
+// its own copy of a name
+static Symbol parse_symbol(std::istream &in) {
+    return Symbol(parse_alphabetic(in, ""));
+}
+
 static char peek_after_spaces(std::istream &in) {
     char c;
     while (1) {
@@ -211,7 +249,7 @@ static char peek_after_spaces(std::istream &in) {
     return c;
 }
 
-static PTR(Expr) parse_str(std::string s) {
+PTR(Expr) parse_str(std::string s) {
     std::istringstream in(s);
     return parse(in);
 }
@@ -308,6 +346,17 @@ TEST_CASE( "Parse Testing" ) {
           ->equals(NEW(FunExpr)("x", NEW(AddExpr)(NEW(VarExpr)("x"), NEW(NumExpr)(1)))));
     CHECK( parse_str("_fun (x) x * x")
           ->equals(NEW(FunExpr)("x", NEW(MultExpr)(NEW(VarExpr)("x"), NEW(VarExpr)("x")))));
+    CHECK( parse_str("_spawn f(1) + 2")
+          ->equals(NEW(SpawnExpr)(NEW(AddExpr)(NEW(CallExpr)(NEW(VarExpr)("f"), NEW(NumExpr)(1)), NEW(NumExpr)(2)))));
+    CHECK( parse_str("_await f(1) + _await g")
+          ->equals(NEW(AddExpr)(NEW(AwaitExpr)(NEW(CallExpr)(NEW(VarExpr)("f"), NEW(NumExpr)(1))), NEW(AwaitExpr)(NEW(VarExpr)("g")))));
+    CHECK( parse_str("_fold(f, 0, 1, n + 1)(2)")
+          ->equals(NEW(CallExpr)(NEW(FoldExpr)(NEW(VarExpr)("f"), NEW(NumExpr)(0), NEW(NumExpr)(1), NEW(AddExpr)(NEW(VarExpr)("n"), NEW(NumExpr)(1))), NEW(NumExpr)(2))));
+    CHECK( parse_str("_fold(_fun (a) _fun (i) a + i, _let x = 1 _in x, 0, 3)")
+          ->equals(NEW(FoldExpr)(NEW(FunExpr)("a", NEW(FunExpr)("i", NEW(AddExpr)(NEW(VarExpr)("a"), NEW(VarExpr)("i")))), NEW(LetExpr)("x", NEW(NumExpr)(1), NEW(VarExpr)("x")), NEW(NumExpr)(0), NEW(NumExpr)(3))));
+    CHECK_THROWS_WITH( parse_str("_fold f"), "expected an open parenthesis" );
+    CHECK_THROWS_WITH( parse_str("_fold(f, 0, 1)"), "expected a comma" );
+    CHECK_THROWS_WITH( parse_str("_fold(f, 0, 1, 2, 3)"), "expected a close parenthesis" );
     CHECK( parse_str("(_fun (x) x + 1) (2)")->interp(NEW(EmptyEnv)())
           ->equals(NEW(NumVal)(3)));
     CHECK( parse_str("_let f = _fun (x) x + 1 _in f(3)")->interp(NEW(EmptyEnv)())
@@ -2,10 +2,13 @@
 #define parse_hpp
 
 #include <iostream>
+#include <string>
 #include "env.hpp"
 
 class Expr;
 PTR(Expr) parse(std::istream &in);
+// Parses a whole program held in a string
+PTR(Expr) parse_str(std::string s);
 
 #endif /* parse_hpp */
 
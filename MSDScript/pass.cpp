@@ -0,0 +1,326 @@
+#include <chrono>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include "pass.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+#include "env.hpp"
+#include "cse.hpp"
+#include "lift.hpp"
+#include "escape.hpp"
+#include "egraph.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+
+FunctionPass::FunctionPass(std::string pass_name, std::function<PTR(Expr)(PTR(Expr))> fn) {
+    this->pass_name = pass_name;
+    this->fn = fn;
+}
+
+std::string FunctionPass::name() {
+    return pass_name;
+}
+
+PTR(Expr) FunctionPass::run(PTR(Expr) e) {
+    return fn(e);
+}
+
+static std::map<std::string, std::function<PTR(Pass)()>> &registry() {
+    static std::map<std::string, std::function<PTR(Pass)()>> passes = {
+        { "fold", []() -> PTR(Pass) {
+            return NEW(FunctionPass)("fold", [](PTR(Expr) e) { return e->optimize(); });
+        } },
+        { "simplify", []() -> PTR(Pass) {
+            return NEW(FunctionPass)("simplify", simplify);
+        } },
+        { "cse", []() -> PTR(Pass) {
+            return NEW(FunctionPass)("cse", cse);
+        } },
+        { "lift", []() -> PTR(Pass) {
+            return NEW(FunctionPass)("lift", lift);
+        } },
+        { "escape", []() -> PTR(Pass) {
+            return NEW(FunctionPass)("escape", escape_analysis);
+        } }
+    };
+    return passes;
+}
+
+void PassManager::register_pass(std::string name, std::function<PTR(Pass)()> make) {
+    registry()[name] = make;
+}
+
+PTR(Pass) PassManager::make_pass(std::string name) {
+    auto found = registry().find(name);
+    if (found == registry().end())
+        throw std::runtime_error("unknown pass " + name);
+    return found->second();
+}
+
+PassManager::PassManager() {
+    max_iterations = 8;
+    iterations = 0;
+}
+
+void PassManager::add_setup_pass(PTR(Pass) pass) {
+    setup_passes.push_back(pass);
+}
+
+void PassManager::add_pass(PTR(Pass) pass) {
+    passes.push_back(pass);
+}
+
+void PassManager::add_cleanup_pass(PTR(Pass) pass) {
+    cleanup_passes.push_back(pass);
+}
+
+PTR(PassManager) PassManager::for_level(int level) {
+    PTR(PassManager) pm = NEW(PassManager)();
+    if (level >= 1)
+        pm->add_pass(make_pass("fold"));
+    if (level >= 2) {
+        pm->add_pass(make_pass("simplify"));
+        pm->add_cleanup_pass(make_pass("cse"));
+    } else {
+        pm->max_iterations = 1;
+    }
+    return pm;
+}
+
+PTR(PassManager) PassManager::for_names(std::string names) {
+    PTR(PassManager) pm = NEW(PassManager)();
+    pm->max_iterations = 1;
+    std::istringstream in(names);
+    std::string name;
+    while (std::getline(in, name, ','))
+        if (name != "")
+            pm->add_pass(make_pass(name));
+    return pm;
+}
+
+// A pass that cannot handle a tree (for example folding hits a runtime
+// error) leaves it as it was; optimizing never makes a program fail
+PTR(Expr) PassManager::run_one(PTR(Pass) pass, Stats &stat, PTR(Expr) e) {
+    auto start = std::chrono::steady_clock::now();
+    PTR(Expr) out;
+    try {
+        out = pass->run(e);
+    } catch (std::runtime_error &) {
+        stat.failures++;
+        out = e;
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    stat.runs++;
+    stat.seconds += std::chrono::duration<double>(end - start).count();
+    stat.nodes_in += expr_size(e);
+    stat.nodes_out += expr_size(out);
+    if (!out->equals(e))
+        stat.changes++;
+    return out;
+}
+
+PTR(Expr) PassManager::run(PTR(Expr) e) {
+    stats.clear();
+    for (PTR(Pass) pass : setup_passes)
+        stats.push_back({ pass->name(), 0, 0, 0, 0.0, 0, 0 });
+    for (PTR(Pass) pass : passes)
+        stats.push_back({ pass->name(), 0, 0, 0, 0.0, 0, 0 });
+    for (PTR(Pass) pass : cleanup_passes)
+        stats.push_back({ pass->name(), 0, 0, 0, 0.0, 0, 0 });
+
+    size_t first = setup_passes.size();
+    size_t last = first + passes.size();
+    for (size_t i = 0; i < setup_passes.size(); i++)
+        e = run_one(setup_passes[i], stats[i], e);
+    iterations = 0;
+    while (iterations < max_iterations && !passes.empty()) {
+        iterations++;
+        PTR(Expr) before = e;
+        for (size_t i = 0; i < passes.size(); i++)
+            e = run_one(passes[i], stats[first + i], e);
+        if (e->equals(before))
+            break;
+    }
+    for (size_t i = 0; i < cleanup_passes.size(); i++)
+        e = run_one(cleanup_passes[i], stats[last + i], e);
+    return e;
+}
+
+void PassManager::report(std::ostream &out) {
+    out << "pass         runs  changed  failed   time (ms)   nodes in  nodes out" << std::endl;
+    for (Stats &stat : stats) {
+        out << std::left << std::setw(12) << stat.name << std::right
+            << std::setw(6) << stat.runs
+            << std::setw(9) << stat.changes
+            << std::setw(8) << stat.failures
+            << std::setw(12) << std::fixed << std::setprecision(3) << stat.seconds * 1000
+            << std::setw(11) << stat.nodes_in
+            << std::setw(11) << stat.nodes_out << std::endl;
+    }
+    out << "iterations: " << iterations << std::endl;
+}
+
+std::vector<PTR(Expr)> expr_children(PTR(Expr) e) {
+    if (PTR(AddExpr) a = CAST(AddExpr)(e))
+        return { a->lhs, a->rhs };
+    if (PTR(MultExpr) m = CAST(MultExpr)(e))
+        return { m->lhs, m->rhs };
+    if (PTR(EqualExpr) q = CAST(EqualExpr)(e))
+        return { q->lhs, q->rhs };
+    if (PTR(LetExpr) l = CAST(LetExpr)(e))
+        return { l->rhs, l->body };
+    if (PTR(IfExpr) i = CAST(IfExpr)(e))
+        return { i->test_part, i->then_part, i->else_part };
+    if (PTR(FunExpr) f = CAST(FunExpr)(e))
+        return { f->body };
+    if (PTR(CallExpr) c = CAST(CallExpr)(e))
+        return { c->to_be_called, c->actual_arg };
+    if (PTR(SpawnExpr) s = CAST(SpawnExpr)(e))
+        return { s->expr };
+    if (PTR(AwaitExpr) w = CAST(AwaitExpr)(e))
+        return { w->expr };
+    if (PTR(FoldExpr) f = CAST(FoldExpr)(e))
+        return { f->fun, f->init, f->lo, f->hi };
+    return { };
+}
+
+// Returns `e` itself when every child is unchanged
+PTR(Expr) expr_with_children(PTR(Expr) e, std::vector<PTR(Expr)> kids) {
+    std::vector<PTR(Expr)> old_kids = expr_children(e);
+    if (kids == old_kids)
+        return e;
+    if (CAST(AddExpr)(e))
+        return NEW(AddExpr)(kids[0], kids[1]);
+    if (CAST(MultExpr)(e))
+        return NEW(MultExpr)(kids[0], kids[1]);
+    if (CAST(EqualExpr)(e))
+        return NEW(EqualExpr)(kids[0], kids[1]);
+    if (PTR(LetExpr) l = CAST(LetExpr)(e))
+        return NEW(LetExpr)(l->name, kids[0], kids[1]);
+    if (CAST(IfExpr)(e))
+        return NEW(IfExpr)(kids[0], kids[1], kids[2]);
+    if (PTR(FunExpr) f = CAST(FunExpr)(e))
+        return NEW(FunExpr)(f->formal_arg, kids[0]);
+    if (CAST(CallExpr)(e))
+        return NEW(CallExpr)(kids[0], kids[1]);
+    if (CAST(SpawnExpr)(e))
+        return NEW(SpawnExpr)(kids[0]);
+    if (CAST(AwaitExpr)(e))
+        return NEW(AwaitExpr)(kids[0]);
+    if (CAST(FoldExpr)(e))
+        return NEW(FoldExpr)(kids[0], kids[1], kids[2], kids[3]);
+    return e;
+}
+
+long expr_size(PTR(Expr) e) {
+    long size = 1;
+    for (PTR(Expr) kid : expr_children(e))
+        size += expr_size(kid);
+    return size;
+}
+
+bool foldable(PTR(Expr) e) {
+    if (CAST(SpawnExpr)(e) || CAST(AwaitExpr)(e) || CAST(FoldExpr)(e))
+        return false;
+    for (PTR(Expr) kid : expr_children(e)) {
+        if (!foldable(kid))
+            return false;
+    }
+    return true;
+}
+
+std::set<std::string> free_vars(PTR(Expr) e) {
+    if (PTR(VarExpr) v = CAST(VarExpr)(e))
+        return { v->name };
+    if (PTR(LetExpr) l = CAST(LetExpr)(e)) {
+        std::set<std::string> vars = free_vars(l->body);
+        vars.erase(l->name);
+        std::set<std::string> rhs_vars = free_vars(l->rhs);
+        vars.insert(rhs_vars.begin(), rhs_vars.end());
+        return vars;
+    }
+    if (PTR(FunExpr) f = CAST(FunExpr)(e)) {
+        std::set<std::string> vars = free_vars(f->body);
+        vars.erase(f->formal_arg);
+        return vars;
+    }
+    std::set<std::string> vars;
+    for (PTR(Expr) kid : expr_children(e)) {
+        std::set<std::string> kid_vars = free_vars(kid);
+        vars.insert(kid_vars.begin(), kid_vars.end());
+    }
+    return vars;
+}
+
+TEST_CASE( "Pass helpers" ) {
+    PTR(Expr) e = parse_str("_let x = 1 _in _if x == 1 _then f(x) _else _fun (y) y * 2");
+    CHECK( expr_size(e) == 13 );
+    CHECK( expr_size(NEW(NumExpr)(1)) == 1 );
+    CHECK( expr_children(NEW(VarExpr)("x")).empty() );
+    CHECK( expr_with_children(e, expr_children(e)) == e );
+    CHECK( expr_with_children(NEW(AddExpr)(NEW(NumExpr)(1), NEW(NumExpr)(2)), { NEW(NumExpr)(3), NEW(NumExpr)(4) })
+          ->equals(NEW(AddExpr)(NEW(NumExpr)(3), NEW(NumExpr)(4))) );
+    CHECK( expr_with_children(NEW(LetExpr)("x", NEW(NumExpr)(1), NEW(NumExpr)(2)), { NEW(NumExpr)(3), NEW(VarExpr)("x") })
+          ->equals(NEW(LetExpr)("x", NEW(NumExpr)(3), NEW(VarExpr)("x"))) );
+    CHECK( free_vars(e) == std::set<std::string>({ "f" }) );
+    CHECK( free_vars(parse_str("_let x = x _in x + y")) == std::set<std::string>({ "x", "y" }) );
+    CHECK( free_vars(parse_str("_fun (x) _fun (y) x + y + z")) == std::set<std::string>({ "z" }) );
+}
+
+TEST_CASE( "Pass manager" ) {
+    SECTION( "Levels" ) {
+        PTR(Expr) e = parse_str("_let y = 2 + 3 _in (x + y) * (x + y)");
+        CHECK( PassManager::for_level(0)->run(e) == e );
+        CHECK( PassManager::for_level(1)->run(e)->to_string()
+              == "((x + 5) * (x + 5))" );
+        CHECK( PassManager::for_level(2)->run(e)->to_string()
+              == "(_let csea = (x + 5) _in (csea * csea))" );
+    }
+    SECTION( "Fixed point" ) {
+        PTR(PassManager) pm = PassManager::for_level(2);
+        pm->run(parse_str("1 + 2"));
+        CHECK( pm->iterations == 2 );
+        CHECK( pm->stats.size() == 3 );
+        CHECK( pm->stats[0].name == "fold" );
+        CHECK( pm->stats[0].runs == 2 );
+        CHECK( pm->stats[0].changes == 1 );
+        CHECK( pm->stats[0].nodes_in == 4 );
+        CHECK( pm->stats[0].nodes_out == 2 );
+        CHECK( pm->stats[1].name == "simplify" );
+        CHECK( pm->stats[1].runs == 2 );
+        CHECK( pm->stats[2].name == "cse" );
+        CHECK( pm->stats[2].runs == 1 );
+    }
+    SECTION( "Failing pass keeps its input" ) {
+        PassManager::register_pass("broken", []() -> PTR(Pass) {
+            return NEW(FunctionPass)("broken", [](PTR(Expr) e) -> PTR(Expr) {
+                throw std::runtime_error("broken");
+            });
+        });
+        PTR(PassManager) pm = PassManager::for_names("broken");
+        PTR(Expr) e = parse_str("1 + 2");
+        CHECK( pm->run(e) == e );
+        CHECK( pm->stats[0].failures == 1 );
+    }
+    SECTION( "Named passes" ) {
+        CHECK( PassManager::for_names("cse")->run(parse_str("(1 + 2) * (1 + 2)"))->to_string()
+              == "(_let csea = (1 + 2) _in (csea * csea))" );
+        CHECK( PassManager::for_names("cse,fold")->run(parse_str("(1 + 2) * (1 + 2)"))->to_string()
+              == "9" );
+        CHECK_THROWS_WITH( PassManager::for_names("fold,nope"), "unknown pass nope" );
+    }
+    SECTION( "Registered pass" ) {
+        PassManager::register_pass("swap", []() -> PTR(Pass) {
+            return NEW(FunctionPass)("swap", [](PTR(Expr) e) -> PTR(Expr) {
+                if (PTR(AddExpr) a = CAST(AddExpr)(e))
+                    return NEW(AddExpr)(a->rhs, a->lhs);
+                return e;
+            });
+        });
+        CHECK( PassManager::for_names("swap")->run(parse_str("x + 1"))->to_string()
+              == "(1 + x)" );
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef pass_hpp
+#define pass_hpp
+
+#include <functional>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+#include "macros.hpp"
+
+class Expr;
+
+// A single transformation over a whole Expr tree
+class Pass ENABLE_THIS(Pass) {
+public:
+    virtual ~Pass() { }
+    virtual std::string name() = 0;
+    virtual PTR(Expr) run(PTR(Expr) e) = 0;
+};
+
+// Wraps a plain function so a new pass does not need its own class
+class FunctionPass : public Pass {
+public:
+    std::string pass_name;
+    std::function<PTR(Expr)(PTR(Expr))> fn;
+    
+    FunctionPass(std::string pass_name, std::function<PTR(Expr)(PTR(Expr))> fn);
+    std::string name();
+    PTR(Expr) run(PTR(Expr) e);
+};
+
+// Runs any setup passes once, then an ordered list of passes until the
+// tree stops changing, then any cleanup passes once, keeping time and
+// node counts for every pass
+class PassManager ENABLE_THIS(PassManager) {
+public:
+    struct Stats {
+        std::string name;
+        int runs;
+        int changes;
+        int failures;
+        double seconds;
+        long nodes_in;
+        long nodes_out;
+    };
+    
+    int max_iterations;
+    int iterations;
+    std::vector<PTR(Pass)> setup_passes;
+    std::vector<PTR(Pass)> passes;
+    std::vector<PTR(Pass)> cleanup_passes;
+    std::vector<Stats> stats;
+    
+    PassManager();
+    void add_setup_pass(PTR(Pass) pass);
+    void add_pass(PTR(Pass) pass);
+    void add_cleanup_pass(PTR(Pass) pass);
+    PTR(Expr) run(PTR(Expr) e);
+    void report(std::ostream &out);
+    
+    // -O0 runs nothing, -O1 constant folding, -O2 folding and algebraic
+    // simplification to a fixed point followed by common subexpression
+    // elimination
+    static PTR(PassManager) for_level(int level);
+    // Comma separated pass names, run once each in the given order
+    static PTR(PassManager) for_names(std::string names);
+    static void register_pass(std::string name, std::function<PTR(Pass)()> make);
+    static PTR(Pass) make_pass(std::string name);
+    
+private:
+    PTR(Expr) run_one(PTR(Pass) pass, Stats &stat, PTR(Expr) e);
+};
+
+// Generic tree access so passes can walk and rebuild any Expr without a
+// new method on every subclass
+std::vector<PTR(Expr)> expr_children(PTR(Expr) e);
+PTR(Expr) expr_with_children(PTR(Expr) e, std::vector<PTR(Expr)> kids);
+long expr_size(PTR(Expr) e);
+std::set<std::string> free_vars(PTR(Expr) e);
+// Whether optimize() may evaluate `e`: not when it holds a _spawn or
+// _await, which start or wait on threads that fuel cannot stop, or a
+// _fold, whose loop is left for run time
+bool foldable(PTR(Expr) e);
+
+#endif /* pass_hpp */
@@ -0,0 +1,328 @@
+#include <chrono>
+#include <sstream>
+#include <stdexcept>
+#include "profile.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+#include "env.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+
+PTR(Profile) Profile::current = nullptr;
+
+static double now_seconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// FNV-1a over the printed program, so a profile is only applied to the
+// program it was recorded from
+static unsigned long program_fingerprint(PTR(Expr) program) {
+    unsigned long hash = 2166136261UL;
+    for (char c : program->to_string()) {
+        hash ^= (unsigned char)c;
+        hash = (hash * 16777619UL) & 0xffffffffUL;
+    }
+    return hash;
+}
+
+Profile::Profile(PTR(Expr) program) {
+    node_count = 0;
+    number(program);
+    fingerprint = program_fingerprint(program);
+    call_counts.assign(node_count, 0);
+    then_counts.assign(node_count, 0);
+    else_counts.assign(node_count, 0);
+    fun_calls.assign(node_count, 0);
+    fun_seconds.assign(node_count, 0.0);
+    fun_depth.assign(node_count, 0);
+    fun_start.assign(node_count, 0.0);
+}
+
+// Preorder, in the same child order as expr_children()
+void Profile::number(PTR(Expr) e) {
+    int id = node_count++;
+    ids[&*e] = id;
+    if (PTR(FunExpr) f = CAST(FunExpr)(e))
+        fun_bodies[&*f->body] = id;
+    for (PTR(Expr) kid : expr_children(e))
+        number(kid);
+}
+
+void Profile::record_call(Expr *site) {
+    auto found = ids.find(site);
+    if (found != ids.end())
+        call_counts[found->second]++;
+}
+
+void Profile::record_branch(Expr *site, bool took_then) {
+    auto found = ids.find(site);
+    if (found == ids.end())
+        return;
+    if (took_then)
+        then_counts[found->second]++;
+    else
+        else_counts[found->second]++;
+}
+
+// Time is only taken around the outermost active call of a function,
+// so recursion is not counted twice
+int Profile::enter_function(Expr *body) {
+    auto found = fun_bodies.find(body);
+    if (found == fun_bodies.end())
+        return -1;
+    int id = found->second;
+    fun_calls[id]++;
+    if (fun_depth[id]++ == 0)
+        fun_start[id] = now_seconds();
+    return id;
+}
+
+void Profile::exit_function(int id) {
+    if (id < 0)
+        return;
+    if (--fun_depth[id] == 0)
+        fun_seconds[id] += now_seconds() - fun_start[id];
+}
+
+long Profile::hottest_call() {
+    long hottest = 0;
+    for (long count : call_counts)
+        hottest = std::max(hottest, count);
+    return hottest;
+}
+
+void Profile::write(std::ostream &out) {
+    out << "msdscript-profile 1" << std::endl;
+    out << "nodes " << node_count << " " << fingerprint << std::endl;
+    for (int id = 0; id < node_count; id++) {
+        if (call_counts[id] > 0)
+            out << "call " << id << " " << call_counts[id] << std::endl;
+        if (then_counts[id] > 0 || else_counts[id] > 0)
+            out << "if " << id << " " << then_counts[id] << " " << else_counts[id] << std::endl;
+        if (fun_calls[id] > 0)
+            out << "fun " << id << " " << fun_calls[id] << " " << fun_seconds[id] << std::endl;
+    }
+}
+
+PTR(Profile) Profile::read(std::istream &in, PTR(Expr) program) {
+    PTR(Profile) profile = NEW(Profile)(program);
+    std::string word;
+    int version = 0;
+    int nodes = -1;
+    unsigned long fingerprint = 0;
+    in >> word >> version;
+    if (word != "msdscript-profile" || version != 1)
+        throw std::runtime_error("not a profile");
+    in >> word >> nodes >> fingerprint;
+    if (word != "nodes" || nodes != profile->node_count || fingerprint != profile->fingerprint)
+        throw std::runtime_error("profile does not match program");
+    while (in >> word) {
+        int id;
+        in >> id;
+        if (!in || id < 0 || id >= nodes)
+            throw std::runtime_error("bad profile entry");
+        if (word == "call") {
+            in >> profile->call_counts[id];
+        } else if (word == "if") {
+            in >> profile->then_counts[id] >> profile->else_counts[id];
+        } else if (word == "fun") {
+            in >> profile->fun_calls[id] >> profile->fun_seconds[id];
+        } else {
+            throw std::runtime_error("bad profile entry");
+        }
+    }
+    return profile;
+}
+
+ProfilePass::ProfilePass(PTR(Profile) profile) {
+    this->profile = profile;
+    this->hot_fraction = 0.01;
+    this->max_inline_size = 40;
+    this->next_id = 0;
+}
+
+std::string ProfilePass::name() {
+    return "profile";
+}
+
+PTR(Expr) ProfilePass::run(PTR(Expr) e) {
+    next_id = 0;
+    return visit(e, std::unordered_map<Symbol, PTR(Expr)>());
+}
+
+bool ProfilePass::is_hot(int id) {
+    long count = profile->call_counts[id];
+    return count > 0 && count >= hot_fraction * profile->hottest_call();
+}
+
+// Matches `v == c` or `c == v` where `c` is closed arithmetic on numbers
+static bool var_equals_const(PTR(Expr) test, Symbol &var, int &rep) {
+    PTR(EqualExpr) eq = CAST(EqualExpr)(test);
+    if (eq == nullptr)
+        return false;
+    PTR(Expr) other;
+    if (PTR(VarExpr) v = CAST(VarExpr)(eq->lhs)) {
+        var = v->name;
+        other = eq->rhs;
+    } else if (PTR(VarExpr) v = CAST(VarExpr)(eq->rhs)) {
+        var = v->name;
+        other = eq->lhs;
+    } else {
+        return false;
+    }
+    if (other->has_var())
+        return false;
+    try {
+        PTR(NumVal) val = CAST(NumVal)(other->interp(NEW(EmptyEnv)()));
+        if (val == nullptr)
+            return false;
+        rep = val->rep;
+        return true;
+    } catch (std::runtime_error &) {
+        return false;
+    }
+}
+
+// Ids are handed out in the same preorder as Profile::number, before
+// any child is rewritten
+PTR(Expr) ProfilePass::visit(PTR(Expr) e, std::unordered_map<Symbol, PTR(Expr)> funs) {
+    int id = next_id++;
+
+    if (PTR(LetExpr) l = CAST(LetExpr)(e)) {
+        PTR(Expr) rhs = visit(l->rhs, funs);
+        if (CAST(FunExpr)(rhs) != nullptr
+            && free_vars(rhs).empty()
+            && expr_size(rhs) <= max_inline_size)
+            funs[l->name] = rhs;
+        else
+            funs.erase(l->name);
+        return expr_with_children(e, { rhs, visit(l->body, funs) });
+    }
+    if (PTR(FunExpr) f = CAST(FunExpr)(e)) {
+        funs.erase(f->formal_arg);
+        return expr_with_children(e, { visit(f->body, funs) });
+    }
+    if (PTR(IfExpr) i = CAST(IfExpr)(e)) {
+        int else_id = id + 1 + (int)expr_size(i->test_part) + (int)expr_size(i->then_part);
+        PTR(Expr) test_part = visit(i->test_part, funs);
+        PTR(Expr) then_part = visit(i->then_part, funs);
+        PTR(Expr) else_part = visit(i->else_part, funs);
+        // Two tests of one variable against different constants can
+        // never both be true, so the hotter one can go first
+        PTR(IfExpr) inner = CAST(IfExpr)(else_part);
+        Symbol var1, var2;
+        int rep1, rep2;
+        if (inner != nullptr
+            && profile->then_counts[else_id] > profile->then_counts[id]
+            && var_equals_const(test_part, var1, rep1)
+            && var_equals_const(inner->test_part, var2, rep2)
+            && var1 == var2 && rep1 != rep2) {
+            return NEW(IfExpr)(inner->test_part, inner->then_part,
+                               NEW(IfExpr)(test_part, then_part, inner->else_part));
+        }
+        return expr_with_children(e, { test_part, then_part, else_part });
+    }
+    if (PTR(CallExpr) c = CAST(CallExpr)(e)) {
+        PTR(Expr) to_be_called = visit(c->to_be_called, funs);
+        PTR(Expr) actual_arg = visit(c->actual_arg, funs);
+        if (is_hot(id)) {
+            PTR(FunExpr) callee = CAST(FunExpr)(to_be_called);
+            if (PTR(VarExpr) v = CAST(VarExpr)(to_be_called)) {
+                auto found = funs.find(v->name);
+                if (found != funs.end())
+                    callee = CAST(FunExpr)(found->second);
+            }
+            if (callee != nullptr && expr_size(callee) <= max_inline_size)
+                return NEW(LetExpr)(callee->formal_arg, actual_arg, callee->body);
+        }
+        return expr_with_children(e, { to_be_called, actual_arg });
+    }
+
+    std::vector<PTR(Expr)> kids;
+    for (PTR(Expr) kid : expr_children(e))
+        kids.push_back(visit(kid, funs));
+    return expr_with_children(e, kids);
+}
+
+static PTR(Profile) profile_run(PTR(Expr) e) {
+    Profile::current = NEW(Profile)(e);
+    e->interp(NEW(EmptyEnv)());
+    PTR(Profile) profile = Profile::current;
+    Profile::current = nullptr;
+    return profile;
+}
+
+TEST_CASE( "Profile recording" ) {
+    PTR(Expr) e = parse_str("_let f = _fun (x) _if x == 0 _then 1 _else 2 _in f(0) + f(1) + f(1)");
+    PTR(Profile) profile = profile_run(e);
+    // 0 let, 1 fun, 2 if, 3 ==, 4 x, 5 0, 6 1, 7 2, 8 +, 9 call f(0), ...
+    CHECK( profile->node_count == 19 );
+    CHECK( profile->fun_calls[1] == 3 );
+    CHECK( profile->then_counts[2] == 1 );
+    CHECK( profile->else_counts[2] == 2 );
+    CHECK( profile->call_counts[9] == 1 );
+    CHECK( profile->hottest_call() == 1 );
+    CHECK( profile->fun_seconds[1] >= 0.0 );
+
+    SECTION( "Round trip" ) {
+        std::stringstream out;
+        profile->write(out);
+        PTR(Profile) again = Profile::read(out, parse_str("_let f = _fun (x) _if x == 0 _then 1 _else 2 _in f(0) + f(1) + f(1)"));
+        CHECK( again->then_counts == profile->then_counts );
+        CHECK( again->else_counts == profile->else_counts );
+        CHECK( again->call_counts == profile->call_counts );
+        CHECK( again->fun_calls == profile->fun_calls );
+    }
+    SECTION( "Other program" ) {
+        std::stringstream out;
+        profile->write(out);
+        CHECK_THROWS_WITH( Profile::read(out, parse_str("1 + 2")), "profile does not match program" );
+        std::stringstream junk("hello");
+        CHECK_THROWS_WITH( Profile::read(junk, e), "not a profile" );
+    }
+}
+
+TEST_CASE( "Profile timing survives errors" ) {
+    PTR(Expr) e = parse_str("_let f = _fun (x) _fold(_fun (a) _fun (i) _if i == 3 _then a _else a + i, x, 0, 20000) _in f");
+    Profile::current = NEW(Profile)(e);
+    PTR(Val) f = e->interp(NEW(EmptyEnv)());
+    CHECK_THROWS_WITH( f->call(NEW(BoolVal)(true)), "no adding booleans" );
+    CHECK( f->call(NEW(NumVal)(0))->equals(NEW(NumVal)(199990000 - 3)) );
+    PTR(Profile) profile = Profile::current;
+    Profile::current = nullptr;
+    CHECK( profile->fun_calls[1] == 2 );
+    CHECK( profile->fun_seconds[1] > 0.0 );
+}
+
+TEST_CASE( "Profile guided optimization" ) {
+    SECTION( "Hot direct call is inlined" ) {
+        PTR(Expr) e = parse_str("(_fun (x) x + 1)(2)");
+        PTR(Expr) opt = ProfilePass(profile_run(e)).run(e);
+        CHECK( opt->to_string() == "(_let x = 2 _in (x + 1))" );
+        CHECK( opt->interp(NEW(EmptyEnv)())->equals(NEW(NumVal)(3)) );
+    }
+    SECTION( "Cold call is left alone" ) {
+        PTR(Expr) e = parse_str("(_fun (x) x + 1)(2)");
+        PTR(Expr) opt = ProfilePass(NEW(Profile)(e)).run(e);
+        CHECK( opt == e );
+    }
+    SECTION( "Let bound closed function" ) {
+        PTR(Expr) e = parse_str("_let f = _fun (x) x * 2 _in f(3) + f(4)");
+        PTR(Expr) opt = ProfilePass(profile_run(e)).run(e);
+        CHECK( opt->to_string() == "(_let f = (_fun (x) (x * 2)) _in ((_let x = 3 _in (x * 2)) + (_let x = 4 _in (x * 2))))" );
+    }
+    SECTION( "Function with free variables is not inlined" ) {
+        PTR(Expr) e = parse_str("_let y = 2 _in _let f = _fun (x) x * y _in _let y = 5 _in f(3)");
+        PTR(Expr) opt = ProfilePass(profile_run(e)).run(e);
+        CHECK( opt->equals(e) );
+        CHECK( opt->interp(NEW(EmptyEnv)())->equals(NEW(NumVal)(6)) );
+    }
+    SECTION( "Hotter case is tested first" ) {
+        std::string src = "_let f = _fun (n) _if n == 0 _then 10 _else _if n == 2 + -1 _then 20 _else 30 _in f(1) + f(1) + f(0) + f(5)";
+        PTR(Expr) e = parse_str(src);
+        PTR(Profile) profile = profile_run(e);
+        PTR(Expr) opt = ProfilePass(profile).run(parse_str(src));
+        CHECK( opt->to_string().find("(_if n == (2 + -1) _then 20 _else (_if n == 0 _then 10 _else 30))") != std::string::npos );
+        CHECK( opt->interp(NEW(EmptyEnv)())->equals(NEW(NumVal)(80)) );
+    }
+}
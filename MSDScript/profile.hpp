@@ -0,0 +1,72 @@
+#ifndef profile_hpp
+#define profile_hpp
+
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+#include "macros.hpp"
+#include "symbol.hpp"
+#include "pass.hpp"
+
+class Expr;
+
+// Execution counts for one program, keyed by each node's preorder
+// position so a profile still lines up after the same source is parsed
+// again. While `Profile::current` is set, interp() records call counts
+// for every CallExpr, branch counts for every IfExpr and the time spent
+// in every function
+class Profile ENABLE_THIS(Profile) {
+public:
+    int node_count;
+    unsigned long fingerprint;
+    std::vector<long> call_counts;
+    std::vector<long> then_counts;
+    std::vector<long> else_counts;
+    std::vector<long> fun_calls;
+    std::vector<double> fun_seconds;
+    
+    static PTR(Profile) current;
+    
+    Profile(PTR(Expr) program);
+    void record_call(Expr *site);
+    void record_branch(Expr *site, bool took_then);
+    // Returns the FunExpr id for a body, or -1 when it is not in the program
+    int enter_function(Expr *body);
+    void exit_function(int id);
+    long hottest_call();
+    
+    void write(std::ostream &out);
+    // Reads a profile written for the same program, throwing when it
+    // belongs to a different one
+    static PTR(Profile) read(std::istream &in, PTR(Expr) program);
+    
+private:
+    std::unordered_map<Expr*, int> ids;
+    std::unordered_map<Expr*, int> fun_bodies;
+    std::vector<int> fun_depth;
+    std::vector<double> fun_start;
+    
+    void number(PTR(Expr) e);
+};
+
+// Uses a profile to inline hot call sites of small closed functions and
+// to test the hotter case first in `_if v == a _then .. _else _if v == b`
+// chains. It must see the tree exactly as it was parsed, so it runs as a
+// setup pass before any other optimization
+class ProfilePass : public Pass {
+public:
+    PTR(Profile) profile;
+    double hot_fraction;
+    long max_inline_size;
+    
+    ProfilePass(PTR(Profile) profile);
+    std::string name();
+    PTR(Expr) run(PTR(Expr) e);
+    
+private:
+    int next_id;
+    bool is_hot(int id);
+    PTR(Expr) visit(PTR(Expr) e, std::unordered_map<Symbol, PTR(Expr)> funs);
+};
+
+#endif /* profile_hpp */
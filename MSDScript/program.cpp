@@ -0,0 +1,178 @@
+#include <exception>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include "program.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+#include "env.hpp"
+#include "gc.hpp"
+#include "jit.hpp"
+#include "lift.hpp"
+#include "escape.hpp"
+#include "pass.hpp"
+#include "profile.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+
+// Whether evaluating `e` can call a function, which is what makes an
+// operand worth handing to another thread
+static bool makes_calls(PTR(Expr) e, std::unordered_map<Expr*, bool> &memo) {
+    auto found = memo.find(&*e);
+    if (found != memo.end())
+        return found->second;
+    bool calls = (CAST(CallExpr)(e) != nullptr || CAST(FoldExpr)(e) != nullptr);
+    // A _fun's body only runs once it is called
+    if (CAST(FunExpr)(e) == nullptr) {
+        for (PTR(Expr) kid : expr_children(e))
+            calls = makes_calls(kid, memo) || calls;
+    }
+    memo[&*e] = calls;
+    return calls;
+}
+
+// Adds an object to be marked IMMORTAL once the walk is done
+template <typename T>
+void Program::freeze(PTR(T) const &p) {
+#if MSD_PTR_MODE == MSD_PTR_COUNTED
+    if (p != nullptr)
+        frozen.push_back(std::make_pair(&*p, 0L));
+#endif
+}
+
+Program::Program(PTR(Expr) e) {
+    if (GC::enabled)
+        throw std::runtime_error("a shared program cannot use the collector");
+    if (Profile::current != nullptr)
+        throw std::runtime_error("a shared program cannot be profiled");
+    expr = escape_analysis(lift(e));
+    // The counts saved below should only hold the tree's own references
+    // and the caller's
+    e = nullptr;
+    
+    {
+        std::unordered_set<Expr*> seen;
+        std::unordered_map<Expr*, bool> calls;
+        std::vector<PTR(Expr)> todo = { expr };
+        while (!todo.empty()) {
+            PTR(Expr) node = todo.back();
+            todo.pop_back();
+            if (!seen.insert(&*node).second)
+                continue;
+            if (PTR(AddExpr) a = CAST(AddExpr)(node)) {
+                a->quick.share(a->lhs, a->rhs);
+                a->fork = makes_calls(a->lhs, calls) && makes_calls(a->rhs, calls);
+            } else if (PTR(MultExpr) m = CAST(MultExpr)(node)) {
+                m->quick.share(m->lhs, m->rhs);
+                m->fork = makes_calls(m->lhs, calls) && makes_calls(m->rhs, calls);
+            } else if (PTR(EqualExpr) q = CAST(EqualExpr)(node)) {
+                q->quick.share(q->lhs, q->rhs);
+                q->fork = makes_calls(q->lhs, calls) && makes_calls(q->rhs, calls);
+            } else if (PTR(NumExpr) n = CAST(NumExpr)(node)) {
+                freeze(n->val);
+            } else if (PTR(FunExpr) f = CAST(FunExpr)(node)) {
+                freeze(f->lifted);
+                if (JitEntry::enabled && f->jit == nullptr)
+                    f->jit = NEW(JitEntry)(f->formal_arg, f->body);
+                if (f->jit != nullptr) {
+                    f->jit->prepare();
+                    freeze(f->jit);
+                }
+            }
+            for (PTR(Expr) kid : expr_children(node))
+                todo.push_back(kid);
+            freeze(node);
+        }
+    }
+#if MSD_PTR_MODE == MSD_PTR_COUNTED
+    // Counts are only read now that the walk holds no pointers
+    for (auto &entry : frozen) {
+        entry.second = entry.first->msd_refs;
+        entry.first->msd_refs = msd::RefCounted::immortal_refs;
+    }
+#endif
+}
+
+Program::~Program() {
+#if MSD_PTR_MODE == MSD_PTR_COUNTED
+    // Backwards, so an object frozen twice ends with its first count
+    for (auto entry = frozen.rbegin(); entry != frozen.rend(); ++entry)
+        entry->first->msd_refs = entry->second;
+#endif
+}
+
+PTR(Val) Program::run() {
+    return expr->interp(Env::empty);
+}
+
+std::vector<PTR(Val)> Program::run_on_threads(int threads) {
+    std::vector<PTR(Val)> results(threads);
+    std::vector<std::exception_ptr> errors(threads);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back([this, i, &results, &errors]() {
+            try {
+                results[i] = run();
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+    for (std::thread &worker : workers)
+        worker.join();
+    for (std::exception_ptr &error : errors) {
+        if (error)
+            std::rethrow_exception(error);
+    }
+    return results;
+}
+
+TEST_CASE( "Program" ) {
+    std::string fib = "_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1 _else fib(fib)(x + -1) + fib(fib)(x + -2) _in fib(fib)(15)";
+    SECTION( "Same result as interp" ) {
+        Program program(parse_str(fib));
+        CHECK( program.run()->equals(NEW(NumVal)(987)) );
+        CHECK( program.run()->equals(NEW(NumVal)(987)) );
+        Program closure(parse_str("_let y = 2 _in _fun (x) x + y"));
+        CHECK( closure.run()->to_string() == "_fun (x) (x + y)" );
+    }
+#if MSD_PTR_MODE == MSD_PTR_COUNTED
+    SECTION( "Runs leave the tree's counts alone" ) {
+        const long immortal = msd::RefCounted::immortal_refs;
+        Program program(parse_str(fib));
+        program.run();
+        PTR(LetExpr) let = CAST(LetExpr)(program.expr);
+        REQUIRE( let != nullptr );
+        CHECK( let->msd_refs == immortal );
+        CHECK( let->rhs->msd_refs == immortal );
+        CHECK( CAST(FunExpr)(let->rhs)->lifted->msd_refs == immortal );
+    }
+    SECTION( "Counts come back" ) {
+        PTR(Expr) e = parse_str("1 + 2 * 3");
+        long before = e->msd_refs;
+        {
+            Program program(e);
+            CHECK( program.expr == e );
+            CHECK( program.run()->equals(NEW(NumVal)(7)) );
+        }
+        CHECK( e->msd_refs == before );
+    }
+#endif
+    SECTION( "Many threads" ) {
+        Program program(parse_str(fib));
+        for (PTR(Val) result : program.run_on_threads(8))
+            CHECK( result->equals(NEW(NumVal)(987)) );
+        // Deep enough that every thread hands calls to its own step machine
+        Program count(parse_str("_let count = _fun (count) _fun (n) _if n == 0 _then 0 _else 1 + count(count)(n + -1) _in count(count)(3000)"));
+        for (PTR(Val) result : count.run_on_threads(4))
+            CHECK( result->equals(NEW(NumVal)(3000)) );
+    }
+    SECTION( "Errors" ) {
+        Program program(parse_str("_let f = _fun (x) _true + x _in f(1)"));
+        CHECK_THROWS_WITH( program.run_on_threads(4), "no adding booleans" );
+        Program same(parse_str("_let f = _fun (x) x + 1 _in f(1) + f(_true)"));
+        CHECK_THROWS_WITH( same.run(), "no adding booleans" );
+    }
+}
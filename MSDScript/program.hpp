@@ -0,0 +1,48 @@
+#ifndef program_hpp
+#define program_hpp
+
+#include <utility>
+#include <vector>
+#include "macros.hpp"
+
+class Expr;
+class Val;
+
+/* A program that any number of threads can run at once. Making one
+ lifts and escape-analyzes the tree, then fills in everything interp()
+ would otherwise fill in on the way (every +, * and == site is
+ specialized and every _fun gets its JIT code), marks the +, * and ==
+ sites whose operands both make calls as worth forking for Parallel, and
+ marks each node, the numbers they hold and the lifted closures
+ IMMORTAL. From then on a run only reads the tree: copying a pointer to
+ a node counts nothing, and all the Vals, Envs and continuations a run
+ makes are its own, so threads share no memory that is written. The
+ tree belongs to the Program until it is destroyed, which puts the
+ counts back, so nothing a run returns may outlive it. Needs the
+ collector and profiling off. */
+class Program ENABLE_THIS(Program) {
+public:
+    PTR(Expr) expr;
+    
+    Program(PTR(Expr) e);
+    ~Program();
+    Program(const Program &) = delete;
+    Program &operator=(const Program &) = delete;
+    
+    // Safe to call from several threads at once
+    PTR(Val) run();
+    // Runs the program once on each of `threads` threads and returns
+    // every result, or throws the first error
+    std::vector<PTR(Val)> run_on_threads(int threads);
+    
+private:
+#if MSD_PTR_MODE == MSD_PTR_COUNTED
+    // Every object marked IMMORTAL, with its count from before
+    std::vector<std::pair<msd::RefCounted*, long>> frozen;
+#endif
+    
+    template <typename T>
+    void freeze(PTR(T) const &p);
+};
+
+#endif /* program_hpp */
@@ -0,0 +1,273 @@
+#include <algorithm>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include "scheduler.hpp"
+#include "checkpoint.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+#include "env.hpp"
+#include "parse.hpp"
+#include "catch.hpp"
+
+Scheduler::Scheduler(long quantum) {
+    if (quantum < 1)
+        throw std::runtime_error("quantum must be at least 1");
+    this->quantum = quantum;
+    this->aging = 16;
+    this->next_id = 1;
+    this->waiting_tasks = 0;
+    this->slice_count = 0;
+}
+
+long Scheduler::add(PTR(Expr) e, int priority, long max_steps) {
+    return add(e, Env::empty, priority, max_steps);
+}
+
+long Scheduler::add(PTR(Expr) e, PTR(Env) env, int priority, long max_steps) {
+    Step::Registers regs;
+    Step::start(regs, e, env);
+    return add(e, regs, priority, max_steps);
+}
+
+long Scheduler::resume(PTR(Expr) program, const std::string &saved, int priority, long max_steps) {
+    Step::Registers regs;
+    Checkpoint::load(program, saved, regs);
+    return add(program, regs, priority, max_steps);
+}
+
+long Scheduler::add(PTR(Expr) e, Step::Registers &regs, int priority, long max_steps) {
+    long id = next_id++;
+    Task &task = tasks[id];
+    task.expr = e;
+    std::swap(task.regs, regs);
+    task.priority = priority;
+    task.max_steps = max_steps;
+    task.steps = 0;
+    task.status = waiting;
+    queues[priority].ids.push_back(id);
+    waiting_tasks++;
+    return id;
+}
+
+bool Scheduler::run_slice() {
+    while (!queues.empty()) {
+        // The highest priority, unless a lower one has waited too long
+        auto level = std::prev(queues.end());
+        for (auto starved = queues.begin(); starved != level; starved++) {
+            if (starved->second.passed >= aging) {
+                level = starved;
+                break;
+            }
+        }
+        long id = level->second.ids.front();
+        level->second.ids.pop_front();
+        auto found = tasks.find(id);
+        if (found == tasks.end()) {
+            if (level->second.ids.empty())
+                queues.erase(level);
+            continue;
+        }
+        for (auto &other : queues)
+            other.second.passed++;
+        level->second.passed = 0;
+        if (level->second.ids.empty())
+            queues.erase(level);
+
+        Task &task = found->second;
+        long budget = quantum;
+        if (task.max_steps >= 0)
+            budget = std::min(budget, task.max_steps - task.steps);
+        slice_count++;
+        try {
+            task.steps += Step::resume(task.regs, budget);
+        } catch (...) {
+            fail(task, std::current_exception());
+            return true;
+        }
+        if (Step::done(task.regs)) {
+            task.status = finished;
+            waiting_tasks--;
+            // Only the value is needed now
+            task.expr = nullptr;
+            task.regs.expr = nullptr;
+            task.regs.env = nullptr;
+            task.regs.cont = nullptr;
+        } else if (task.max_steps >= 0 && task.steps >= task.max_steps) {
+            fail(task, std::make_exception_ptr(std::runtime_error("out of fuel")));
+        } else {
+            queues[task.priority].ids.push_back(id);
+        }
+        return true;
+    }
+    return false;
+}
+
+void Scheduler::run() {
+    while (run_slice())
+        ;
+}
+
+void Scheduler::fail(Task &task, std::exception_ptr error) {
+    task.status = failed;
+    task.error = error;
+    waiting_tasks--;
+    task.expr = nullptr;
+    task.regs.expr = nullptr;
+    task.regs.env = nullptr;
+    task.regs.val = nullptr;
+    task.regs.cont = nullptr;
+}
+
+Scheduler::Task &Scheduler::find(long id) {
+    auto found = tasks.find(id);
+    if (found == tasks.end())
+        throw std::runtime_error("no such task");
+    return found->second;
+}
+
+Scheduler::status_t Scheduler::status(long id) {
+    return find(id).status;
+}
+
+long Scheduler::steps(long id) {
+    return find(id).steps;
+}
+
+PTR(Val) Scheduler::take(long id) {
+    Task &task = find(id);
+    if (task.status == waiting)
+        throw std::runtime_error("task not finished");
+    std::exception_ptr error = task.error;
+    PTR(Val) val = task.regs.val;
+    tasks.erase(id);
+    if (error)
+        std::rethrow_exception(error);
+    return val;
+}
+
+void Scheduler::cancel(long id) {
+    if (find(id).status == waiting)
+        waiting_tasks--;
+    tasks.erase(id);
+}
+
+std::string Scheduler::checkpoint(long id) {
+    Task &task = find(id);
+    if (task.status != waiting)
+        throw std::runtime_error("task not waiting");
+    return Checkpoint::save(task.expr, task.regs);
+}
+
+long Scheduler::waiting_count() {
+    return waiting_tasks;
+}
+
+long Scheduler::slices() {
+    return slice_count;
+}
+
+TEST_CASE( "Scheduler" ) {
+    std::string count = "_let count = _fun (count) _fun (n) _if n == 0 _then 0 _else 1 + count(count)(n + -1) _in count(count)";
+    std::string loop = "_let loop = _fun (loop) _fun (n) loop(loop)(n + 1) _in loop(loop)(0)";
+    SECTION( "Same values as running to the end" ) {
+        Scheduler scheduler(7);
+        std::string programs[] = {
+            "1 + 2",
+            "_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1 _else fib(fib)(x + -1) + fib(fib)(x + -2) _in fib(fib)(10)",
+            "_fun (x) x * 2",
+            "_if 1 == 2 _then _true _else _false",
+            "_fold(_fun (a) _fun (i) a + i, 0, 0, 10)",
+            "_await _spawn 3 * 4"
+        };
+        std::vector<long> ids;
+        for (std::string &program : programs)
+            ids.push_back(scheduler.add(parse_str(program)));
+        scheduler.run();
+        CHECK( scheduler.waiting_count() == 0 );
+        for (size_t i = 0; i < ids.size(); i++) {
+            CHECK( scheduler.status(ids[i]) == Scheduler::finished );
+            CHECK( scheduler.take(ids[i])->equals(Step::interp_by_steps(parse_str(programs[i]))) );
+        }
+        CHECK_THROWS_WITH( scheduler.take(ids[0]), "no such task" );
+    }
+    SECTION( "Taking turns" ) {
+        Scheduler scheduler(100);
+        long a = scheduler.add(parse_str(count + "(2000)"));
+        long b = scheduler.add(parse_str(count + "(2000)"));
+        for (int i = 0; i < 10; i++)
+            scheduler.run_slice();
+        CHECK( scheduler.steps(a) == 500 );
+        CHECK( scheduler.steps(b) == 500 );
+        CHECK_THROWS_WITH( scheduler.take(a), "task not finished" );
+        scheduler.run();
+        CHECK( scheduler.take(a)->equals(NEW(NumVal)(2000)) );
+        CHECK( scheduler.take(b)->equals(NEW(NumVal)(2000)) );
+    }
+    SECTION( "Priorities" ) {
+        Scheduler scheduler(50);
+        long low = scheduler.add(parse_str(count + "(100)"), 0);
+        long high = scheduler.add(parse_str(count + "(100)"), 1);
+        while (scheduler.status(high) == Scheduler::waiting)
+            scheduler.run_slice();
+        CHECK( scheduler.status(low) == Scheduler::waiting );
+        CHECK( scheduler.steps(low) <= scheduler.steps(high) / scheduler.aging );
+        scheduler.run();
+        CHECK( scheduler.take(low)->equals(NEW(NumVal)(100)) );
+    }
+    SECTION( "Aging" ) {
+        Scheduler scheduler(50);
+        long forever = scheduler.add(parse_str(loop), 1);
+        long low = scheduler.add(parse_str(count + "(100)"), 0);
+        long slices = 0;
+        while (scheduler.status(low) == Scheduler::waiting) {
+            scheduler.run_slice();
+            REQUIRE( ++slices < 10000 );
+        }
+        // The lower priority gets one turn in every aging + 1
+        long low_turns = (scheduler.steps(low) + 49) / 50;
+        CHECK( slices == low_turns * (scheduler.aging + 1) );
+        CHECK( scheduler.steps(forever) == low_turns * scheduler.aging * 50 );
+        CHECK( scheduler.take(low)->equals(NEW(NumVal)(100)) );
+        scheduler.cancel(forever);
+    }
+    SECTION( "Scripts that never end" ) {
+        Scheduler scheduler(1000);
+        long forever = scheduler.add(parse_str(loop));
+        long budget = scheduler.add(parse_str(loop), 0, 2500);
+        long quick = scheduler.add(parse_str(count + "(20)"));
+        for (int i = 0; i < 3; i++)
+            scheduler.run_slice();
+        CHECK( scheduler.take(quick)->equals(NEW(NumVal)(20)) );
+        for (int i = 0; i < 4; i++)
+            scheduler.run_slice();
+        CHECK( scheduler.status(budget) == Scheduler::failed );
+        CHECK( scheduler.steps(budget) == 2500 );
+        CHECK_THROWS_WITH( scheduler.take(budget), "out of fuel" );
+        CHECK( scheduler.waiting_count() == 1 );
+        scheduler.cancel(forever);
+        CHECK( scheduler.waiting_count() == 0 );
+        CHECK( ! scheduler.run_slice() );
+    }
+    SECTION( "Errors" ) {
+        Scheduler scheduler(3);
+        long bad = scheduler.add(parse_str("_let x = 1 _in (x + 2) + _true"));
+        long good = scheduler.add(parse_str("_let x = 1 _in (x + 2) + 3"));
+        scheduler.run();
+        CHECK( scheduler.status(bad) == Scheduler::failed );
+        CHECK_THROWS_WITH( scheduler.take(bad), "not a number" );
+        CHECK( scheduler.take(good)->equals(NEW(NumVal)(6)) );
+        CHECK_THROWS_WITH( Scheduler(0), "quantum must be at least 1" );
+    }
+    SECTION( "Many tasks" ) {
+        Scheduler scheduler(20);
+        PTR(Expr) e = parse_str(count + "(30)");
+        std::vector<long> ids;
+        for (int i = 0; i < 2000; i++)
+            ids.push_back(scheduler.add(e, i % 3, -1));
+        scheduler.run();
+        for (long id : ids)
+            CHECK( scheduler.take(id)->equals(NEW(NumVal)(30)) );
+    }
+}
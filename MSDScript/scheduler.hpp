@@ -0,0 +1,98 @@
+#ifndef scheduler_hpp
+#define scheduler_hpp
+
+#include <deque>
+#include <exception>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include "macros.hpp"
+#include "step.hpp"
+
+class Expr;
+class Env;
+class Val;
+
+/* Runs many step machine evaluations on one thread, taking turns. Each
+ task is a paused set of registers. run_slice() resumes the next one for
+ `quantum` steps and, unless it finished, puts it at the back of the
+ queue for its priority. Higher priorities go first and equal ones take
+ turns, but a priority passed over `aging` times in a row gets the next
+ turn, so a task that never ends slows down lower priorities instead of
+ stopping them. A task given a step budget fails with "out of fuel" once it
+ has used it. One step can still take long when it waits on an _await,
+ or runs a _fold that does not call its function; one that does makes
+ each call its own steps. Not thread safe; each thread running tasks
+ needs its own Scheduler. */
+class Scheduler {
+public:
+    typedef enum {
+        waiting,
+        finished,
+        failed
+    } status_t;
+
+    // Steps a task runs before the next one gets a turn
+    long quantum;
+    // Turns a priority with waiting tasks can be passed over before it
+    // gets one
+    long aging;
+
+    Scheduler(long quantum);
+    // Returns the new task's id. A negative `max_steps` lets it run for
+    // as long as it needs
+    long add(PTR(Expr) e, int priority = 0, long max_steps = -1);
+    long add(PTR(Expr) e, PTR(Env) env, int priority, long max_steps);
+    // Gives the next task its turn. False when no task is waiting
+    bool run_slice();
+    // Takes turns until every task has finished or failed
+    void run();
+
+    status_t status(long id);
+    long steps(long id);
+    // Returns a finished task's value, or rethrows what a failed one
+    // threw, and forgets the task
+    PTR(Val) take(long id);
+    // Forgets a task, whether or not it has finished
+    void cancel(long id);
+    // Saves a waiting task with Checkpoint, for resume() to pick up in
+    // this Scheduler or another one, maybe in another process
+    std::string checkpoint(long id);
+    // Adds a task that continues from checkpoint() bytes, which must have
+    // been saved from the same program
+    long resume(PTR(Expr) program, const std::string &saved, int priority = 0, long max_steps = -1);
+
+    long waiting_count();
+    long slices();
+
+private:
+    struct Task {
+        // Owns the tree, since the registers only point into it
+        PTR(Expr) expr;
+        Step::Registers regs;
+        int priority;
+        long max_steps;
+        long steps;
+        status_t status;
+        std::exception_ptr error;
+    };
+
+    long next_id;
+    long waiting_tasks;
+    long slice_count;
+    std::unordered_map<long, Task> tasks;
+    struct Level {
+        // A cancelled task's id is skipped when reached
+        std::deque<long> ids;
+        // Turns since this priority last had one
+        long passed = 0;
+    };
+
+    std::map<int, Level> queues;
+
+    long add(PTR(Expr) e, Step::Registers &regs, int priority, long max_steps);
+    Task &find(long id);
+    void fail(Task &task, std::exception_ptr error);
+};
+
+#endif /* scheduler_hpp */
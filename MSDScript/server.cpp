@@ -0,0 +1,462 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "server.hpp"
+#include "program.hpp"
+#include "expr.hpp"
+#include "value.hpp"
+#include "env.hpp"
+#include "parse.hpp"
+#include "pass.hpp"
+#include "step.hpp"
+#include "catch.hpp"
+
+namespace {
+    // FNV-1a, 64 bits wide
+    unsigned long content_hash(const std::string &source) {
+        unsigned long hash = 14695981039346656037UL;
+        for (char c : source) {
+            hash ^= (unsigned char)c;
+            hash *= 1099511628211UL;
+        }
+        return hash;
+    }
+
+    long micros_since(std::chrono::steady_clock::time_point start) {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    }
+
+    // Reads and writes a socket. Writes are not buffered, and a closed
+    // socket fails the stream instead of raising SIGPIPE
+    class SocketBuf : public std::streambuf {
+    public:
+        SocketBuf(int fd) : fd(fd) { }
+
+    protected:
+        int underflow() override {
+            ssize_t n;
+            do {
+                n = ::recv(fd, buffer, sizeof(buffer), 0);
+            } while (n < 0 && errno == EINTR);
+            if (n <= 0)
+                return traits_type::eof();
+            setg(buffer, buffer, buffer + n);
+            return (unsigned char)*gptr();
+        }
+
+        std::streamsize xsputn(const char *s, std::streamsize count) override {
+            std::streamsize sent = 0;
+            while (sent < count) {
+                ssize_t n = ::send(fd, s + sent, count - sent, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    break;
+                sent += n;
+            }
+            return sent;
+        }
+
+        int overflow(int c) override {
+            if (c == traits_type::eof())
+                return 0;
+            char ch = (char)c;
+            return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
+        }
+
+    private:
+        int fd;
+        char buffer[4096];
+    };
+}
+
+long Server::max_request = 16L * 1024 * 1024;
+long Server::max_steps = 100000000;
+
+Server::Server(int workers, size_t cache_size) {
+    if (cache_size < 1)
+        throw std::runtime_error("cache size must be at least 1");
+    this->cache_size = cache_size;
+    this->hits = 0;
+    this->misses = 0;
+    this->stopping = false;
+    this->open_connections = 0;
+    if (workers <= 0)
+        workers = std::max(1, (int)std::thread::hardware_concurrency());
+    for (int i = 0; i < workers; i++)
+        pool.emplace_back([this]() { work(); });
+}
+
+Server::~Server() {
+    {
+        std::lock_guard<std::mutex> hold(pool_lock);
+        stopping = true;
+    }
+    pool_ready.notify_all();
+    for (std::thread &worker : pool)
+        worker.join();
+}
+
+void Server::work() {
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> hold(pool_lock);
+            pool_ready.wait(hold, [this] { return stopping || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        job();
+    }
+}
+
+// Returns the cached program for `source` and marks it used, or null
+std::shared_ptr<Program> Server::find(unsigned long key, const std::string &source) {
+    std::lock_guard<std::mutex> hold(cache_lock);
+    auto found = cache.find(key);
+    if (found == cache.end() || found->second.source != source)
+        return nullptr;
+    recent.splice(recent.begin(), recent, found->second.place);
+    hits++;
+    return found->second.program;
+}
+
+std::shared_ptr<Program> Server::prepare(const std::string &source, bool &cached) {
+    unsigned long key = content_hash(source);
+    cached = true;
+    std::shared_ptr<Program> program = find(key, source);
+    if (program != nullptr)
+        return program;
+    std::lock_guard<std::mutex> building(prepare_lock);
+    // Another request may have made it while this one waited
+    program = find(key, source);
+    if (program != nullptr)
+        return program;
+
+    cached = false;
+    program = std::make_shared<Program>(PassManager::for_level(2)->run(parse_str(source)));
+    std::lock_guard<std::mutex> hold(cache_lock);
+    misses++;
+    auto found = cache.find(key);
+    if (found != cache.end()) {
+        // Same hash, different source: the newer one takes the place
+        recent.erase(found->second.place);
+        cache.erase(found);
+    }
+    recent.push_front(key);
+    cache[key] = Entry { source, program, recent.begin() };
+    if (cache.size() > cache_size) {
+        // Requests running the dropped program still hold it
+        cache.erase(recent.back());
+        recent.pop_back();
+    }
+    return program;
+}
+
+Server::Result Server::run(const std::string &source, const std::vector<std::string> &args) {
+    Result result;
+    result.ok = false;
+    result.cached = false;
+    result.run_us = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::shared_ptr<Program> program;
+    try {
+        program = prepare(source, result.cached);
+    } catch (std::exception &err) {
+        result.prepare_us = micros_since(start);
+        result.text = err.what();
+        return result;
+    }
+    result.prepare_us = micros_since(start);
+
+    start = std::chrono::steady_clock::now();
+    try {
+        // The arguments' calls are steps of the request too
+        PTR(Expr) request = program->expr;
+        for (const std::string &arg : args)
+            request = NEW(CallExpr)(request, parse_str(arg));
+        // Gone before `program`, since values can point into its tree
+        PTR(Val) value = Step::interp_by_steps(request, Env::empty, max_steps);
+        result.text = value->to_string();
+        result.ok = true;
+    } catch (std::exception &err) {
+        result.text = err.what();
+    }
+    result.run_us = micros_since(start);
+    return result;
+}
+
+void Server::submit(const std::string &source, const std::vector<std::string> &args,
+                    std::function<void(const Result &)> done) {
+    {
+        std::lock_guard<std::mutex> hold(pool_lock);
+        jobs.push_back([this, source, args, done]() {
+            done(run(source, args));
+        });
+    }
+    pool_ready.notify_one();
+}
+
+void Server::serve(std::istream &in, std::ostream &out) {
+    std::mutex out_lock;
+    std::condition_variable answered;
+    long pending = 0;
+    long number = 0;
+    std::string header;
+    while (std::getline(in, header)) {
+        number++;
+        std::istringstream fields(header);
+        long length = -1, count = -1;
+        std::string extra;
+        bool framed = (fields >> length >> count) && length >= 0 && length <= max_request
+            && count >= 0 && !(fields >> extra);
+        std::string source;
+        std::vector<std::string> args;
+        if (framed) {
+            source.resize(length);
+            framed = in.read(&source[0], length) && in.get() == '\n';
+        }
+        for (long i = 0; framed && i < count; i++) {
+            std::string arg;
+            framed = (bool)std::getline(in, arg);
+            args.push_back(arg);
+        }
+        if (!framed) {
+            // There is no telling where the next request would start
+            std::lock_guard<std::mutex> hold(out_lock);
+            out << number << " error miss 0 0 badly framed request" << std::endl;
+            break;
+        }
+
+        {
+            std::lock_guard<std::mutex> hold(out_lock);
+            pending++;
+        }
+        submit(source, args, [&, number](const Result &result) {
+            std::ostringstream line;
+            line << number << (result.ok ? " ok " : " error ") << (result.cached ? "hit " : "miss ")
+                 << result.prepare_us << " " << result.run_us << " " << result.text << "\n";
+            std::lock_guard<std::mutex> hold(out_lock);
+            out << line.str() << std::flush;
+            pending--;
+            answered.notify_all();
+        });
+    }
+    std::unique_lock<std::mutex> hold(out_lock);
+    answered.wait(hold, [&] { return pending == 0; });
+}
+
+void Server::listen(const std::string &path, long max_connections) {
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+        throw std::runtime_error("socket path too long");
+    strcpy(address.sun_path, path.c_str());
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+        throw std::runtime_error("cannot make a socket");
+    unlink(path.c_str());
+    if (bind(listener, (sockaddr *)&address, sizeof(address)) < 0 || ::listen(listener, 64) < 0) {
+        close(listener);
+        throw std::runtime_error("cannot listen on " + path);
+    }
+
+    for (long served = 0; max_connections < 0 || served < max_connections; ) {
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            close(listener);
+            throw std::runtime_error("cannot accept a connection");
+        }
+        served++;
+        {
+            std::lock_guard<std::mutex> hold(connection_lock);
+            open_connections++;
+        }
+        std::thread([this, connection]() {
+            try {
+                SocketBuf buffer(connection);
+                std::istream in(&buffer);
+                std::ostream out(&buffer);
+                serve(in, out);
+            } catch (std::exception &) {
+                // Only this connection is lost
+            }
+            close(connection);
+            std::lock_guard<std::mutex> hold(connection_lock);
+            open_connections--;
+            connection_closed.notify_all();
+        }).detach();
+    }
+    close(listener);
+    unlink(path.c_str());
+    std::unique_lock<std::mutex> hold(connection_lock);
+    connection_closed.wait(hold, [this] { return open_connections == 0; });
+}
+
+long Server::cache_hits() {
+    std::lock_guard<std::mutex> hold(cache_lock);
+    return hits;
+}
+
+long Server::cache_misses() {
+    std::lock_guard<std::mutex> hold(cache_lock);
+    return misses;
+}
+
+TEST_CASE( "Server" ) {
+    std::string count = "_let count = _fun (count) _fun (n) _if n == 0 _then 0 _else 1 + count(count)(n + -1) _in count(count)";
+    SECTION( "Running programs" ) {
+        Server server(2);
+        Server::Result first = server.run("1 + 2", {});
+        CHECK( first.ok );
+        CHECK( ! first.cached );
+        CHECK( first.text == "3" );
+        Server::Result again = server.run("1 + 2", {});
+        CHECK( again.cached );
+        CHECK( again.text == "3" );
+        CHECK( server.run("_fun (x) _fun (y) x * y", { "6", "7" }).text == "42" );
+        CHECK( server.run(count, { "2000" }).text == "2000" );
+        CHECK( server.run(count, { "5 + 5" }).text == "10" );
+        CHECK( server.run("_fun (f) f(3)", { "_fun (x) x * x" }).text == "9" );
+        CHECK( server.cache_hits() == 2 );
+        CHECK( server.cache_misses() == 4 );
+    }
+    SECTION( "Errors" ) {
+        Server server(1);
+        Server::Result bad = server.run("1 +", {});
+        CHECK( ! bad.ok );
+        CHECK( ! bad.cached );
+        CHECK( server.run("_true + 1", {}).text == "no adding booleans" );
+        CHECK( server.run("1", { "2" }).text == "cannot call on a number" );
+        CHECK( ! server.run("_fun (x) x", { "_let" }).ok );
+        CHECK( server.cache_misses() == 3 );
+        CHECK_THROWS_WITH( Server(1, 0), "cache size must be at least 1" );
+    }
+    SECTION( "Fuel" ) {
+        Server server(1);
+        long saved = Server::max_steps;
+        Server::max_steps = 100000;
+        std::string loop = "_let loop = _fun (loop) _fun (n) loop(loop)(n + 1) _in loop(loop)";
+        Server::Result endless = server.run(loop, { "0" });
+        CHECK( ! endless.ok );
+        CHECK( endless.text == "out of fuel" );
+        CHECK( server.run(count, { "1000" }).text == "1000" );
+        // The next request gets its own fuel
+        CHECK( server.run("_fun (x) x * 2", { "21" }).text == "42" );
+        Server::max_steps = saved;
+    }
+    SECTION( "Programs are optimized" ) {
+        Server server(1);
+        long saved = Server::max_steps;
+        Server::max_steps = 1000;
+        // Folded to a number before it is cached, so running it is cheap
+        std::string program = "_let n = " + count + "(500) _in _fun (x) x + n";
+        CHECK( server.run(program, { "1" }).text == "501" );
+        CHECK( server.run(program, { "2" }).text == "502" );
+        Server::max_steps = saved;
+    }
+    SECTION( "Least recently used programs are dropped" ) {
+        Server server(1, 2);
+        server.run("1", {});
+        server.run("2", {});
+        CHECK( server.run("1", {}).cached );
+        server.run("3", {});
+        CHECK( server.run("1", {}).cached );
+        CHECK( ! server.run("2", {}).cached );
+    }
+    SECTION( "Many requests at once" ) {
+        Server server(4);
+        std::mutex lock;
+        std::condition_variable finished;
+        std::vector<std::string> answers;
+        for (int i = 0; i < 200; i++) {
+            server.submit(count, { std::to_string(i) }, [&](const Server::Result &result) {
+                std::lock_guard<std::mutex> hold(lock);
+                answers.push_back(result.text);
+                finished.notify_all();
+            });
+        }
+        std::unique_lock<std::mutex> hold(lock);
+        finished.wait(hold, [&] { return answers.size() == 200; });
+        std::sort(answers.begin(), answers.end(), [](const std::string &a, const std::string &b) {
+            return std::stoi(a) < std::stoi(b);
+        });
+        for (int i = 0; i < 200; i++)
+            CHECK( answers[i] == std::to_string(i) );
+        CHECK( server.cache_misses() == 1 );
+    }
+    SECTION( "Framing" ) {
+        Server server(2);
+        std::istringstream in("14 1\n_fun (x) x + 1\n41\n5 0\n1 + 2\n14 1\n_fun (x) x + 1\n1\n3 0\n_fa\n");
+        std::ostringstream out;
+        server.serve(in, out);
+        std::istringstream lines(out.str());
+        std::vector<std::string> answers(4);
+        std::string line;
+        while (std::getline(lines, line)) {
+            int number = std::stoi(line);
+            REQUIRE( number >= 1 );
+            REQUIRE( number <= 4 );
+            answers[number - 1] = line;
+        }
+        CHECK( answers[0].find("1 ok ") == 0 );
+        CHECK( answers[0].substr(answers[0].size() - 3) == " 42" );
+        CHECK( answers[1].substr(answers[1].size() - 2) == " 3" );
+        CHECK( answers[2].substr(answers[2].size() - 2) == " 2" );
+        CHECK( answers[3].find("4 error miss ") == 0 );
+
+        std::istringstream short_program("10 0\n1 + 2\n");
+        std::ostringstream short_out;
+        server.serve(short_program, short_out);
+        CHECK( short_out.str() == "1 error miss 0 0 badly framed request\n" );
+        std::istringstream bad_header("5\n1 + 2\n");
+        std::ostringstream bad_out;
+        server.serve(bad_header, bad_out);
+        CHECK( bad_out.str() == "1 error miss 0 0 badly framed request\n" );
+        std::istringstream huge("100000000000000 0\n1\n");
+        std::ostringstream huge_out;
+        server.serve(huge, huge_out);
+        CHECK( huge_out.str() == "1 error miss 0 0 badly framed request\n" );
+    }
+    SECTION( "Unix domain sockets" ) {
+        Server server(2);
+        std::string path = "/tmp/msdscript_test_" + std::to_string(getpid()) + ".sock";
+        std::thread listening([&]() { server.listen(path, 1); });
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strcpy(address.sun_path, path.c_str());
+        int client = socket(AF_UNIX, SOCK_STREAM, 0);
+        REQUIRE( client >= 0 );
+        // The listener may not be bound yet
+        for (int tries = 0; connect(client, (sockaddr *)&address, sizeof(address)) < 0; tries++) {
+            REQUIRE( tries < 1000 );
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        std::string request = "10 1\n_fun (x) x\n_true\n";
+        REQUIRE( send(client, request.data(), request.size(), 0) == (ssize_t)request.size() );
+        shutdown(client, SHUT_WR);
+        std::string reply;
+        char buffer[256];
+        ssize_t n;
+        while ((n = recv(client, buffer, sizeof(buffer), 0)) > 0)
+            reply.append(buffer, n);
+        close(client);
+        listening.join();
+        CHECK( reply.find("1 ok miss ") == 0 );
+        CHECK( reply.substr(reply.size() - 7) == " _true\n" );
+        CHECK( access(path.c_str(), F_OK) != 0 );
+    }
+}
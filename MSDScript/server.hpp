@@ -0,0 +1,119 @@
+#ifndef server_hpp
+#define server_hpp
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "macros.hpp"
+
+class Program;
+
+/* Runs requests for `--serve`, so a script run many times pays for
+ parsing and optimizing it once. A request is a program's source and
+ arguments, each an expression the program's value is called with in
+ turn. Programs are optimized as -O2 would, then kept as Programs in a cache keyed by a hash of their
+ source, with the least recently used one dropped once there are
+ `cache_size`, and requests run on a pool of `workers` threads. A request
+ for a cached program only evaluates it, on the step machine and for at
+ most `max_steps` steps, so one that never ends is answered with "out
+ of fuel" instead of holding its worker. Steps taken by a _spawn's body
+ on the future pool are not counted. Every result says whether the
+ program was cached and how long preparing and running took.
+ Needs the collector and profiling off, as Program does.
+
+ serve() and listen() take requests framed as a line holding the
+ program's length in bytes and the number of arguments, then the program
+ and a newline, then one line per argument:
+
+     14 1
+     _fun (x) x + 1
+     41
+
+ and answer each with one line, in the order they finish:
+
+     <request number> ok|error hit|miss <prepare us> <run us> <value or message>
+
+ where requests are numbered from 1 on each connection. */
+class Server {
+public:
+    struct Result {
+        bool ok;
+        // Whether the program was already in the cache
+        bool cached;
+        long prepare_us;
+        long run_us;
+        // The value printed, or what went wrong
+        std::string text;
+    };
+
+    // Longest program a request may send, in bytes. A longer one is badly
+    // framed, so a bad length cannot take all the memory
+    static long max_request;
+    // Most steps a request may take, or negative for no limit
+    static long max_steps;
+
+    // 0 workers makes one per core
+    Server(int workers, size_t cache_size = 64);
+    // Finishes the requests already submitted
+    ~Server();
+    Server(const Server &) = delete;
+    Server &operator=(const Server &) = delete;
+
+    // Runs a request on the calling thread
+    Result run(const std::string &source, const std::vector<std::string> &args);
+    // Queues a request for the pool, which calls `done` with its result
+    void submit(const std::string &source, const std::vector<std::string> &args,
+                std::function<void(const Result &)> done);
+    // Answers the requests read from `in` until it ends or one is badly
+    // framed, then waits for the last answer
+    void serve(std::istream &in, std::ostream &out);
+    // Serves each connection to a Unix domain socket at `path` as serve()
+    // does, each on its own thread. Returns once `max_connections` have
+    // been served, or never when it is negative
+    void listen(const std::string &path, long max_connections = -1);
+
+    long cache_hits();
+    long cache_misses();
+
+private:
+    struct Entry {
+        std::string source;
+        std::shared_ptr<Program> program;
+        std::list<unsigned long>::iterator place;
+    };
+
+    size_t cache_size;
+    std::mutex cache_lock;
+    // Held while a program is made, so one missed by several requests at
+    // once is only made once
+    std::mutex prepare_lock;
+    std::unordered_map<unsigned long, Entry> cache;
+    // Keys, most recently used first
+    std::list<unsigned long> recent;
+    long hits;
+    long misses;
+
+    std::mutex pool_lock;
+    std::condition_variable pool_ready;
+    std::deque<std::function<void()>> jobs;
+    std::vector<std::thread> pool;
+    bool stopping;
+
+    std::mutex connection_lock;
+    std::condition_variable connection_closed;
+    long open_connections;
+
+    std::shared_ptr<Program> prepare(const std::string &source, bool &cached);
+    std::shared_ptr<Program> find(unsigned long key, const std::string &source);
+    void work();
+};
+
+#endif /* server_hpp */
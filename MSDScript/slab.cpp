@@ -0,0 +1,228 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <mutex>
+#include <new>
+#include <thread>
+#include "slab.hpp"
+#include "catch.hpp"
+
+namespace {
+    const std::size_t page_size = 64 * 1024;
+    const std::size_t granule = 16;
+    const int size_classes = Slab::max_size / granule;
+    // Room for the page header, keeping blocks 16 byte aligned
+    const std::size_t header_size = 64;
+    
+    struct Block {
+        Block *next;
+    };
+    
+    // One thread's pages and free lists. Never deleted, so another thread
+    // can always hand a block back to it
+    struct Cache {
+        Block *free[size_classes];
+        std::atomic<Block*> remote[size_classes];
+        Cache *next_orphan;
+    };
+    
+    struct Page {
+        Cache *owner;
+    };
+    
+    std::mutex orphans_lock;
+    Cache *orphans = nullptr;
+    
+    thread_local Cache *current = nullptr;
+    thread_local bool exiting = false;
+    
+    // Leaves the thread's cache for the next thread when this one ends
+    struct CacheGuard {
+        ~CacheGuard() {
+            exiting = true;
+            if (current != nullptr) {
+                std::lock_guard<std::mutex> hold(orphans_lock);
+                current->next_orphan = orphans;
+                orphans = current;
+                current = nullptr;
+            }
+        }
+    };
+    thread_local CacheGuard guard;
+    
+    Cache *adopt() {
+        Cache *cache = nullptr;
+        {
+            std::lock_guard<std::mutex> hold(orphans_lock);
+            if (orphans != nullptr) {
+                cache = orphans;
+                orphans = cache->next_orphan;
+            }
+        }
+        if (cache == nullptr) {
+            cache = new Cache();
+            for (int i = 0; i < size_classes; i++) {
+                cache->free[i] = nullptr;
+                cache->remote[i].store(nullptr, std::memory_order_relaxed);
+            }
+        }
+        current = cache;
+        // Using the guard makes it run when the thread ends; a thread that
+        // is already ending keeps the cache
+        if (!exiting)
+            (void)&guard;
+        return cache;
+    }
+    
+    // Carves a new page into blocks of one size class
+    Block *new_page(Cache *cache, int size_class) {
+        void *mem = nullptr;
+        if (posix_memalign(&mem, page_size, page_size) != 0)
+            throw std::bad_alloc();
+        ((Page *)mem)->owner = cache;
+        std::size_t block_size = (size_class + 1) * granule;
+        char *start = (char *)mem + header_size;
+        std::size_t count = (page_size - header_size) / block_size;
+        for (std::size_t i = 0; i + 1 < count; i++)
+            ((Block *)(start + i * block_size))->next = (Block *)(start + (i + 1) * block_size);
+        ((Block *)(start + (count - 1) * block_size))->next = nullptr;
+        return (Block *)start;
+    }
+}
+
+void *Slab::allocate(std::size_t size) {
+    if (size > max_size)
+        return ::operator new(size);
+    int size_class = (int)((size + granule - 1) / granule) - 1;
+    Cache *cache = (current != nullptr ? current : adopt());
+    Block *block = cache->free[size_class];
+    if (block == nullptr) {
+        block = cache->remote[size_class].exchange(nullptr, std::memory_order_acquire);
+        if (block == nullptr)
+            block = new_page(cache, size_class);
+    }
+    cache->free[size_class] = block->next;
+    return block;
+}
+
+void Slab::deallocate(void *p, std::size_t size) {
+    if (size > max_size) {
+        ::operator delete(p);
+        return;
+    }
+    int size_class = (int)((size + granule - 1) / granule) - 1;
+    Cache *owner = ((Page *)((std::uintptr_t)p & ~(std::uintptr_t)(page_size - 1)))->owner;
+    Block *block = (Block *)p;
+    if (owner == current) {
+        block->next = owner->free[size_class];
+        owner->free[size_class] = block;
+        return;
+    }
+    std::atomic<Block*> &remote = owner->remote[size_class];
+    Block *head = remote.load(std::memory_order_relaxed);
+    do {
+        block->next = head;
+    } while (!remote.compare_exchange_weak(head, block, std::memory_order_release, std::memory_order_relaxed));
+}
+
+namespace {
+    // Sizes of NumVal, ExtendedEnv, FunVal and a typical Cont
+    const std::size_t bench_sizes[] = { 24, 48, 72, 56 };
+    const int batch = 1000;
+    
+    // Each round allocates a batch, swaps it with a neighbour's and
+    // frees what it got back, so with more than one thread every block
+    // is freed by a thread that did not allocate it
+    template <typename Alloc, typename Free>
+    double bench_run(int threads, long rounds, Alloc alloc, Free release) {
+        std::vector<std::atomic<std::vector<void*>*>> slots(threads);
+        for (auto &slot : slots)
+            slot.store(nullptr);
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.push_back(std::thread([&, t]() {
+                for (long r = 0; r < rounds; r++) {
+                    std::vector<void*> *mine = new std::vector<void*>(batch);
+                    for (int i = 0; i < batch; i++)
+                        (*mine)[i] = alloc(bench_sizes[i % 4]);
+                    std::vector<void*> *theirs = slots[(t + 1) % threads].exchange(mine);
+                    if (theirs != nullptr) {
+                        for (int i = 0; i < batch; i++)
+                            release((*theirs)[i], bench_sizes[i % 4]);
+                        delete theirs;
+                    }
+                }
+            }));
+        }
+        for (std::thread &w : workers)
+            w.join();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        for (auto &slot : slots) {
+            std::vector<void*> *left = slot.exchange(nullptr);
+            if (left != nullptr) {
+                for (int i = 0; i < batch; i++)
+                    release((*left)[i], bench_sizes[i % 4]);
+                delete left;
+            }
+        }
+        return (double)threads * rounds * batch / elapsed.count() / 1e6;
+    }
+}
+
+void Slab::benchmark(std::ostream &out, const std::vector<int> &threads) {
+    const long rounds = 2000;
+    out << "threads   slab Mallocs/s   new Mallocs/s" << std::endl;
+    for (int n : threads) {
+        double slab = bench_run(n, rounds,
+                                [](std::size_t size) { return Slab::allocate(size); },
+                                [](void *p, std::size_t size) { Slab::deallocate(p, size); });
+        double plain = bench_run(n, rounds,
+                                 [](std::size_t size) { return ::operator new(size); },
+                                 [](void *p, std::size_t size) { ::operator delete(p); });
+        out << std::setw(7) << n << std::setw(17) << std::fixed << std::setprecision(1) << slab
+            << std::setw(16) << plain << std::endl;
+    }
+}
+
+TEST_CASE( "Slab" ) {
+    SECTION( "Blocks are reused" ) {
+        void *a = Slab::allocate(40);
+        Slab::deallocate(a, 40);
+        CHECK( Slab::allocate(33) == a );
+        Slab::deallocate(a, 48);
+        void *b = Slab::allocate(16);
+        void *c = Slab::allocate(16);
+        CHECK( b != c );
+        CHECK( ((std::uintptr_t)b % 16) == 0 );
+        Slab::deallocate(b, 16);
+        Slab::deallocate(c, 16);
+    }
+    SECTION( "Frees from other threads" ) {
+        // No object is this big, so nothing else has used its free list
+        std::vector<void*> blocks;
+        for (int i = 0; i < 5000; i++)
+            blocks.push_back(Slab::allocate(200));
+        std::thread other([&]() {
+            for (void *p : blocks)
+                Slab::deallocate(p, 200);
+        });
+        other.join();
+        // The blocks come back to this thread once its own list is empty
+        std::vector<void*> again;
+        bool reused = false;
+        for (int i = 0; i < 10000 && !reused; i++) {
+            again.push_back(Slab::allocate(200));
+            reused = (again.back() == blocks[4999]);
+        }
+        CHECK( reused );
+        for (void *p : again)
+            Slab::deallocate(p, 200);
+    }
+    SECTION( "Big objects" ) {
+        void *p = Slab::allocate(Slab::max_size + 1);
+        Slab::deallocate(p, Slab::max_size + 1);
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef slab_hpp
+#define slab_hpp
+
+#include <cstddef>
+#include <iostream>
+#include <vector>
+
+/* Size-class slab allocator for the small objects the interpreter makes
+ most: every Val, Env and Cont is allocated here through Collectable's
+ operator new. Sizes are rounded up to 16 bytes, and each thread carves
+ blocks of one size out of its own 64KB pages, so allocating and freeing
+ on the thread that owns a page takes no lock and no atomic operation.
+ A block freed by another thread goes on a lock-free list belonging to
+ the owning thread, which takes the whole list back the next time it
+ runs out. When a thread exits its pages are kept, with any objects
+ still alive in them, for the next thread that starts. Pages are never
+ given back to the system; anything over `max_size` uses plain new. */
+class Slab {
+public:
+    static const std::size_t max_size = 256;
+    
+    static void *allocate(std::size_t size);
+    static void deallocate(void *p, std::size_t size);
+    
+    // Allocation throughput with the slabs and with plain new at each
+    // thread count, with some frees made by other threads
+    static void benchmark(std::ostream &out, const std::vector<int> &threads);
+};
+
+#endif /* slab_hpp */
@@ -1,36 +1,85 @@
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
 #include "step.hpp"
 #include "expr.hpp"
 #include "cont.hpp"
 #include "env.hpp"
 #include "value.hpp"
+#include "future.hpp"
+#include "parse.hpp"
 #include "catch.hpp"
 
-Step::mode_t Step::mode;
+thread_local Step::Registers *Step::regs = nullptr;
 
-PTR(Cont) Step::cont;
-PTR(Expr) Step::expr;
-PTR(Val) Step::val;
-PTR(Env) Step::env;
+thread_local int Step::interp_depth = 0;
+int Step::max_interp_depth = 1000;
 
 PTR(Val) Step::interp_by_steps(PTR(Expr) e) {
-    Step::mode = Step::interp_mode;
-    Step::expr = e;
-    Step::env = NEW(EmptyEnv)();
-    Step::val = nullptr;
-    Step::cont = Cont::done;
-    while (1) {
-        if (Step::mode == Step::interp_mode) {
-            Step::expr->step_interp();
+    return interp_by_steps(e, -1);
+}
+
+PTR(Val) Step::interp_by_steps(PTR(Expr) e, long max_steps) {
+    return interp_by_steps(e, NEW(EmptyEnv)(), max_steps);
+}
+
+PTR(Val) Step::interp_by_steps(PTR(Expr) e, PTR(Env) env, long max_steps) {
+    Registers state;
+    start(state, e, env);
+    resume(state, max_steps);
+    if (!done(state))
+        throw std::runtime_error("out of fuel");
+    return state.val;
+}
+
+void Step::start(Registers &state, PTR(Expr) e, PTR(Env) env) {
+    state.mode = Step::interp_mode;
+    state.expr = e;
+    state.env = env;
+    state.val = nullptr;
+    state.cont = Cont::done;
+}
+
+bool Step::done(const Registers &state) {
+    return state.mode == Step::continue_mode && state.cont == Cont::done;
+}
+
+long Step::resume(Registers &state, long max_steps) {
+    if (Step::regs == nullptr) {
+        // Frees this thread's registers when it exits
+        static thread_local std::unique_ptr<Registers> owned;
+        owned.reset(new Registers());
+        Step::regs = owned.get();
+    }
+    Registers &regs = *Step::regs;
+    // A run on this thread may be waiting inside another, as when an
+    // _await runs its future in place, so the outer one gets its
+    // registers back when this one pauses, ends or throws. Swapped, to
+    // count no references
+    struct Swap {
+        Registers &a;
+        Registers &b;
+        Swap(Registers &a, Registers &b) : a(a), b(b) { std::swap(a, b); }
+        ~Swap() { std::swap(a, b); }
+    } swap(regs, state);
+    long steps = 0;
+    while (max_steps < 0 || steps < max_steps) {
+        steps++;
+        GC::safe_point();
+        Future::poll();
+        if (regs.mode == Step::interp_mode) {
+            regs.expr->step_interp();
         } else {
-            if (Step::cont == Cont::done) {
-                return Step::val;
+            if (regs.cont == Cont::done) {
+                break;
             } else {
-                Step::cont->step_continue();
+                regs.cont->step_continue();
             }
             
         }
     }
-    
+    return steps;
 }
 
 TEST_CASE( "Step Interp" ) {
@@ -88,4 +137,28 @@ TEST_CASE( "Step Interp" ) {
         CHECK( (Step::interp_by_steps(NEW(FunExpr)("x", NEW(AddExpr)(NEW(NumExpr)(4), NEW(VarExpr)("x")))))
               ->equals(NEW(FunVal)("x", NEW(AddExpr)(NEW(NumExpr)(4), NEW(VarExpr)("x")), NEW(EmptyEnv)())));
     }
+    SECTION( "Hand-off from interp" ) {
+        PTR(Expr) count = parse_str("_let count = _fun (count) _fun (n) _if n == 0 _then 0 _else 1 + count(count)(n + -1) _in count(count)(100000)");
+        CHECK( count->interp(NEW(EmptyEnv)())
+              ->equals(NEW(NumVal)(100000)) );
+        CHECK( Step::interp_depth == 0 );
+        int saved_depth = Step::max_interp_depth;
+        Step::max_interp_depth = 3;
+        std::istringstream fib_in("_let fib = _fun (fib) _fun (x) _if x == 0 _then 1 _else _if x == 1 _then 1 _else fib(fib)(x + -1) + fib(fib)(x + -2) _in fib(fib)(10)");
+        CHECK( parse(fib_in)->interp(NEW(EmptyEnv)())
+              ->equals(NEW(NumVal)(89)) );
+        std::istringstream bad_in("_let f = _fun (f) _fun (n) _if n == 0 _then _true + 1 _else f(f)(n + -1) _in f(f)(2)");
+        CHECK_THROWS_WITH( parse(bad_in)->interp(NEW(EmptyEnv)()), "no adding booleans" );
+        CHECK( Step::interp_depth == 0 );
+        Step::max_interp_depth = saved_depth;
+    }
+    SECTION( "Fuel" ) {
+        PTR(Expr) sum = NEW(AddExpr)(NEW(NumExpr)(3), NEW(NumExpr)(2));
+        CHECK( (Step::interp_by_steps(sum, 10))
+              ->equals(NEW(NumVal)(5)));
+        CHECK_THROWS_WITH( Step::interp_by_steps(sum, 3), "out of fuel" );
+        PTR(Expr) loop = NEW(CallExpr)(NEW(FunExpr)("f", NEW(CallExpr)(NEW(VarExpr)("f"), NEW(VarExpr)("f"))),
+                                       NEW(FunExpr)("f", NEW(CallExpr)(NEW(VarExpr)("f"), NEW(VarExpr)("f"))));
+        CHECK_THROWS_WITH( Step::interp_by_steps(loop, 1000), "out of fuel" );
+    }
 }
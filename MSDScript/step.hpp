@@ -15,12 +15,37 @@ public:
         continue_mode
     } mode_t;
     
-    static mode_t mode;
-    static PTR(Expr) expr;
-    static PTR(Env) env;
-    static PTR(Val) val;
-    static PTR(Cont) cont;
+    struct Registers {
+        mode_t mode = interp_mode;
+        // Spelled out for MSD_PTR_RAW, where pointers start uninitialized
+        PTR(Expr) expr = nullptr;
+        PTR(Env) env = nullptr;
+        PTR(Val) val = nullptr;
+        PTR(Cont) cont = nullptr;
+    };
+    // Each thread steps with its own registers, made by its first
+    // interp_by_steps(). A plain pointer, so reaching them costs no
+    // thread_local initialization check
+    static thread_local Registers *regs;
     static PTR(Val) interp_by_steps(PTR(Expr) e);
+    // Throws "out of fuel" after `max_steps` steps
+    static PTR(Val) interp_by_steps(PTR(Expr) e, long max_steps);
+    static PTR(Val) interp_by_steps(PTR(Expr) e, PTR(Env) env, long max_steps);
+    
+    // A paused evaluation is a set of registers kept outside `regs`.
+    // start() sets one up to evaluate `e` in `env`, and resume() runs it
+    // for at most `max_steps` steps, or to the end when negative,
+    // returning how many it took. It has finished once done() says so,
+    // with its value in `val`
+    static void start(Registers &state, PTR(Expr) e, PTR(Env) env);
+    static long resume(Registers &state, long max_steps);
+    static bool done(const Registers &state);
+    
+    // interp() counts nested function calls in `interp_depth`; a call
+    // nested deeper than `max_interp_depth` runs its body here instead,
+    // so deep recursion finishes without overflowing the C++ stack
+    static thread_local int interp_depth;
+    static int max_interp_depth;
 };
 
 #endif /* step_hpp */
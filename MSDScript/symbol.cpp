@@ -0,0 +1,73 @@
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include "symbol.hpp"
+#include "catch.hpp"
+
+// Names live in a deque so references handed out by str() stay valid as
+// more are added. Interning is locked, but str() and comparisons never
+// touch the table, so evaluation does not contend on it
+namespace {
+    struct SymbolTable {
+        std::mutex lock;
+        std::deque<std::string> names;
+        std::unordered_map<std::string, int> ids;
+        const std::string *empty;
+        
+        // The empty name is always id 0, so a default Symbol needs no lock
+        SymbolTable() {
+            names.push_back("");
+            ids.emplace("", 0);
+            empty = &names[0];
+        }
+    };
+    
+    SymbolTable &table() {
+        static SymbolTable *t = new SymbolTable();
+        return *t;
+    }
+}
+
+Symbol::Symbol() {
+    sym_id = 0;
+    text = table().empty;
+}
+
+Symbol::Symbol(const char *name) : Symbol(std::string(name)) { }
+
+Symbol::Symbol(const std::string &name) {
+    SymbolTable &t = table();
+    std::lock_guard<std::mutex> guard(t.lock);
+    auto found = t.ids.find(name);
+    if (found == t.ids.end()) {
+        sym_id = (int)t.names.size();
+        t.names.push_back(name);
+        t.ids.emplace(name, sym_id);
+    } else {
+        sym_id = found->second;
+    }
+    text = &t.names[sym_id];
+}
+
+int Symbol::count() {
+    SymbolTable &t = table();
+    std::lock_guard<std::mutex> guard(t.lock);
+    return (int)t.names.size();
+}
+
+TEST_CASE( "Symbol" ) {
+    Symbol a("apple");
+    Symbol b(std::string("app") + "le");
+    Symbol c("banana");
+    CHECK( a == b );
+    CHECK( a.id() == b.id() );
+    CHECK( &a.str() == &b.str() );
+    CHECK( a != c );
+    CHECK( a < c );
+    CHECK( a.str() == "apple" );
+    CHECK( (std::string)c == "banana" );
+    int before = Symbol::count();
+    Symbol again("banana");
+    CHECK( Symbol::count() == before );
+    CHECK( std::hash<Symbol>()(again) == std::hash<Symbol>()(c) );
+}
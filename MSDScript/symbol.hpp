@@ -0,0 +1,40 @@
+#ifndef symbol_hpp
+#define symbol_hpp
+
+#include <functional>
+#include <string>
+
+// An interned variable name. Every distinct spelling is stored once and
+// gets a small integer id, so copying a Symbol copies no characters and
+// comparing two Symbols compares their ids
+class Symbol {
+public:
+    Symbol();
+    Symbol(const std::string &name);
+    Symbol(const char *name);
+    
+    int id() const { return sym_id; }
+    const std::string &str() const { return *text; }
+    operator const std::string &() const { return *text; }
+    
+    bool operator==(const Symbol &other) const { return sym_id == other.sym_id; }
+    bool operator!=(const Symbol &other) const { return sym_id != other.sym_id; }
+    // Orders by spelling, so sorted output does not depend on the order
+    // names were first seen
+    bool operator<(const Symbol &other) const { return *text < *other.text; }
+    
+    // Number of distinct names interned so far
+    static int count();
+    
+private:
+    int sym_id;
+    const std::string *text;
+};
+
+namespace std {
+    template <> struct hash<Symbol> {
+        size_t operator()(const Symbol &s) const { return std::hash<int>()(s.id()); }
+    };
+}
+
+#endif /* symbol_hpp */
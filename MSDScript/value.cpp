@@ -4,6 +4,10 @@
 #include "expr.hpp"
 #include "env.hpp"
 #include "step.hpp"
+#include "profile.hpp"
+#include "jit.hpp"
+#include "parallel.hpp"
+#include "future.hpp"
 
 NumVal::NumVal(int rep) {
     this->rep = rep;
@@ -98,10 +102,12 @@ std::string BoolVal::to_string() {
         return "_false";
 }
 
-FunVal::FunVal(std::string arg, PTR(Expr) body, PTR(Env) env) {
+FunVal::FunVal(Symbol arg, PTR(Expr) body, PTR(Env) env) {
     this->formal_arg = arg;
     this->body = body;
     this->env = env;
+    this->stack_frame = false;
+    this->jit = nullptr;
 }
 
 bool FunVal::equals(PTR(Val) other_val) {
@@ -124,15 +130,66 @@ PTR(Val) FunVal::mult_with(PTR(Val) other_val) {
     throw std::runtime_error("no multiplying functions");
 }
 
+void FunVal::gc_children(std::vector<Collectable*> &out) {
+    gc_child(out, env);
+}
+
+void FunVal::gc_clear() {
+    env = nullptr;
+}
+
+namespace {
+    // Keeps Step::interp_depth right when a call throws
+    struct DepthGuard {
+        DepthGuard() { Step::interp_depth++; }
+        ~DepthGuard() { Step::interp_depth--; }
+    };
+
+    // Ends a function's time in the profile even when the call throws
+    struct ProfileGuard {
+        int id;
+        ProfileGuard(Expr *body) { id = Profile::current->enter_function(body); }
+        ~ProfileGuard() {
+            if (Profile::current != nullptr)
+                Profile::current->exit_function(id);
+        }
+    };
+}
+
 PTR(Val) FunVal::call(PTR(Val) actual_arg) {
+    GC::safe_point();
+    Future::poll();
+    // Native code cannot fork, so it waits until a thread is too many
+    // forks deep to fork again
+    if (jit != nullptr && Profile::current == nullptr && !Parallel::may_fork()) {
+        PTR(Val) result;
+        if (jit->try_call(env, actual_arg, result))
+            return result;
+    }
+    if (Profile::current != nullptr) {
+        ProfileGuard guard(&*body);
+        return call_body(actual_arg);
+    }
+    return call_body(actual_arg);
+}
+
+PTR(Val) FunVal::call_body(PTR(Val) actual_arg) {
+    if (Step::interp_depth >= Step::max_interp_depth)
+        return Step::interp_by_steps(body, NEW(ExtendedEnv)(formal_arg, actual_arg, env), -1);
+    DepthGuard guard;
+    if (stack_frame) {
+        ExtendedEnv frame(formal_arg, actual_arg, env);
+        return body->interp(BORROW(Env, frame));
+    }
     return body->interp(NEW(ExtendedEnv)(formal_arg, actual_arg, env));
 }
 
 void FunVal::call_step(PTR(Val) actual_arg, PTR(Cont) rest) {
-    Step::mode = Step::interp_mode;
-    Step::expr = body;
-    Step::env = NEW(ExtendedEnv)(formal_arg, actual_arg, env);
-    Step::cont = rest;
+    Step::Registers &regs = *Step::regs;
+    regs.mode = Step::interp_mode;
+    regs.expr = body;
+    regs.env = NEW(ExtendedEnv)(formal_arg, actual_arg, env);
+    regs.cont = rest;
 }
 
 PTR(Expr) FunVal::to_expr() {
@@ -140,7 +197,57 @@ PTR(Expr) FunVal::to_expr() {
 }
 
 std::string FunVal::to_string() {
-    return "_fun (" + this->formal_arg + ") " + this->body->to_string();
+    return "_fun (" + this->formal_arg.str() + ") " + this->body->to_string();
+}
+
+FutureVal::FutureVal(std::shared_ptr<Future> future) {
+    this->future = future;
+}
+
+bool FutureVal::equals(PTR(Val) other_val) {
+    PTR(FutureVal) other_future_val = CAST(FutureVal)(other_val);
+    if (other_future_val == nullptr)
+        return false;
+    else if (future == other_future_val->future)
+        return true;
+    else
+        return future->await()->equals(other_future_val->future->await());
+}
+
+bool FutureVal::is_true() {
+    throw std::runtime_error("futures cannot be true/false");
+}
+
+PTR(Val) FutureVal::add_to(PTR(Val) other_val) {
+    throw std::runtime_error("no adding futures");
+}
+
+PTR(Val) FutureVal::mult_with(PTR(Val) other_val) {
+    throw std::runtime_error("no multiplying futures");
+}
+
+PTR(Val) FutureVal::call(PTR(Val) actual_arg) {
+    throw std::runtime_error("cannot call on a future");
+}
+
+void FutureVal::call_step(PTR(Val) actual_arg, PTR(Cont) rest) {
+    throw std::runtime_error("cannot call on a future");
+}
+
+// Would have to wait for a value that may never come
+PTR(Expr) FutureVal::to_expr() {
+    throw std::runtime_error("cannot turn a future into an expression");
+}
+
+std::string FutureVal::to_string() {
+    return "_spawn " + future->await()->to_string();
+}
+
+PTR(Val) FutureVal::await(PTR(Val) val) {
+    PTR(FutureVal) future_val = CAST(FutureVal)(val);
+    if (future_val == nullptr)
+        throw std::runtime_error("not a future");
+    return future_val->future->await();
 }
 
 TEST_CASE( "values equals" ) {
@@ -281,3 +388,50 @@ TEST_CASE ( "call" ) {
               ->equals(NEW(NumVal)(5)));
     }
 }
+
+#if MSD_PTR_MODE == MSD_PTR_COUNTED
+namespace {
+    // Counts how many are alive, to see when the last reference frees one
+    class CountedVal : public NumVal {
+    public:
+        static int alive;
+        CountedVal(int rep) : NumVal(rep) { alive++; }
+        CountedVal(const CountedVal &other) : NumVal(other) { alive++; }
+        ~CountedVal() { alive--; }
+    };
+    int CountedVal::alive = 0;
+}
+
+TEST_CASE( "Reference counts" ) {
+    SECTION( "Last reference frees" ) {
+        {
+            PTR(Val) a = NEW(CountedVal)(1);
+            PTR(Val) b = a;
+            CHECK( a->msd_refs == 2 );
+            a = nullptr;
+            CHECK( CountedVal::alive == 1 );
+            PTR(NumVal) c = CAST(NumVal)(b);
+            CHECK( c->msd_refs == 2 );
+            b.reset();
+            CHECK( CountedVal::alive == 1 );
+        }
+        CHECK( CountedVal::alive == 0 );
+    }
+    SECTION( "Copies start with no references" ) {
+        PTR(CountedVal) a = NEW(CountedVal)(1);
+        PTR(Val) b = NEW(CountedVal)(*a);
+        CHECK( a->msd_refs == 1 );
+        CHECK( b->msd_refs == 1 );
+    }
+    SECTION( "Borrowed objects are never freed" ) {
+        CountedVal local(3);
+        {
+            PTR(Val) a = BORROW(Val, local);
+            PTR(Val) b = a;
+        }
+        CHECK( CountedVal::alive == 1 );
+        CHECK( local.msd_refs == 1 );
+    }
+    CHECK( CountedVal::alive == 0 );
+}
+#endif
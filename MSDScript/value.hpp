@@ -2,15 +2,19 @@
 #define value_hpp
 
 #include <iostream>
+#include <typeinfo>
 #include "macros.hpp"
+#include "symbol.hpp"
+#include "jit.hpp"
 #include "cont.hpp"
+#include "gc.hpp"
 
 /* A forward declaration, so `Val` can refer to `Expr`, while
  `Expr` still needs to refer to `Val`. */
 class Expr;
 class Env;
 
-class Val ENABLE_THIS(Val){
+class Val COLLECTABLE(Val) {
 public:
     virtual bool equals(PTR(Val) val) = 0;
     virtual bool is_true() = 0;
@@ -39,6 +43,14 @@ public:
     void call_step(PTR(Val) actual_arg, PTR(Cont) rest);
 };
 
+// The type guard used by specialized code: an exact type check, cheaper
+// than a dynamic cast
+inline NumVal *as_num(PTR(Val) const &v) {
+    if (typeid(*v) == typeid(NumVal))
+        return static_cast<NumVal *>(&*v);
+    return nullptr;
+}
+
 class BoolVal : public Val {
 public:
     bool rep;
@@ -58,12 +70,18 @@ public:
 
 class FunVal : public Val {
 public:
-    std::string formal_arg;
+    Symbol formal_arg;
     PTR(Expr) body;
     PTR(Env) env;
+    // Copied from FunExpr::stack_frame
+    bool stack_frame;
+    // Shared by every closure of the same FunExpr
+    PTR(JitEntry) jit;
     
-    FunVal(std::string arg, PTR(Expr) body, PTR(Env) env);
+    FunVal(Symbol arg, PTR(Expr) body, PTR(Env) env);
     bool equals(PTR(Val) val);
+    void gc_children(std::vector<Collectable*> &out);
+    void gc_clear();
     bool is_true();
     
     PTR(Val) add_to(PTR(Val) other_val);
@@ -72,6 +90,32 @@ public:
     void call_step(PTR(Val) actual_arg, PTR(Cont) rest);
     PTR(Expr) to_expr();
     std::string to_string();
+    
+private:
+    PTR(Val) call_body(PTR(Val) actual_arg);
+};
+
+class Future;
+
+// The value of a _spawn. Two futures are equal when their values are, so
+// comparing one waits for it
+class FutureVal : public Val {
+public:
+    std::shared_ptr<Future> future;
+    
+    FutureVal(std::shared_ptr<Future> future);
+    bool equals(PTR(Val) val);
+    bool is_true();
+    
+    PTR(Val) add_to(PTR(Val) other_val);
+    PTR(Val) mult_with(PTR(Val) other_val);
+    PTR(Val) call(PTR(Val) actual_arg);
+    void call_step(PTR(Val) actual_arg, PTR(Cont) rest);
+    PTR(Expr) to_expr();
+    std::string to_string();
+    
+    // The value of `val`, which _await requires to be a FutureVal
+    static PTR(Val) await(PTR(Val) val);
 };
 
 #endif /* value_hpp */